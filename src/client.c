@@ -15,16 +15,22 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "client.h"
 
-int bcc_send_fd(int sock, int fd) {
-  ssize_t size;
-  int cl = -1;
+int bcc_send_fd_to(int cl, int fd) {
   union {
     struct cmsghdr cmsghdr;
     char control[CMSG_SPACE(sizeof(int))];
@@ -43,39 +49,39 @@ int bcc_send_fd(int sock, int fd) {
     .msg_namelen = 0,
   };
 
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  *((int *)CMSG_DATA(cmsg)) = fd;
+
+  if (sendmsg(cl, &msg, 0) < 0) {
+    perror("sendmsg");
+    return -1;
+  }
+  return 0;
+}
+
+int bcc_send_fd(int sock, int fd) {
+  int cl;
   for (;;) {
     cl = accept(sock, NULL, NULL);
     if (cl < 0) {
       // ignore errors when the parent calls shutdown(sock)
       if (errno != EINVAL)
         perror("accept");
-      goto cleanup;
-    }
-
-    cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    *((int *)CMSG_DATA(cmsg)) = fd;
-
-    size = sendmsg(cl, &msg, 0);
-    if (size < 0) {
-      perror("sendmsg");
-      //goto cleanup;
+      return 0;
     }
+    bcc_send_fd_to(cl, fd);
     close(cl);
-    cl = -1;
   }
-
-cleanup:
-  if (cl >= 0)
-    close(cl);
-  return 0;
 }
 
+#define CONNECT_RETRIES 100
+#define CONNECT_RETRY_USEC 10000
 int bcc_recv_fd(const char *path) {
   ssize_t size;
-  int fd = -1, sock = -1;
+  int fd = -1, sock = -1, retries;
   union {
     struct cmsghdr cmsghdr;
     char control[CMSG_SPACE(sizeof(int))];
@@ -107,9 +113,13 @@ int bcc_recv_fd(const char *path) {
   addr.sun_family = AF_UNIX;
   strncpy(addr.sun_path, path, sizeof(addr.sun_path));
 
-  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-    perror("connect");
-    goto cleanup;
+  // the socket of an fd that was just loaded may still be on its way
+  for (retries = 0; connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0; ++retries) {
+    if ((errno != ENOENT && errno != ECONNREFUSED) || retries == CONNECT_RETRIES) {
+      perror("connect");
+      goto cleanup;
+    }
+    usleep(CONNECT_RETRY_USEC);
   }
 
   size = recvmsg(sock, &msg, 0);
@@ -139,3 +149,251 @@ cleanup:
 
   return fd;
 }
+
+static size_t snapshot_size(const struct bcc_snapshot *snap) {
+  return sizeof(*snap) + snap->capacity * (snap->key_size + snap->leaf_size);
+}
+
+const struct bcc_snapshot * bcc_snapshot_open(const char *path) {
+  const struct bcc_snapshot *snap;
+  int fd = bcc_recv_fd(path);
+  if (fd < 0)
+    return NULL;
+  snap = bcc_snapshot_map(fd);
+  close(fd);
+  return snap;
+}
+
+const struct bcc_snapshot * bcc_snapshot_map(int fd) {
+  struct stat st;
+  void *mem;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct bcc_snapshot)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+  if (snapshot_size(mem) > (size_t)st.st_size) {
+    munmap(mem, st.st_size);
+    errno = EINVAL;
+    return NULL;
+  }
+  return mem;
+}
+
+void bcc_snapshot_close(const struct bcc_snapshot *snap) {
+  if (snap)
+    munmap((void *)snap, snapshot_size(snap));
+}
+
+long bcc_snapshot_read(const struct bcc_snapshot *snap, void *buf, size_t size,
+                       uint64_t *generation) {
+  size_t rsize = snap->key_size + snap->leaf_size;
+  uint32_t seq;
+  uint64_t count, gen;
+  for (;;) {
+    seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+    count = snap->count;
+    gen = snap->generation;
+    if (count > snap->capacity)
+      continue;
+    if (count * rsize > size) {
+      errno = ENOSPC;
+      return -1;
+    }
+    memcpy(buf, snap + 1, count * rsize);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&snap->seq, __ATOMIC_RELAXED) == seq)
+      break;
+  }
+  if (generation)
+    *generation = gen;
+  return count;
+}
+
+int bcc_snapshot_wait(const struct bcc_snapshot *snap, uint64_t generation, int timeout_ms) {
+  struct timespec deadline, left, *timeout = NULL;
+  uint32_t seq;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    ++deadline.tv_sec;
+    deadline.tv_nsec -= 1000000000;
+  }
+  for (;;) {
+    seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE);
+    if (!(seq & 1) && __atomic_load_n(&snap->generation, __ATOMIC_RELAXED) > generation)
+      return 0;
+    if (__atomic_load_n(&snap->flags, __ATOMIC_RELAXED) & BCC_SNAPSHOT_CLOSED) {
+      errno = EPIPE;
+      return -1;
+    }
+    if (timeout_ms >= 0) {
+      clock_gettime(CLOCK_MONOTONIC, &left);
+      left.tv_sec = deadline.tv_sec - left.tv_sec;
+      left.tv_nsec = deadline.tv_nsec - left.tv_nsec;
+      if (left.tv_nsec < 0) {
+        --left.tv_sec;
+        left.tv_nsec += 1000000000;
+      }
+      if (left.tv_sec < 0) {
+        errno = ETIMEDOUT;
+        return -1;
+      }
+      timeout = &left;
+    }
+    // returns at once if seq moved on since it was read
+    syscall(SYS_futex, &snap->seq, FUTEX_WAIT, seq, timeout, NULL, 0);
+  }
+}
+
+union map_io_buf {
+  struct bcc_map_io io;
+  uint8_t bytes[BCC_MAP_IO_MAX];
+};
+
+static int map_io_fits(size_t len) {
+  if (len > BCC_MAP_IO_MAX - sizeof(struct bcc_map_io)) {
+    errno = E2BIG;
+    return 0;
+  }
+  return 1;
+}
+
+// send the header and len bytes of data, the daemon answers in place
+static long map_io(int fd, int op, union map_io_buf *buf, size_t key_size, size_t leaf_size,
+                   uint32_t count, uint32_t flags, size_t len) {
+  buf->io.key_size = key_size;
+  buf->io.leaf_size = leaf_size;
+  buf->io.count = count;
+  buf->io.flags = flags;
+  if (ioctl(fd, BCC_MAP_IO(op, sizeof(buf->io) + len), &buf->io) < 0)
+    return -1;
+  return buf->io.count;
+}
+
+int bcc_map_lookup(int fd, const void *key, size_t key_size, void *leaf, size_t leaf_size) {
+  union map_io_buf buf;
+  size_t len = key_size > leaf_size ? key_size : leaf_size;
+  if (!map_io_fits(len))
+    return -1;
+  memcpy(buf.io.data, key, key_size);
+  if (map_io(fd, BCC_MAP_LOOKUP, &buf, key_size, leaf_size, 1, 0, len) < 0)
+    return -1;
+  memcpy(leaf, buf.io.data, leaf_size);
+  return 0;
+}
+
+int bcc_map_update(int fd, const void *key, size_t key_size, const void *leaf,
+                   size_t leaf_size, uint32_t flags) {
+  union map_io_buf buf;
+  if (!map_io_fits(key_size + leaf_size))
+    return -1;
+  memcpy(buf.io.data, key, key_size);
+  memcpy(buf.io.data + key_size, leaf, leaf_size);
+  return map_io(fd, BCC_MAP_UPDATE, &buf, key_size, leaf_size, 1, flags,
+                key_size + leaf_size) < 0 ? -1 : 0;
+}
+
+int bcc_map_delete(int fd, const void *key, size_t key_size, size_t leaf_size) {
+  union map_io_buf buf;
+  if (!map_io_fits(key_size))
+    return -1;
+  memcpy(buf.io.data, key, key_size);
+  return map_io(fd, BCC_MAP_DELETE, &buf, key_size, leaf_size, 1, 0, key_size) < 0 ? -1 : 0;
+}
+
+long bcc_map_lookup_batch(int fd, const void *keys, size_t key_size, void *leaves,
+                          size_t leaf_size, uint8_t *found, size_t count) {
+  union map_io_buf buf;
+  size_t max = BCC_MAP_BATCH_MAX(key_size, leaf_size), total = 0;
+  while (count) {
+    size_t n = count < max ? count : max;
+    long rc;
+    if (!n) {
+      errno = E2BIG;
+      return -1;
+    }
+    memcpy(buf.io.data, keys, n * key_size);
+    rc = map_io(fd, BCC_MAP_LOOKUP_BATCH, &buf, key_size, leaf_size, n, 0,
+                n * (key_size + 1 + leaf_size));
+    if (rc < 0)
+      return -1;
+    memcpy(found, buf.io.data + n * key_size, n);
+    memcpy(leaves, buf.io.data + n * (key_size + 1), n * leaf_size);
+    keys = (const uint8_t *)keys + n * key_size;
+    leaves = (uint8_t *)leaves + n * leaf_size;
+    found += n;
+    count -= n;
+    total += rc;
+  }
+  return total;
+}
+
+int bcc_array_layout(const char *text, struct bcc_array *array) {
+  char name[32];
+  size_t value, offset = 0;
+  int n;
+  memset(array, 0, sizeof(*array));
+  while (sscanf(text, "%31s %zu\n%n", name, &value, &n) == 2) {
+    if (!strcmp(name, "offset"))
+      offset = value;
+    else if (!strcmp(name, "stride"))
+      array->stride = value;
+    else if (!strcmp(name, "leaf_size"))
+      array->leaf_size = value;
+    else if (!strcmp(name, "max_entries"))
+      array->max_entries = value;
+    else if (!strcmp(name, "size"))
+      array->size = value;
+    text += n;
+  }
+  if (offset || !array->size || array->stride < array->leaf_size ||
+      array->stride * array->max_entries > array->size) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+int bcc_array_map(int fd, struct bcc_array *array) {
+  void *mem = mmap(NULL, array->size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED)
+    return -1;
+  array->data = mem;
+  return 0;
+}
+
+int bcc_array_open(const char *dir, struct bcc_array *array) {
+  char path[4096], text[256];
+  ssize_t size;
+  int fd, rc;
+  snprintf(path, sizeof(path), "%s/layout", dir);
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  size = read(fd, text, sizeof(text) - 1);
+  close(fd);
+  if (size < 0)
+    return -1;
+  text[size] = 0;
+  if (bcc_array_layout(text, array) < 0)
+    return -1;
+  snprintf(path, sizeof(path), "%s/fd", dir);
+  fd = bcc_recv_fd(path);
+  if (fd < 0)
+    return -1;
+  rc = bcc_array_map(fd, array);
+  close(fd);
+  return rc;
+}
+
+void bcc_array_close(struct bcc_array *array) {
+  if (array->data)
+    munmap((void *)array->data, array->size);
+  array->data = NULL;
+}
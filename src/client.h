@@ -17,13 +17,114 @@
 #ifndef BCC_CLIENT_H
 #define BCC_CLIENT_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 int bcc_send_fd(int sock, int fd);
+// send fd to one connected client
+int bcc_send_fd_to(int cl, int fd);
 int bcc_recv_fd(const char *path);
 
+// Header of the map snapshots that maps/NAME/snapshot hands out as a memfd,
+// followed by count records of key_size + leaf_size bytes each. seq is odd
+// while the daemon rewrites the records. flags gets BCC_SNAPSHOT_CLOSED once
+// no more snapshots will come, the last one stays readable.
+#define BCC_SNAPSHOT_CLOSED 1
+struct bcc_snapshot {
+  uint32_t seq;
+  uint32_t key_size;
+  uint32_t leaf_size;
+  uint32_t flags;
+  uint64_t generation;
+  uint64_t count;
+  uint64_t capacity;
+  uint64_t time_ns;
+};
+
+// map the snapshots behind a socket path, or a memfd, read-only; NULL on error
+const struct bcc_snapshot * bcc_snapshot_open(const char *path);
+const struct bcc_snapshot * bcc_snapshot_map(int fd);
+void bcc_snapshot_close(const struct bcc_snapshot *snap);
+// copy the records of one complete snapshot into buf and return how many
+// there were, or -1 with errno ENOSPC if they do not fit in size bytes
+long bcc_snapshot_read(const struct bcc_snapshot *snap, void *buf, size_t size,
+                       uint64_t *generation);
+// wait for a snapshot newer than generation, 0 or -1 with errno ETIMEDOUT,
+// or EPIPE once the snapshots are closed; timeout_ms < 0 waits forever
+int bcc_snapshot_wait(const struct bcc_snapshot *snap, uint64_t generation, int timeout_ms);
+
+// Point operations on the raw key and leaf bytes of a map, as ioctls on an
+// open maps/NAME/dump (or the map directory). key_size and leaf_size must be
+// the map's; per-cpu maps are refused with EINVAL. Update and delete fail
+// with EBADF unless dump is open for writing, and always on the directory.
+// data holds, for
+//   BCC_MAP_LOOKUP        key in, leaf out
+//   BCC_MAP_UPDATE        key, leaf; flags is BPF_ANY, BPF_NOEXIST or BPF_EXIST
+//   BCC_MAP_DELETE        key
+//   BCC_MAP_LOOKUP_BATCH  count keys, then count found bytes and count leaves out
+// and count comes back as the number of entries found, updated or deleted.
+// The size of the ioctl is the header plus as much data as the operation
+// needs, fuse copies that much each way.
+struct bcc_map_io {
+  uint32_t key_size;
+  uint32_t leaf_size;
+  uint32_t count;
+  uint32_t flags;
+  uint8_t data[];
+};
+
+enum {
+  BCC_MAP_LOOKUP = 1,
+  BCC_MAP_UPDATE,
+  BCC_MAP_DELETE,
+  BCC_MAP_LOOKUP_BATCH,
+};
+
+// the largest size an ioctl command can encode
+#define BCC_MAP_IO_MAX 16376
+#define BCC_MAP_IO(op, size) _IOC(_IOC_READ | _IOC_WRITE, 'B', (op), (size))
+
+// keys that fit in one batch
+#define BCC_MAP_BATCH_MAX(key_size, leaf_size) \
+  ((BCC_MAP_IO_MAX - sizeof(struct bcc_map_io)) / ((key_size) + 1 + (leaf_size)))
+
+// 0, or -1 with errno; fd is an open maps/NAME/dump, O_RDWR to change the map
+int bcc_map_lookup(int fd, const void *key, size_t key_size, void *leaf, size_t leaf_size);
+int bcc_map_update(int fd, const void *key, size_t key_size, const void *leaf,
+                   size_t leaf_size, uint32_t flags);
+int bcc_map_delete(int fd, const void *key, size_t key_size, size_t leaf_size);
+// look up count keys at once, found[i] tells whether leaves[i] was filled in;
+// the number found, or -1 with errno
+long bcc_map_lookup_batch(int fd, const void *keys, size_t key_size, void *leaves,
+                          size_t leaf_size, uint8_t *found, size_t count);
+
+// The values of an array map created BPF_F_MMAPABLE, mapped read-only from
+// the map fd. Value i sits at data + i * stride and is the kernel's live copy,
+// reading it takes no syscall. maps/NAME/layout describes the mapping and
+// only exists for such arrays.
+struct bcc_array {
+  const void *data;
+  size_t stride;
+  size_t leaf_size;
+  size_t max_entries;
+  size_t size;
+};
+
+#define BCC_ARRAY_VALUE(array, i) \
+  ((const void *)((const uint8_t *)(array)->data + (size_t)(i) * (array)->stride))
+
+// 0, or -1 with errno; dir is a map directory, e.g. /run/bcc/foo/maps/counts
+int bcc_array_open(const char *dir, struct bcc_array *array);
+// the same from the text of layout and a map fd, which stays the caller's
+int bcc_array_layout(const char *text, struct bcc_array *array);
+int bcc_array_map(int fd, struct bcc_array *array);
+void bcc_array_close(struct bcc_array *array);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <bcc/bpf_common.h>
+
+#include "codec.h"
+#include "hex.h"
+#include "string_util.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace bcc {
+
+namespace {
+
+// Just enough json for libbcc's type descriptions: strings, numbers and lists
+struct Json {
+  bool is_list;
+  string str;
+  vector<Json> items;
+};
+
+bool parse_json(const char **s, Json *out) {
+  while (isspace(**s))
+    ++*s;
+  out->is_list = false;
+  if (**s == '"') {
+    const char *start = ++*s;
+    while (**s && **s != '"')
+      ++*s;
+    if (!**s)
+      return false;
+    out->str.assign(start, *s - start);
+    ++*s;
+    return true;
+  }
+  if (isdigit(**s)) {
+    const char *start = *s;
+    while (isdigit(**s))
+      ++*s;
+    out->str.assign(start, *s - start);
+    return true;
+  }
+  if (**s != '[')
+    return false;
+  ++*s;
+  out->is_list = true;
+  for (;;) {
+    while (isspace(**s))
+      ++*s;
+    if (**s == ']') {
+      ++*s;
+      return true;
+    }
+    if (!out->items.empty()) {
+      if (**s != ',')
+        return false;
+      ++*s;
+    }
+    out->items.push_back(Json());
+    if (!parse_json(s, &out->items.back()))
+      return false;
+  }
+}
+
+struct Integer {
+  const char *name;
+  size_t size;
+  bool is_signed;
+};
+
+const Integer integers[] = {
+  {"char", 1, true},
+  {"signed char", 1, true},
+  {"unsigned char", 1, false},
+  {"_Bool", 1, false},
+  {"short", 2, true},
+  {"unsigned short", 2, false},
+  {"int", 4, true},
+  {"unsigned int", 4, false},
+  {"long", 8, true},
+  {"unsigned long", 8, false},
+  {"long long", 8, true},
+  {"unsigned long long", 8, false},
+  {"s8", 1, true}, {"u8", 1, false}, {"__s8", 1, true}, {"__u8", 1, false},
+  {"s16", 2, true}, {"u16", 2, false}, {"__s16", 2, true}, {"__u16", 2, false},
+  {"s32", 4, true}, {"u32", 4, false}, {"__s32", 4, true}, {"__u32", 4, false},
+  {"s64", 8, true}, {"u64", 8, false}, {"__s64", 8, true}, {"__u64", 8, false},
+};
+
+const Integer * find_integer(const Json &j) {
+  if (j.is_list)
+    return nullptr;
+  for (auto &i : integers)
+    if (j.str == i.name)
+      return &i;
+  return nullptr;
+}
+
+uint64_t load(const uint8_t *p, size_t size) {
+  uint64_t v = 0;
+  memcpy(&v, p, size);
+  return v;
+}
+
+void store(uint8_t *p, size_t size, uint64_t v) {
+  memcpy(p, &v, size);
+}
+
+void append_hex(uint64_t v, string *out) {
+  static const char digits[] = "0123456789abcdef";
+  char buf[18];
+  char *end = buf + sizeof(buf), *p = end;
+  do {
+    *--p = digits[v & 0xf];
+    v >>= 4;
+  } while (v);
+  *--p = 'x';
+  *--p = '0';
+  out->append(p, end - p);
+}
+
+void skip_space(const char **s) {
+  while (isspace(**s))
+    ++*s;
+}
+
+// same rules as scanf's %i: optional sign, then hex, octal or decimal; like
+// strtoull, or strtoll with a minus sign, anything out of range fails
+bool parse_int(const char **s, uint64_t *v) {
+  skip_space(s);
+  const char *p = *s;
+  bool neg = false;
+  if (*p == '-' || *p == '+')
+    neg = *p++ == '-';
+  uint64_t r = 0;
+  bool over = false;
+  const char *digits = p;
+  if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X') && hex_nibble(p[2]) >= 0) {
+    for (p += 2; hex_nibble(*p) >= 0; ++p) {
+      over |= r >> 60 != 0;
+      r = (r << 4) | hex_nibble(*p);
+    }
+  } else if (p[0] == '0') {
+    for (; *p >= '0' && *p <= '7'; ++p) {
+      over |= r >> 61 != 0;
+      r = (r << 3) | (*p - '0');
+    }
+  } else {
+    for (; *p >= '0' && *p <= '9'; ++p) {
+      over |= r > (UINT64_MAX - (*p - '0')) / 10;
+      r = r * 10 + (*p - '0');
+    }
+  }
+  if (p == digits || over || (neg && r > 1ull << 63))
+    return false;
+  *v = neg ? -r : r;
+  *s = p;
+  return true;
+}
+
+bool expect(const char **s, char c) {
+  skip_space(s);
+  if (**s != c)
+    return false;
+  ++*s;
+  return true;
+}
+
+bool at_end(const char *s) {
+  skip_space(&s);
+  return !*s;
+}
+
+template <size_t N>
+class IntCodec : public TypeCodec {
+ public:
+  IntCodec() : TypeCodec(N) {}
+  int format(const void *data, string *out) const override {
+    append_hex(load((const uint8_t *)data, N), out);
+    return 0;
+  }
+  int parse(const char *text, void *data) const override {
+    uint64_t v;
+    if (!parse_int(&text, &v) || !at_end(text))
+      return -1;
+    store((uint8_t *)data, N, v);
+    return 0;
+  }
+};
+
+// "{ 0x1 [ 0x2 0x3 ] }" for a struct of an integer and an array of two
+class FlatCodec : public TypeCodec {
+ public:
+  explicit FlatCodec(const Layout &layout) : TypeCodec(layout.size), fields_(layout.fields) {}
+  int format(const void *data, string *out) const override {
+    const uint8_t *p = (const uint8_t *)data;
+    out->append("{ ");
+    for (auto &f : fields_) {
+      if (f.count) {
+        out->append("[ ");
+        for (size_t i = 0; i < f.count; ++i) {
+          append_hex(load(p + f.offset + i * f.size, f.size), out);
+          out->push_back(' ');
+        }
+        out->push_back(']');
+      } else {
+        append_hex(load(p + f.offset, f.size), out);
+      }
+      out->push_back(' ');
+    }
+    out->push_back('}');
+    return 0;
+  }
+  int parse(const char *text, void *data) const override {
+    uint8_t *p = (uint8_t *)data;
+    uint64_t v;
+    memset(p, 0, size_);
+    if (!expect(&text, '{'))
+      return -1;
+    for (auto &f : fields_) {
+      if (f.count) {
+        if (!expect(&text, '['))
+          return -1;
+        for (size_t i = 0; i < f.count; ++i) {
+          if (!parse_int(&text, &v))
+            return -1;
+          store(p + f.offset + i * f.size, f.size, v);
+        }
+        if (!expect(&text, ']'))
+          return -1;
+      } else {
+        if (!parse_int(&text, &v))
+          return -1;
+        store(p + f.offset, f.size, v);
+      }
+    }
+    if (!expect(&text, '}') || !at_end(text))
+      return -1;
+    return 0;
+  }
+ private:
+  vector<Layout::Field> fields_;
+};
+
+// libbcc's own printf/scanf, for everything else
+class GenericCodec : public TypeCodec {
+ public:
+  GenericCodec(void *bpf_module, int id, bool is_key, size_t size)
+      : TypeCodec(size), bpf_module_(bpf_module), id_(id), is_key_(is_key) {}
+  int format(const void *data, string *out) const override {
+    // libbcc wants a buffer, let it print straight into the output
+    size_t n = out->size(), buflen = size_ * 8;
+    out->resize(n + buflen);
+    int rc = is_key_ ? bpf_table_key_snprintf(bpf_module_, id_, &(*out)[n], buflen, data)
+                     : bpf_table_leaf_snprintf(bpf_module_, id_, &(*out)[n], buflen, data);
+    if (rc) {
+      out->resize(n);
+      return -1;
+    }
+    out->resize(n + strlen(&(*out)[n]));
+    return 0;
+  }
+  int parse(const char *text, void *data) const override {
+    return is_key_ ? bpf_table_key_sscanf(bpf_module_, id_, text, data)
+                   : bpf_table_leaf_sscanf(bpf_module_, id_, text, data);
+  }
+  bool generic() const override { return true; }
+ private:
+  void *bpf_module_;
+  int id_;
+  bool is_key_;
+};
+
+unique_ptr<TypeCodec> make_codec(const Layout &layout, void *bpf_module, int id, bool is_key,
+                                 size_t size) {
+  if (layout.kind == Layout::scalar_e) {
+    switch (layout.size) {
+      case 1: return make_unique<IntCodec<1>>();
+      case 2: return make_unique<IntCodec<2>>();
+      case 4: return make_unique<IntCodec<4>>();
+      case 8: return make_unique<IntCodec<8>>();
+    }
+  }
+  if (layout.kind == Layout::struct_e)
+    return make_unique<FlatCodec>(layout);
+  return make_unique<GenericCodec>(bpf_module, id, is_key, size);
+}
+
+}  // namespace
+
+Layout Layout::parse(const char *desc, size_t size) {
+  Layout layout, opaque;
+  opaque.size = size;
+  Json j;
+  if (!desc || !parse_json(&desc, &j))
+    return opaque;
+  if (const Integer *i = find_integer(j)) {
+    layout.kind = scalar_e;
+    layout.size = i->size;
+    Field f = {"", 0, i->size, 0, i->is_signed};
+    layout.fields.push_back(f);
+    return layout.size == size ? layout : opaque;
+  }
+  // ["name", [["field", "type"], ["field", "type", [count]], ...], "struct"]
+  if (!j.is_list || j.items.size() < 2 || !j.items[1].is_list)
+    return opaque;
+  if (j.items.size() > 2 && j.items[2].str != "struct")
+    return opaque;
+  size_t offset = 0, align = 1;
+  for (auto &jf : j.items[1].items) {
+    if (!jf.is_list || jf.items.size() < 2 || jf.items.size() > 3 || jf.items[0].is_list)
+      return opaque;
+    const Integer *i = find_integer(jf.items[1]);
+    if (!i)
+      return opaque;
+    Field f = {jf.items[0].str, 0, i->size, 0, i->is_signed};
+    if (jf.items.size() == 3) {
+      // a bare number here is a bitfield width
+      const Json &dims = jf.items[2];
+      if (!dims.is_list || dims.items.size() != 1 || dims.items[0].is_list)
+        return opaque;
+      f.count = strtoul(dims.items[0].str.c_str(), nullptr, 10);
+      if (!f.count)
+        return opaque;
+    }
+    offset = (offset + i->size - 1) / i->size * i->size;
+    f.offset = offset;
+    offset += f.size * (f.count ? f.count : 1);
+    align = std::max(align, i->size);
+    layout.fields.push_back(f);
+  }
+  layout.kind = struct_e;
+  layout.size = (offset + align - 1) / align * align;
+  if (layout.fields.empty() || layout.size != size)
+    return opaque;
+  return layout;
+}
+
+const Layout::Field * Layout::field(const string &name) const {
+  if (kind == scalar_e && name.empty())
+    return &fields[0];
+  for (auto &f : fields)
+    if (f.name == name)
+      return &f;
+  return nullptr;
+}
+
+int HexCodec::format(const void *data, string *out) const {
+  size_t n = out->size();
+  out->resize(n + size_ * 2);
+  hex_encode((const uint8_t *)data, size_, &(*out)[n]);
+  return 0;
+}
+
+int HexCodec::parse(const char *text, void *data) const {
+  if (strlen(text) != size_ * 2 || !hex_decode(text, size_, (uint8_t *)data))
+    return -1;
+  return 0;
+}
+
+TableCodec::TableCodec(void *bpf_module, int id) {
+  size_t key_size = bpf_table_key_size_id(bpf_module, id);
+  size_t leaf_size = bpf_table_leaf_size_id(bpf_module, id);
+  key_layout_ = Layout::parse(bpf_table_key_desc_id(bpf_module, id), key_size);
+  leaf_layout_ = Layout::parse(bpf_table_leaf_desc_id(bpf_module, id), leaf_size);
+  key_ = make_codec(key_layout_, bpf_module, id, true, key_size);
+  leaf_ = make_codec(leaf_layout_, bpf_module, id, false, leaf_size);
+}
+
+}  // namespace bcc
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace bcc {
+
+// Layout of a key or leaf type, as far as it can be recovered from the json
+// type description that libbcc keeps for each table. Only integers, flat
+// structs of integers and fixed arrays thereof are understood; anything else
+// (nested structs, unions, bitfields, packed layouts) is opaque.
+struct Layout {
+  struct Field {
+    std::string name;
+    size_t offset;
+    size_t size;    // of one element
+    size_t count;   // number of array elements, 0 for a plain integer
+    bool is_signed;
+    bool operator==(const Field &o) const {
+      return name == o.name && offset == o.offset && size == o.size && count == o.count &&
+             is_signed == o.is_signed;
+    }
+  };
+  enum Kind { opaque_e, scalar_e, struct_e };
+
+  Layout() : kind(opaque_e), size(0) {}
+  // size is the one reported by libbcc, the layout is opaque if they differ
+  static Layout parse(const char *desc, size_t size);
+  // field by name, or the only member of a scalar for ""
+  const Field * field(const std::string &name) const;
+  // opaque layouts only compare by size
+  bool operator==(const Layout &o) const {
+    return kind == o.kind && size == o.size && fields == o.fields;
+  }
+  bool operator!=(const Layout &o) const { return !(*this == o); }
+
+  Kind kind;
+  size_t size;
+  std::vector<Field> fields;
+};
+
+// Text form of one key or leaf type. The text matches what the printf/scanf
+// functions generated by libbcc produce and accept.
+class TypeCodec {
+ public:
+  virtual ~TypeCodec() {}
+  // append the text form of data to out
+  virtual int format(const void *data, std::string *out) const = 0;
+  // parse text into size() bytes at data
+  virtual int parse(const char *text, void *data) const = 0;
+  virtual bool generic() const { return false; }
+  size_t size() const { return size_; }
+ protected:
+  explicit TypeCodec(size_t size) : size_(size) {}
+  size_t size_;
+};
+
+// Fixed width hex of the raw bytes, for views that bypass the typed text form
+class HexCodec : public TypeCodec {
+ public:
+  explicit HexCodec(size_t size) : TypeCodec(size) {}
+  int format(const void *data, std::string *out) const override;
+  int parse(const char *text, void *data) const override;
+};
+
+// Key and leaf codecs of one table, picked once when the table is loaded:
+// specialized ones for the common layouts, libbcc's generic ones otherwise.
+class TableCodec {
+ public:
+  TableCodec(void *bpf_module, int id);
+  int format_key(const void *key, std::string *out) const { return key_->format(key, out); }
+  int format_leaf(const void *leaf, std::string *out) const { return leaf_->format(leaf, out); }
+  int parse_key(const char *text, void *key) const { return key_->parse(text, key); }
+  int parse_leaf(const char *text, void *leaf) const { return leaf_->parse(text, leaf); }
+  const TypeCodec & key() const { return *key_; }
+  const TypeCodec & leaf() const { return *leaf_; }
+  const Layout & key_layout() const { return key_layout_; }
+  const Layout & leaf_layout() const { return leaf_layout_; }
+ private:
+  Layout key_layout_;
+  Layout leaf_layout_;
+  std::unique_ptr<TypeCodec> key_;
+  std::unique_ptr<TypeCodec> leaf_;
+};
+
+// Scratch space for one key or leaf, on the stack unless it is large
+class Scratch {
+ public:
+  explicit Scratch(size_t size) : heap_(size > sizeof(local_) ? new uint8_t[size] : nullptr) {}
+  uint8_t * get() { return heap_ ? &heap_[0] : local_; }
+ private:
+  Scratch(const Scratch &) = delete;
+  uint8_t local_[128];
+  std::unique_ptr<uint8_t[]> heap_;
+};
+
+}  // namespace bcc
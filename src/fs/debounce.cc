@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "debounce.h"
+
+using std::unique_lock;
+
+namespace bcc {
+
+Debouncer::Debouncer(unsigned window_ms)
+    : window_ms_(window_ms), running_(nullptr), stop_(false) {
+  thread_ = std::thread(&Debouncer::run, this);
+}
+
+Debouncer::~Debouncer() {
+  {
+    unique_lock<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+}
+
+// every submit pushes the run out by a whole window again
+void Debouncer::submit(const void *key, Job job) {
+  {
+    unique_lock<std::mutex> lock(mutex_);
+    ++latest_[key];
+    Pending &p = pending_[key];
+    p.job = std::move(job);
+    p.due = Clock::now() + std::chrono::milliseconds(window_ms_);
+  }
+  cond_.notify_all();
+}
+
+void Debouncer::cancel(const void *key) {
+  unique_lock<std::mutex> lock(mutex_);
+  pending_.erase(key);
+  ++latest_[key];
+  cond_.wait(lock, [&] { return running_ != key; });
+  latest_.erase(key);
+  cond_.notify_all();
+}
+
+void Debouncer::drain() {
+  unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] { return pending_.empty() && !running_; });
+}
+
+void Debouncer::run() {
+  unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    auto next = pending_.end();
+    for (auto it = pending_.begin(); it != pending_.end(); ++it)
+      if (next == pending_.end() || it->second.due < next->second.due)
+        next = it;
+    if (next == pending_.end()) {
+      cond_.wait(lock);
+      continue;
+    }
+    if (Clock::now() < next->second.due) {
+      cond_.wait_until(lock, next->second.due);
+      continue;
+    }
+    const void *key = next->first;
+    uint64_t seq = latest_[key];
+    Job job = std::move(next->second.job);
+    pending_.erase(next);
+    running_ = key;
+    lock.unlock();
+    job([this, key, seq] {
+      unique_lock<std::mutex> lock(mutex_);
+      return latest_[key] != seq;
+    });
+    lock.lock();
+    running_ = nullptr;
+    cond_.notify_all();
+  }
+}
+
+}  // namespace bcc
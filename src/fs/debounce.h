@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace bcc {
+
+// Runs the last job submitted for a key once no other came for the window,
+// on a thread of its own, so that a burst of submits costs one run. A job
+// is handed a test that turns true once a newer job for its key came in, so
+// that it can drop work that has been overtaken.
+class Debouncer {
+ public:
+  typedef std::function<bool()> Obsolete;
+  typedef std::function<void(const Obsolete &obsolete)> Job;
+
+  explicit Debouncer(unsigned window_ms);
+  ~Debouncer();
+  unsigned window_ms() const { return window_ms_; }
+  void submit(const void *key, Job job);
+  // drop the pending job of key, and wait for a running one to finish
+  void cancel(const void *key);
+  // wait until no job is pending or running
+  void drain();
+ private:
+  typedef std::chrono::steady_clock Clock;
+  struct Pending {
+    Job job;
+    Clock::time_point due;
+  };
+  void run();
+
+  unsigned window_ms_;
+  std::map<const void *, Pending> pending_;
+  // submits so far per key, a job is obsolete once this moves past its own
+  std::map<const void *, uint64_t> latest_;
+  const void *running_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stop_;
+  std::thread thread_;
+};
+
+}  // namespace bcc
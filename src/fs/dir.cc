@@ -15,13 +15,16 @@
  */
 
 #include <algorithm>
+#include <cstring>
 #include <fuse.h>
+#include <set>
 #include <string>
-#include <bcc/bpf_common.h>
+#include <vector>
 #include <bcc/libbpf.h>
-#include <time.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include "clock.h"
 #include "mount.h"
 #include "string_util.h"
 
@@ -29,9 +32,32 @@ using std::map;
 using std::move;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 
 namespace bcc {
 
+namespace {
+
+// Where the values of an array map sit when its fd is mapped, empty unless
+// the array was created BPF_F_MMAPABLE. libbcc does not report map flags, so
+// ask the kernel by mapping it.
+string array_layout(const TableInfo *table) {
+  if (table->type != BPF_MAP_TYPE_ARRAY || !table->max_entries)
+    return string();
+  size_t page = sysconf(_SC_PAGESIZE), stride = (table->leaf_size + 7) & ~7ul;
+  size_t size = (stride * table->max_entries + page - 1) / page * page;
+  void *mem = mmap(nullptr, size, PROT_READ, MAP_SHARED, table->fd, 0);
+  if (mem == MAP_FAILED)
+    return string();
+  munmap(mem, size);
+  return "offset 0\nstride " + std::to_string(stride) +
+         "\nleaf_size " + std::to_string(table->leaf_size) +
+         "\nmax_entries " + std::to_string(table->max_entries) +
+         "\nsize " + std::to_string(size) + "\n";
+}
+
+}  // namespace
+
 Dir::Dir(mode_t mode)
     : Inode(dir_e, mode), n_files_(0), n_dirs_(0) {
 }
@@ -104,6 +130,25 @@ void Dir::remove_child(const string &name) {
   }
 }
 
+unique_ptr<Inode> Dir::take_child(const string &name) {
+  auto it = children_.find(name);
+  if (it == children_.end())
+    return nullptr;
+  unique_ptr<Inode> node = move(it->second);
+  if (node->type() == file_e)
+    --n_files_;
+  else
+    --n_dirs_;
+  node->set_parent(nullptr);
+  children_.erase(it);
+  return node;
+}
+
+Inode * Dir::child(const string &name) {
+  auto it = children_.find(name);
+  return it != children_.end() ? &*it->second : nullptr;
+}
+
 string Dir::path(const Inode *node) const {
   // TODO: inefficient
   for (auto&& it : children_) {
@@ -121,60 +166,188 @@ int RootDir::mkdir(const char *path, mode_t mode) {
   return 0;
 }
 
+void RootDir::metric_maps(vector<MapDir *> *out) {
+  for (auto &it : children_)
+    if (ProgramDir *pd = dynamic_cast<ProgramDir *>(&*it.second))
+      pd->metric_maps(out);
+}
+
 ProgramDir::ProgramDir(mode_t mode)
-    : Dir(mode), bpf_module_(nullptr) {
+    : Dir(mode) {
   add_child("source", make_unique<SourceFile>());
   add_child("valid", make_unique<StatFile>("0\n"));
+  add_child("memory", make_unique<StatFile>(""));
+  add_child("reload", make_unique<StatFile>(""));
+  add_child("metrics", make_unique<MetricsFile>());
 }
 
 ProgramDir::~ProgramDir() {
+  if (Debouncer *debouncer = mount_->debouncer())
+    debouncer->cancel(this);
   unload();
 }
 
+// The compile runs without the tree, which is only taken to put the program
+// in place, and not at all if another flush has come in meanwhile.
+void ProgramDir::load_later(const string &text) {
+  uid_t uid = Mount::caller_uid();
+  mount_->debouncer()->submit(this, [this, uid, text] (const Debouncer::Obsolete &obsolete) {
+    mount_->adopt_thread();
+    bool empty = text.empty() || text == "\n";
+    unique_ptr<Module> module = empty ? nullptr : compile(text.c_str(), uid);
+    pthread_rwlock_wrlock(mount_->tree_lock());
+    if (!obsolete()) {
+      if (empty)
+        unload();
+      else
+        install(move(module));
+    }
+    pthread_rwlock_unlock(mount_->tree_lock());
+  });
+}
+
+// Tables that are the same as in the program loaded before keep their maps,
+// and with them their contents; what happened to each is in `reload`. The
+// old program stays in place until the new one is complete, and the fd
+// sockets of kept maps and reloaded functions carry over, so clients never
+// find them missing.
 int ProgramDir::load(const char *text) {
+  return install(compile(text, Mount::caller_uid()));
+}
+
+unique_ptr<Module> ProgramDir::compile(const char *text, uid_t uid) {
+  Scheduler::Slot slot;
+  if (mount_->scheduler()->admit(uid, Scheduler::compile_e, strlen(text), &slot))
+    return nullptr;
+  return Module::create(text);
+}
+
+int ProgramDir::install(unique_ptr<Module> module) {
   StatFile *validf = dynamic_cast<StatFile *>(&*children_["valid"]);
-  if (!validf) return 1;
-  void *m = bpf_module_create_c_from_string(text, 0);
-  if (!m) {
+  StatFile *reloadf = dynamic_cast<StatFile *>(&*children_["reload"]);
+  if (!validf || !reloadf) return 1;
+  if (!module) {
     validf->set_data("0\n");
     return 1;
   }
-  bpf_module_ = m;
-  validf->set_data("1\n");
+  string report;
+  std::set<string> kept;
+  for (size_t i = 0; module_ && i < module->num_tables(); ++i) {
+    const TableInfo &t = module->table(i);
+    const TableInfo *old = module_->find_table(t.name);
+    if (!old) {
+      report += t.name + " new\n";
+      continue;
+    }
+    const char *why = table_mismatch(t, *old);
+    if (!why && module->adopt_table(i, *old))
+      why = "map could not be shared";
+    if (!why)
+      kept.insert(t.name);
+    report += t.name + (why ? " reset: " + string(why) : string(" kept")) + "\n";
+  }
+  for (size_t i = 0; module_ && i < module_->num_tables(); ++i) {
+    if (!module->find_table(module_->table(i).name))
+      report += module_->table(i).name + " dropped\n";
+  }
 
+  auto it = children_.find("functions");
+  Dir *old_functions = it != children_.end() ? dynamic_cast<Dir *>(&*it->second) : nullptr;
   auto functions = make_unique<Dir>(mode_);
-  size_t num_functions = bpf_num_functions(bpf_module_);
-  for (size_t i = 0; i < num_functions; ++i) {
-    functions->add_child(bpf_function_name(bpf_module_, i),
-                         make_unique<FunctionDir>(mode_, bpf_module_, i));
+  for (size_t i = 0; i < module->num_functions(); ++i) {
+    const string &name = module->function(i).name;
+    auto fd = make_unique<FunctionDir>(mode_, &*module, i);
+    unique_ptr<Inode> old = old_functions ? old_functions->take_child(name) : nullptr;
+    if (FunctionDir *old_fd = dynamic_cast<FunctionDir *>(old.get()))
+      fd->take_over(old_fd);
+    functions->add_child(name, move(fd));
   }
-  add_child("functions", move(functions));
 
+  it = children_.find("maps");
+  Dir *old_maps = it != children_.end() ? dynamic_cast<Dir *>(&*it->second) : nullptr;
   auto maps = make_unique<Dir>(mode_);
-  size_t num_tables = bpf_num_tables(bpf_module_);
-  for (size_t i = 0; i < num_tables; ++i) {
-    maps->add_child(bpf_table_name(bpf_module_, i),
-                    make_unique<MapDir>(mode_, bpf_module_, i));
+  for (size_t i = 0; i < module->num_tables(); ++i) {
+    const TableInfo &t = module->table(i);
+    unique_ptr<Inode> old = old_maps && kept.count(t.name) ? old_maps->take_child(t.name) : nullptr;
+    Dir *old_md = dynamic_cast<Dir *>(old.get());
+    auto md = make_unique<MapDir>(mode_, &t, old_md ? old_md->take_child("fd") : nullptr);
+    // a kept map has the same layouts, its metrics and snapshots still apply
+    if (MapDir *old_map = dynamic_cast<MapDir *>(old_md)) {
+      md->set_metrics(old_map->metrics());
+      if (std::shared_ptr<Publisher> publisher = old_map->publisher()) {
+        publisher->set_table(&t);
+        md->set_publisher(publisher);
+      }
+    }
+    const TableInfo *alt = module->find_table(t.name + "_alt");
+    const TableInfo *sel = module->find_table(t.name + "_sel");
+    if (alt && sel && alt->key_size == t.key_size && alt->leaf_size == t.leaf_size &&
+        sel->key_size == 4 && sel->leaf_size == 4)
+      md->enable_swap(alt, sel);
+    maps->add_child(t.name, move(md));
   }
+
+  add_child("functions", move(functions));
   add_child("maps", move(maps));
+  module_ = move(module);
+  reloadf->set_data(report);
+  validf->set_data("1\n");
+
+  if (mount_->flags() & Mount::compact_e)
+    module_->compact();
+  if (StatFile *memoryf = dynamic_cast<StatFile *>(&*children_["memory"]))
+    memoryf->set_data(memory());
   return 0;
 }
 
 void ProgramDir::unload() {
   if (StatFile *validf = dynamic_cast<StatFile *>(&*children_["valid"]))
     validf->set_data("0\n");
-  if (bpf_module_)
-    bpf_module_destroy(bpf_module_);
+  if (StatFile *memoryf = dynamic_cast<StatFile *>(&*children_["memory"]))
+    memoryf->set_data("");
   remove_child("functions");
   remove_child("maps");
-  bpf_module_ = nullptr;
+  module_.reset();
+}
+
+void ProgramDir::metric_maps(vector<MapDir *> *out) {
+  Dir *maps = dynamic_cast<Dir *>(child("maps"));
+  for (size_t i = 0; maps && i < module_->num_tables(); ++i) {
+    MapDir *md = dynamic_cast<MapDir *>(maps->child(module_->table(i).name));
+    if (md && md->metrics())
+      out->push_back(md);
+  }
 }
 
-FunctionDir::FunctionDir(mode_t mode, void *bpf_module, int id)
-    : Dir(mode), bpf_module_(bpf_module), id_(id) {
+// one "name bytes" pair per line, the map lines are kernel side estimates
+string ProgramDir::memory() const {
+  char line[256];
+  string data;
+  snprintf(line, sizeof(line), "compact %d\nmodule %zu\nmetadata %zu\n",
+           module_->compacted(), module_->module_bytes(), module_->metadata_bytes());
+  data += line;
+  size_t total = 0;
+  for (size_t i = 0; i < module_->num_tables(); ++i) {
+    const TableInfo &t = module_->table(i);
+    size_t bytes = map_memory(t);
+    snprintf(line, sizeof(line), "map.%s %zu\n", t.name.c_str(), bytes);
+    data += line;
+    total += bytes;
+  }
+  snprintf(line, sizeof(line), "maps %zu\n", total);
+  data += line;
+  return data;
+}
+
+FunctionDir::FunctionDir(mode_t mode, const Module *module, int id)
+    : Dir(mode), module_(module), id_(id), generation_(0) {
   add_child("type", make_unique<FunctionTypeFile>());
+  add_child("generation", make_unique<StatFile>("0\n"));
 }
 
+// The new program is loaded in full before its fd replaces the one behind
+// the `fd` socket, and the old one keeps running if loading fails.
+// `generation` counts the replacements.
 int FunctionDir::load(const string &type) {
   bpf_prog_type prog_type = BPF_PROG_TYPE_UNSPEC;
   if (type == "filter")
@@ -188,30 +361,183 @@ int FunctionDir::load(const string &type) {
   else
     return -1;
   char log_buf[64 * 1024];
-  int fd = bpf_prog_load(prog_type, (const bpf_insn *)bpf_function_start_id(bpf_module_, id_),
-                         bpf_function_size_id(bpf_module_, id_), bpf_module_license(bpf_module_),
-                         bpf_module_kern_version(bpf_module_), log_buf, sizeof(log_buf));
+  const FunctionInfo &fn = module_->function(id_);
+  int fd = bpf_prog_load(prog_type, (const bpf_insn *)&fn.insns[0], fn.insns.size(),
+                         module_->license().c_str(), module_->kern_version(),
+                         log_buf, sizeof(log_buf));
   if (fd < 0) {
     add_child("error", make_unique<StatFile>(log_buf));
     return -1;
   }
-  add_child("fd", make_unique<FDSocket>(mode_, 0, fd));
+  remove_child("error");
+  auto it = children_.find("fd");
+  FDSocket *sock = it != children_.end() ? dynamic_cast<FDSocket *>(&*it->second) : nullptr;
+  if (sock)
+    sock->set_fd(fd);
+  else
+    add_child("fd", make_unique<FDSocket>(mode_, 0, fd));
+  type_ = type;
+  if (StatFile *generationf = dynamic_cast<StatFile *>(&*children_["generation"]))
+    generationf->set_data(std::to_string(++generation_) + "\n");
   return 0;
 }
 
 void FunctionDir::unload() {
   remove_child("fd");
   remove_child("error");
+  type_.clear();
+}
+
+void FunctionDir::take_over(FunctionDir *old) {
+  generation_ = old->generation_;
+  if (StatFile *generationf = dynamic_cast<StatFile *>(&*children_["generation"]))
+    generationf->set_data(std::to_string(generation_) + "\n");
+  if (old->type_.empty())
+    return;
+  if (unique_ptr<Inode> fd = old->take_child("fd"))
+    add_child("fd", move(fd));
+  add_child("type", make_unique<FunctionTypeFile>(old->type_));
+  // if the new code fails to load, the old program stays behind `fd`
+  type_ = old->type_;
+  load(type_);
+}
+
+MapDir::MapDir(mode_t mode, const TableInfo *table, unique_ptr<Inode> fd)
+    : Dir(mode), table_(table), last_ts_(0), keys_(table->key_size), count_(0),
+      count_ts_(0), tick_(0), evict_at_(0), evictions_(0), sizes_ts_(0),
+      listed_ts_(0) {
+  // the socket closes what it hands out, the table's fd stays the module's
+  if (FDSocket *sock = dynamic_cast<FDSocket *>(fd.get())) {
+    sock->set_fd(dup(map_fd()));
+    add_child("fd", move(fd));
+  } else {
+    add_child("fd", make_unique<FDSocket>(mode_, 0, dup(map_fd())));
+  }
+  add_child("stats", make_unique<MapStatsFile>(table_));
+  add_child("dump", make_unique<MapDumpFile>(table_));
+  add_child("keys", make_unique<MapKeysFile>(table_));
+  add_child("changes", make_unique<MapChangesFile>(table_));
+  add_child("top", make_unique<MapTopFile>(table_));
+  add_child("query", make_unique<MapQueryFile>(table_));
+  add_child("clear", make_unique<MapClearFile>(table_));
+  add_child("sample", make_unique<MapSampleFile>(table_));
+  add_child("series", make_unique<MapSeriesFile>(false));
+  add_child("rate", make_unique<MapSeriesFile>(true));
+  add_child("publish", make_unique<MapPublishFile>(table_));
+  add_child("metrics.conf", make_unique<MapMetricsFile>(table_));
+  add_child("lookup", make_unique<MapLookupFile>(table_, false));
+  auto raw = make_unique<RawMapDir>(mode_, table_->key_size, table_->leaf_size);
+  raw->add_child("lookup", make_unique<MapLookupFile>(table_, true));
+  add_child("raw", move(raw));
+  string layout = array_layout(table_);
+  if (!layout.empty())
+    add_child("layout", make_unique<StatFile>(layout));
+}
+
+std::shared_ptr<Sampler> MapDir::sampler() const {
+  std::lock_guard<std::mutex> lock(attached_mutex_);
+  return sampler_;
+}
+
+// the old one is let go outside the lock, it may have a thread to join
+void MapDir::set_sampler(std::shared_ptr<Sampler> sampler) {
+  std::lock_guard<std::mutex> lock(attached_mutex_);
+  sampler_.swap(sampler);
+}
+
+std::shared_ptr<Publisher> MapDir::publisher() const {
+  std::lock_guard<std::mutex> lock(attached_mutex_);
+  return publisher_;
+}
+
+void MapDir::set_publisher(std::shared_ptr<Publisher> publisher) {
+  {
+    std::lock_guard<std::mutex> lock(attached_mutex_);
+    publisher_.swap(publisher);
+  }
+  std::shared_ptr<Publisher> cur = this->publisher();
+  if (!cur) {
+    remove_child("snapshot");
+    return;
+  }
+  int fd = dup(cur->fd());
+  if (fd >= 0)
+    add_child("snapshot", make_unique<FDSocket>(mode_, 0, fd));
+}
+
+std::shared_ptr<const MetricSet> MapDir::metrics() const {
+  std::lock_guard<std::mutex> lock(attached_mutex_);
+  return metrics_;
 }
 
-MapDir::MapDir(mode_t mode, void *bpf_module, int id)
-    : Dir(mode), bpf_module_(bpf_module), id_(id), last_ts_(0) {
-  add_child("fd", make_unique<FDSocket>(mode_, 0, map_fd()));
-  add_child("dump", make_unique<MapDumpFile>(bpf_module_, id_));
+void MapDir::set_metrics(std::shared_ptr<const MetricSet> metrics) {
+  std::lock_guard<std::mutex> lock(attached_mutex_);
+  metrics_.swap(metrics);
 }
 
-int MapDir::map_fd() const {
-  return bpf_table_fd_id(bpf_module_, id_);
+// Raw bytes straight to the map, without the text form or an entry inode
+int MapDir::ioctl(unsigned cmd, void *data, bool writable) {
+  if (_IOC_TYPE(cmd) != 'B')
+    return -ENOTTY;
+  bcc_map_io *io = static_cast<bcc_map_io *>(data);
+  size_t size = _IOC_SIZE(cmd), k = table_->key_size, l = table_->leaf_size;
+  // a per-cpu value is a leaf for each cpu, more than the caller sized for
+  if (size < sizeof(*io) || io->key_size != k || io->leaf_size != l || percpu_map(table_->type))
+    return -EINVAL;
+  size_t len = size - sizeof(*io);
+  int fd = map_fd();
+  switch (_IOC_NR(cmd)) {
+    case BCC_MAP_LOOKUP: {
+      if (len < std::max(k, l))
+        return -EINVAL;
+      Scratch key(k);
+      memcpy(key.get(), io->data, k);
+      if (bpf_lookup_elem(fd, key.get(), io->data))
+        return -ENOENT;
+      io->count = 1;
+      return 0;
+    }
+    case BCC_MAP_UPDATE:
+      if (!writable)
+        return -EBADF;
+      if (len < k + l)
+        return -EINVAL;
+      if (bpf_update_elem(fd, io->data, io->data + k, io->flags))
+        return -errno;
+      forget_sizes();
+      io->count = 1;
+      return 0;
+    case BCC_MAP_DELETE:
+      if (!writable)
+        return -EBADF;
+      if (len < k)
+        return -EINVAL;
+      if (bpf_delete_elem(fd, io->data))
+        return -ENOENT;
+      forget_sizes();
+      io->count = 1;
+      return 0;
+    case BCC_MAP_LOOKUP_BATCH: {
+      size_t n = io->count;
+      if (len / (k + 1 + l) < n)
+        return -EINVAL;
+      uint8_t *found = io->data + n * k, *leaf = found + n;
+      uint32_t hits = 0;
+      for (size_t i = 0; i < n; ++i, leaf += l) {
+        found[i] = bpf_lookup_elem(fd, io->data + i * k, leaf) == 0;
+        if (!found[i])
+          memset(leaf, 0, l);
+        hits += found[i];
+      }
+      io->count = hits;
+      return 0;
+    }
+  }
+  return -ENOTTY;
+}
+
+void MapDir::enable_swap(const TableInfo *alt, const TableInfo *sel) {
+  add_child("swap", make_unique<MapSwapFile>(table_, alt, sel));
 }
 
 int MapDir::getattr(struct stat *st) {
@@ -220,61 +546,317 @@ int MapDir::getattr(struct stat *st) {
   return Dir::getattr(st);
 }
 
-#define REFRESH_TIME_NSEC (1 * 1e9)
-int MapDir::refresh() {
-  // Once a second, refresh the file list in the directory.
-  // Since the map api is unordered, currently we need to wipe the list of
-  // children and build it from scratch each time. However, objects that have
-  // already been inserted into the map should not be removed, since a client
-  // may have it open(). So, keep the object pointer alive and move it from one
-  // list epoch to the other.
-  struct timespec ts;
-  clock_gettime(CLOCK_MONOTONIC, &ts);
-  uint64_t new_ts = (uint64_t)ts.tv_sec * 1e9 + ts.tv_nsec;
-  if (new_ts < last_ts_ + REFRESH_TIME_NSEC)
+#define REFRESH_TIME_NSEC 1000000000ull
+int MapDir::refresh(bool force) {
+  // Once a second, refresh the list of keys in the directory.
+  // Since the map api is unordered, currently we need to wipe the list and
+  // build it from scratch each time. Entries of keys that are gone are
+  // dropped unless a client has them open (or has written to them without
+  // flushing yet).
+  uint64_t new_ts = now_ns();
+  if (!force && new_ts < last_ts_ + REFRESH_TIME_NSEC)
     return 0;
   last_ts_ = new_ts;
-  auto old_children = move(children_);
-  children_["fd"] = move(old_children["fd"]);
-  children_["dump"] = move(old_children["dump"]);
-  n_dirs_ = 0;
-  n_files_ = 2;
+  keys_.clear();
+  sizes_.clear();
   int fd = map_fd();
-  size_t key_size = bpf_table_key_size_id(bpf_module_, id_);
-  size_t leaf_size = bpf_table_leaf_size_id(bpf_module_, id_);
-  unique_ptr<uint8_t[]> key(new uint8_t[key_size]);
-  unique_ptr<char[]> key_str(new char[key_size * 8]);
-  memset(&key[0], 0, key_size);
-  while (bpf_get_next_key(fd, &key[0], &key[0]) == 0) {
-    if (bpf_table_key_snprintf(bpf_module_, id_, &key_str[0], key_size * 8, &key[0]))
-      return -EIO;
-    auto it = old_children.find(&key_str[0]);
-    unique_ptr<uint8_t[]> k(new uint8_t[key_size]);
-    memcpy(&k[0], &key[0], key_size);
-    if (it == old_children.end())
-      add_child(&key_str[0], make_unique<MapEntry>(move(k), leaf_size));
-    else
-      add_child(&key_str[0], move(it->second));
+  Scratch key(table_->key_size);
+  void *prev = nullptr;
+  size_t n = 0;
+  while (bpf_get_next_key(fd, prev, key.get()) == 0) {
+    prev = key.get();
+    keys_.insert(key.get());
+    ++n;
+  }
+  counted(n, new_ts);
+  drop_stale();
+  return 0;
+}
+
+void MapDir::counted(size_t count, uint64_t ts) {
+  if (ts < count_ts_)
+    return;
+  count_ = count;
+  count_ts_ = ts;
+}
+
+int MapDir::occupancy(size_t *count, uint64_t *ts) {
+  switch (table_->type) {
+    case BPF_MAP_TYPE_ARRAY:
+    case BPF_MAP_TYPE_PERCPU_ARRAY:
+    case BPF_MAP_TYPE_PROG_ARRAY:
+    case BPF_MAP_TYPE_PERF_EVENT_ARRAY:
+      // every element of an array exists, there is nothing to count
+      *count = table_->max_entries;
+      *ts = now_ns();
+      return 0;
+  }
+  *count = count_;
+  *ts = count_ts_;
+  // the sampler and publisher threads walk the map on their own
+  size_t n;
+  uint64_t n_ts;
+  std::shared_ptr<Sampler> sampler = this->sampler();
+  if (sampler && sampler->counted(&n, &n_ts) && n_ts > *ts) {
+    *count = n;
+    *ts = n_ts;
+  }
+  if (std::shared_ptr<Publisher> publisher = this->publisher()) {
+    publisher->counted(&n, &n_ts);
+    if (n_ts > *ts) {
+      *count = n;
+      *ts = n_ts;
+    }
   }
   return 0;
 }
 
+void MapDir::drop_stale() {
+  for (auto it = children_.begin(); it != children_.end();) {
+    MapEntry *ent = dynamic_cast<MapEntry *>(&*it->second);
+    if (ent && !ent->busy() && keys_.find(ent->key()) == KeySet::npos) {
+      --n_files_;
+      it = children_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+// Evicting goes down to three quarters of the cap at once, so that the scan
+// over the entries is not repeated for every new one. Busy entries stay
+// whatever their age; with many of them the next scan waits for a quarter
+// of the cap of new ones.
+void MapDir::evict() {
+  size_t cap = mount_->entry_cache(), target = cap - cap / 4;
+  vector<uint64_t> idle;
+  size_t entries = 0;
+  for (auto &it : children_) {
+    if (MapEntry *ent = dynamic_cast<MapEntry *>(&*it.second)) {
+      ++entries;
+      if (!ent->busy())
+        idle.push_back(ent->used());
+    }
+  }
+  size_t n = entries > target ? std::min(entries - target, idle.size()) : 0;
+  if (n) {
+    std::nth_element(idle.begin(), idle.begin() + n - 1, idle.end());
+    uint64_t newest = idle[n - 1];
+    for (auto it = children_.begin(); it != children_.end() && n;) {
+      MapEntry *ent = dynamic_cast<MapEntry *>(&*it->second);
+      if (ent && !ent->busy() && ent->used() <= newest) {
+        --n_files_;
+        --entries;
+        --n;
+        ++evictions_;
+        it = children_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  evict_at_ = std::max(n_files_ - entries + cap, n_files_ + cap / 4);
+}
+
+size_t MapDir::cached() const {
+  size_t n = 0;
+  for (auto &it : children_)
+    n += dynamic_cast<const MapEntry *>(&*it.second) != nullptr;
+  return n;
+}
+
+Inode * MapDir::leaf(Path *path) {
+  if (!path->next())
+    return this;
+  auto it = children_.find(path->next());
+  Inode *node = it != children_.end() ? &*it->second : entry(path->next());
+  if (!node)
+    return this;
+  if (MapEntry *ent = dynamic_cast<MapEntry *>(node))
+    ent->set_used(++tick_);
+  return node->leaf(path->consume());
+}
+
+// Build the entry for a key name. Only the canonical name of a key is
+// accepted, so that one key never ends up with two inodes.
+Inode * MapDir::entry(StringRef ref) {
+  string name = ref.str();
+  unique_ptr<uint8_t[]> key(new uint8_t[table_->key_size]);
+  string canonical;
+  if (codec().parse_key(name.c_str(), &key[0]) || codec().format_key(&key[0], &canonical) ||
+      canonical != name)
+    return nullptr;
+  if (keys_.find(&key[0]) == KeySet::npos) {
+    // added since the last refresh
+    Scratch leaf(table_->leaf_size);
+    if (bpf_lookup_elem(map_fd(), &key[0], leaf.get()))
+      return nullptr;
+    keys_.insert(&key[0]);
+  }
+  // stat'ing many entries by name without listing them leaves idle inodes
+  if (n_files_ >= evict_at_)
+    evict();
+  auto ent = make_unique<MapEntry>(move(key), table_->leaf_size);
+  Inode *node = &*ent;
+  add_child(name, move(ent));
+  return node;
+}
+
 int MapDir::readdir(void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
   if (int rc = refresh())
     return rc;
-  return Dir::readdir(buf, filler, offset, fi);
+  filler(buf, ".", nullptr, 0);
+  filler(buf, "..", nullptr, 0);
+  for (auto it = children_.begin(); it != children_.end(); ++it)
+    if (!dynamic_cast<MapEntry *>(&*it->second))
+      filler(buf, it->first.c_str(), nullptr, 0);
+  // names only, the leaves wait for a getattr that wants their size
+  string name;
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_mode = S_IFREG | 0444;
+  for (size_t i = 0; i < keys_.size(); ++i) {
+    name.clear();
+    if (codec().format_key(keys_.key(i), &name))
+      return -EIO;
+    filler(buf, name.c_str(), &st, 0);
+  }
+  sizes_.clear();
+  listed_ts_ = now_ns();
+  return 0;
+}
+
+// Lone getattrs look their entry up. One that follows a listing, the way
+// `ls -l` goes through the names, sizes every key listed in the same pass.
+#define ATTR_TIME_NSEC 1000000000ull
+bool MapDir::cached_size(const uint8_t *key, size_t *size) {
+  uint64_t now = now_ns();
+  size_t pos = keys_.find(key);
+  if (pos == KeySet::npos)
+    return false;
+  if (sizes_.size() != keys_.size() || now >= sizes_ts_ + ATTR_TIME_NSEC) {
+    if (now >= listed_ts_ + ATTR_TIME_NSEC)
+      return false;
+    string text;
+    Scratch leaf(table_->leaf_size);
+    int fd = map_fd();
+    sizes_.resize(keys_.size());
+    for (size_t i = 0; i < keys_.size(); ++i) {
+      text.clear();
+      if (bpf_lookup_elem(fd, const_cast<uint8_t *>(keys_.key(i)), leaf.get()) == 0 &&
+          codec().format_leaf(leaf.get(), &text) == 0)
+        text.push_back('\n');
+      sizes_[i] = text.size();
+    }
+    sizes_ts_ = now;
+  }
+  *size = sizes_[pos];
+  return true;
 }
 
 int MapDir::create(const char *name, mode_t mode, struct fuse_file_info *fi) {
-  size_t key_size = bpf_table_key_size_id(bpf_module_, id_);
-  size_t leaf_size = bpf_table_leaf_size_id(bpf_module_, id_);
-  unique_ptr<uint8_t[]> key(new uint8_t[key_size]);
-  if (bpf_table_key_sscanf(bpf_module_, id_, name, &key[0]))
+  unique_ptr<uint8_t[]> key(new uint8_t[table_->key_size]);
+  if (codec().parse_key(name, &key[0]))
     return -EIO;
-  auto ent = make_unique<MapEntry>(move(key), leaf_size);
-  fi->fh = (uintptr_t) &*ent;
+  keys_.insert(&key[0]);
+  if (n_files_ >= evict_at_)
+    evict();
+  auto ent = make_unique<MapEntry>(move(key), table_->leaf_size);
+  ent->set_used(++tick_);
+  MapEntry *p = &*ent;
   add_child(name, move(ent));
+  return p->open(fi);
+}
+
+int MapDir::unlink(const char *name) {
+  Scratch key(table_->key_size);
+  if (codec().parse_key(name, key.get()))
+    return -ENOENT;
+  int rc = Dir::unlink(name);
+  if (!rc) {
+    // erasing moves another key into its position
+    keys_.erase(key.get());
+    sizes_.clear();
+  }
+  return rc;
+}
+
+RawMapDir::RawMapDir(mode_t mode, size_t key_size, size_t leaf_size)
+    : Dir(mode), key_hex_(key_size), leaf_size_(leaf_size) {
+}
+
+int RawMapDir::map_fd() const {
+  MapDir *md = dynamic_cast<MapDir *>(parent_);
+  return md ? md->map_fd() : -1;
+}
+
+// names are the canonical lowercase form only, so that each key has one child
+bool RawMapDir::decode(const char *name, uint8_t *key) const {
+  for (const char *c = name; *c; ++c)
+    if (*c >= 'A' && *c <= 'F')
+      return false;
+  return key_hex_.parse(name, key) == 0;
+}
+
+void RawMapDir::prune() {
+  for (auto it = children_.begin(); it != children_.end();) {
+    RawMapEntry *ent = dynamic_cast<RawMapEntry *>(&*it->second);
+    if (ent && !ent->busy()) {
+      --n_files_;
+      it = children_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+Inode * RawMapDir::leaf(Path *path) {
+  if (!path->next())
+    return this;
+  auto it = children_.find(path->next());
+  if (it != children_.end())
+    return it->second->leaf(path->consume());
+  // not seen before, go to the map with the key instead of listing it
+  string name = path->next().str();
+  unique_ptr<uint8_t[]> key(new uint8_t[key_hex_.size()]);
+  Scratch leaf(leaf_size_);
+  if (!decode(name.c_str(), &key[0]) || bpf_lookup_elem(map_fd(), &key[0], leaf.get()))
+    return this;
+  if (n_files_ > mount_->entry_cache())
+    prune();
+  add_child(name, make_unique<RawMapEntry>(move(key), leaf_size_, false));
+  return children_[name]->leaf(path->consume());
+}
+
+int RawMapDir::readdir(void *buf, fuse_fill_dir_t filler, off_t offset,
+                       struct fuse_file_info *fi) {
+  prune();
+  filler(buf, ".", nullptr, 0);
+  filler(buf, "..", nullptr, 0);
+  for (auto it = children_.begin(); it != children_.end(); ++it)
+    if (!dynamic_cast<RawMapEntry *>(&*it->second))
+      filler(buf, it->first.c_str(), nullptr, 0);
+  int fd = map_fd();
+  Scratch key(key_hex_.size());
+  string name;
+  void *prev = nullptr;
+  while (bpf_get_next_key(fd, prev, key.get()) == 0) {
+    prev = key.get();
+    name.clear();
+    key_hex_.format(key.get(), &name);
+    filler(buf, name.c_str(), nullptr, 0);
+  }
   return 0;
 }
 
+int RawMapDir::create(const char *name, mode_t mode, struct fuse_file_info *fi) {
+  unique_ptr<uint8_t[]> key(new uint8_t[key_hex_.size()]);
+  if (!decode(name, &key[0]))
+    return -EINVAL;
+  auto ent = make_unique<RawMapEntry>(move(key), leaf_size_, true);
+  RawMapEntry *p = &*ent;
+  add_child(name, move(ent));
+  return p->open(fi);
+}
+
 }  // namespace bcc
@@ -14,27 +14,178 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <bcc/libbpf.h>
+#include <functional>
 #include <fuse.h>
 #include <iostream>
 #include <iomanip>
 #include <memory>
 #include <string>
-#include <sstream>
 #include <unistd.h>
+#include <vector>
 
-#include <bcc/bpf_common.h>
-
+#include "clock.h"
+#include "hash.h"
 #include "mount.h"
 #include "string_util.h"
 
 using std::move;
 using std::string;
-using std::stringstream;
 using std::unique_ptr;
+using std::vector;
 
 namespace bcc {
 
+namespace {
+
+// What a `changes` handle saw on its previous read: a hash of the value
+// under each key, by position in the key set
+struct ChangesHandle : public Handle {
+  ChangesHandle(File *file, size_t key_size) : Handle(file), keys(key_size), resync(true) {}
+  KeySet keys;
+  vector<uint64_t> hashes;
+  bool resync;
+};
+
+struct LookupHandle : public Handle {
+  explicit LookupHandle(File *file) : Handle(file), taken(false) {}
+  // written since the last read, replaces keys on the next one
+  string input;
+  bool taken;
+  vector<uint8_t> keys;
+};
+
+// "KEY LEAF" as dump lists it
+int append_entry(const TableCodec &codec, const void *key, const void *leaf, string *out) {
+  if (codec.format_key(key, out))
+    return -EIO;
+  out->push_back(' ');
+  if (codec.format_leaf(leaf, out))
+    return -EIO;
+  out->push_back('\n');
+  return 0;
+}
+
+int append_change(const TableCodec &codec, char op, const void *key, const void *leaf,
+                  string *out) {
+  out->push_back(op);
+  out->push_back(' ');
+  if (leaf)
+    return append_entry(codec, key, leaf, out);
+  if (codec.format_key(key, out))
+    return -EIO;
+  out->push_back('\n');
+  return 0;
+}
+
+void forget_changes(ChangesHandle *h, size_t key_size) {
+  h->keys = KeySet(key_size);
+  vector<uint64_t>().swap(h->hashes);
+}
+
+// list the whole map, remembering it unless it has more than max_keys keys
+int resync_changes(const TableInfo &table, size_t max_keys, ChangesHandle *h, string *out) {
+  Scratch key(table.key_size), leaf(table.leaf_size);
+  void *prev = nullptr;
+  forget_changes(h, table.key_size);
+  out->assign("RESYNC\n");
+  bool track = true;
+  while (bpf_get_next_key(table.fd, prev, key.get()) == 0) {
+    prev = key.get();
+    if (bpf_lookup_elem(table.fd, key.get(), leaf.get()))
+      continue;
+    if (int rc = append_change(*table.codec, '+', key.get(), leaf.get(), out))
+      return rc;
+    if (!track)
+      continue;
+    if (h->keys.size() >= max_keys) {
+      forget_changes(h, table.key_size);
+      track = false;
+      continue;
+    }
+    h->keys.insert(key.get());
+    h->hashes.push_back(hash_bytes(leaf.get(), table.leaf_size));
+  }
+  h->resync = !track;
+  return 0;
+}
+
+// list what changed since the previous read, 1 if the map outgrew max_keys
+int diff_changes(const TableInfo &table, size_t max_keys, ChangesHandle *h, string *out) {
+  Scratch key(table.key_size), leaf(table.leaf_size);
+  void *prev = nullptr;
+  vector<bool> seen(h->keys.size(), false);
+  while (bpf_get_next_key(table.fd, prev, key.get()) == 0) {
+    prev = key.get();
+    if (bpf_lookup_elem(table.fd, key.get(), leaf.get()))
+      continue;
+    uint64_t hash = hash_bytes(leaf.get(), table.leaf_size);
+    size_t pos = h->keys.find(key.get());
+    if (pos == KeySet::npos) {
+      if (h->keys.size() >= max_keys)
+        return 1;
+      h->keys.insert(key.get());
+      h->hashes.push_back(hash);
+      seen.push_back(true);
+      if (int rc = append_change(*table.codec, '+', key.get(), leaf.get(), out))
+        return rc;
+    } else {
+      seen[pos] = true;
+      if (h->hashes[pos] == hash)
+        continue;
+      h->hashes[pos] = hash;
+      if (int rc = append_change(*table.codec, '~', key.get(), leaf.get(), out))
+        return rc;
+    }
+  }
+  // going down, erasing only ever moves an already visited key into the hole
+  for (size_t pos = h->keys.size(); pos-- > 0;) {
+    if (seen[pos])
+      continue;
+    memcpy(key.get(), h->keys.key(pos), table.key_size);
+    if (int rc = append_change(*table.codec, '-', key.get(), nullptr, out))
+      return rc;
+    h->keys.erase(key.get());
+    h->hashes[pos] = h->hashes.back();
+    h->hashes.pop_back();
+    seen[pos] = seen.back();
+    seen.pop_back();
+  }
+  return 0;
+}
+
+// rank of an integer field, ordered like the value it holds
+uint64_t field_rank(const uint8_t *leaf, const Layout::Field &f) {
+  uint64_t v = 0;
+  memcpy(&v, leaf + f.offset, f.size);
+  if (!f.is_signed)
+    return v;
+  unsigned shift = 64 - 8 * f.size;
+  v = (uint64_t)((int64_t)(v << shift) >> shift);
+  return v ^ (1ull << 63);
+}
+
+// add (or take away) each integer of by to the one in leaf, wrapping at its
+// width; false for leaves that are not integers
+bool add_counts(const Layout &layout, uint8_t *leaf, const uint8_t *by, bool subtract) {
+  if (layout.kind == Layout::opaque_e)
+    return false;
+  for (auto &f : layout.fields) {
+    for (size_t i = 0; i < std::max<size_t>(f.count, 1); ++i) {
+      size_t at = f.offset + i * f.size;
+      uint64_t v = 0, w = 0;
+      memcpy(&v, leaf + at, f.size);
+      memcpy(&w, by + at, f.size);
+      v = subtract ? v - w : v + w;
+      memcpy(leaf + at, &v, f.size);
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
 int File::getattr(struct stat *st) {
   st->st_mode = S_IFREG | 0444;
   st->st_nlink = 1;
@@ -43,10 +194,26 @@ int File::getattr(struct stat *st) {
 }
 
 int File::open(struct fuse_file_info *fi) {
-  fi->fh = (uintptr_t)this;
+  fi->fh = (uintptr_t)new Handle(this);
+  set_cache(fi);
   return 0;
 }
 
+// Without a way to push invalidations from the high level api, a stale
+// page cache is dropped by the next open not asking to keep it
+void File::set_cache(struct fuse_file_info *fi) {
+  if (cache_ == direct_e) {
+    fi->direct_io = 1;
+    return;
+  }
+  fi->keep_cache = version_ == cached_version_;
+  cached_version_ = version_;
+}
+
+Handle * File::handle(struct fuse_file_info *fi) {
+  return (Handle *)fi->fh;
+}
+
 int File::read_helper(const string &data, char *buf, size_t size,
                       off_t offset, struct fuse_file_info *fi)  {
   if (offset < (off_t)data.size()) {
@@ -74,6 +241,7 @@ int StringFile::write(const char *buf, size_t size, off_t offset, struct fuse_fi
   if (offset > (off_t)data_.size())
     offset = data_.size();
   data_.replace(offset, size, buf, size);
+  changed();
   return size;
 }
 
@@ -82,11 +250,12 @@ int SourceFile::write(const char *buf, size_t size, off_t offset, struct fuse_fi
   return StringFile::write(buf, size, offset, fi);
 }
 
+// the program stays loaded until the new source is flushed, so that its
+// maps can be carried over
 int SourceFile::truncate(off_t newsize) {
   dirty_ = true;
-  if (ProgramDir *parent = dynamic_cast<ProgramDir *>(parent_))
-    parent->unload();
   data_.resize(newsize);
+  changed();
   return 0;
 }
 
@@ -94,13 +263,19 @@ int SourceFile::flush(struct fuse_file_info *fi) {
   if (!dirty_)
     return 0;
   dirty_ = false;
-  if (data_.empty() || data_ == "\n")
+  ProgramDir *parent = dynamic_cast<ProgramDir *>(parent_);
+  if (!parent)
     return 0;
-  if (ProgramDir *parent = dynamic_cast<ProgramDir *>(parent_)) {
+  if (mount_->debouncer()) {
+    parent->load_later(data_);
+    return 0;
+  }
+  if (data_.empty() || data_ == "\n") {
     parent->unload();
-    if (parent->load(data_.c_str()))
-      return -EIO;
+    return 0;
   }
+  if (parent->load(data_.c_str()))
+    return -EIO;
   return 0;
 }
 
@@ -108,97 +283,774 @@ int StatFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *
   return read_helper(data_, buf, size, offset, fi);
 }
 
+int FunctionTypeFile::write(const char *buf, size_t size, off_t offset,
+                            struct fuse_file_info *fi) {
+  dirty_ = true;
+  return StringFile::write(buf, size, offset, fi);
+}
+
+// like the source, the function keeps running until its replacement is
+// loaded on flush
 int FunctionTypeFile::truncate(off_t newsize) {
-  if (FunctionDir *parent = dynamic_cast<FunctionDir *>(parent_))
-    parent->unload();
+  dirty_ = true;
   data_.resize(newsize);
+  changed();
   return 0;
 }
 
 int FunctionTypeFile::flush(struct fuse_file_info *fi) {
-  if (data_.empty() || data_ == "\n")
+  if (!dirty_)
     return 0;
-  if (FunctionDir *parent = dynamic_cast<FunctionDir *>(parent_)) {
+  dirty_ = false;
+  FunctionDir *parent = dynamic_cast<FunctionDir *>(parent_);
+  if (!parent)
+    return 0;
+  if (data_.empty() || data_ == "\n") {
     parent->unload();
-    if (parent->load(data_))
-      return -EIO;
+    return 0;
   }
+  if (parent->load(data_))
+    return -EIO;
+  return 0;
+}
+
+MapStatsFile::MapStatsFile(const TableInfo *table)
+    : File(direct_e), table_(table) {
+}
+
+size_t MapStatsFile::size() const {
   return 0;
 }
 
-MapDumpFile::MapDumpFile(void *bpf_module, int id)
-    : File(), bpf_module_(bpf_module), id_(id),
-    fd_(bpf_table_fd_id(bpf_module_, id_)),
-    key_size_(bpf_table_key_size_id(bpf_module_, id_)),
-    leaf_size_(bpf_table_leaf_size_id(bpf_module_, id_)) {
+// the count is whatever the latest walk over the map found, reading stats
+// never walks it
+int MapStatsFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  MapDir *md = dynamic_cast<MapDir *>(parent_);
+  if (!md) return -EBADF;
+
+  string &data = handle(fi)->data();
+  if (offset && !data.empty())
+    return read_helper(data, buf, size, offset, fi);
+  size_t count;
+  uint64_t ts;
+  if (int rc = md->occupancy(&count, &ts))
+    return rc;
+  char line[512];
+  snprintf(line, sizeof(line),
+           "type %s\nmax_entries %zu\nentries %zu\nfill %.3f\nkey_size %zu\nleaf_size %zu\n"
+           "memory %zu\nrefreshed_ns %llu\nage_ms %llu\ncached %zu\ncache_max %zu\n"
+           "evictions %llu\n",
+           map_type_name(table_->type), table_->max_entries, count,
+           table_->max_entries ? (double)count / table_->max_entries : 0.0,
+           table_->key_size, table_->leaf_size, map_memory(*table_),
+           (unsigned long long)ts, (unsigned long long)(now_ns() - ts) / 1000000,
+           md->cached(), mount_->entry_cache(), (unsigned long long)md->evictions());
+  data = line;
+  return read_helper(data, buf, size, offset, fi);
+}
+
+MapDumpFile::MapDumpFile(const TableInfo *table)
+    : File(direct_e), table_(table) {
 }
 
+// built on read, there is no size to report that would not take a walk
 size_t MapDumpFile::size() const {
-  unique_ptr<uint8_t[]> key(new uint8_t[key_size_]);
-  memset(&key[0], 0, key_size_);
-  size_t size = 0;
-  while (bpf_get_next_key(fd_, &key[0], &key[0]) == 0) {
-    size += leaf_size_ * 2 + key_size_ * 2 + 2;
-  }
-  log("MapDumpFile::size %zu\n", size);
-  return 4096;
+  return 0;
+}
+
+int MapDumpFile::open(struct fuse_file_info *fi) {
+  if (int rc = File::open(fi))
+    return rc;
+  handle(fi)->watch(WatchTarget(WatchTarget::map_e, table_->fd, table_->key_size,
+                                table_->leaf_size));
+  return 0;
 }
 
+// the dump is built once per pass, the handle serves the rest of it
 int MapDumpFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-  unique_ptr<uint8_t[]> key(new uint8_t[key_size_]);
-  unique_ptr<uint8_t[]> leaf(new uint8_t[leaf_size_]);
-  unique_ptr<char[]> key_str(new char[key_size_ * 8]);
-  unique_ptr<char[]> leaf_str(new char[leaf_size_ * 8]);
-  memset(&key[0], 0, key_size_);
-  stringstream ss;
-  while (bpf_get_next_key(fd_, &key[0], &key[0]) == 0) {
-    if (bpf_lookup_elem(fd_, &key[0], &leaf[0]) == 0) {
-      if (bpf_table_key_snprintf(bpf_module_, id_, &key_str[0], key_size_ * 8, &key[0]))
+  string &data = handle(fi)->data();
+  if (offset && !data.empty())
+    return read_helper(data, buf, size, offset, fi);
+  Scheduler::Slot slot;
+  if (int rc = admit_scan(*table_, &slot))
+    return rc;
+  const TableCodec &codec = *table_->codec;
+  Scratch key(table_->key_size), leaf(table_->leaf_size);
+  void *prev = nullptr;
+  data.clear();
+  uint64_t ts = now_ns();
+  size_t n = 0;
+  while (bpf_get_next_key(table_->fd, prev, key.get()) == 0) {
+    prev = key.get();
+    ++n;
+    if (bpf_lookup_elem(table_->fd, key.get(), leaf.get()) == 0) {
+      if (codec.format_key(key.get(), &data))
         return -EIO;
-      if (bpf_table_leaf_snprintf(bpf_module_, id_, &leaf_str[0], leaf_size_ * 8, &leaf[0]))
+      data.push_back(' ');
+      if (codec.format_leaf(leaf.get(), &data))
         return -EIO;
-      ss << &key_str[0] << " " << &leaf_str[0] << "\n";
+      data.push_back('\n');
     }
   }
-  return read_helper(ss.str(), buf, size, offset, fi);
+  // the walk counted the entries, stats need not do it again
+  if (MapDir *md = dynamic_cast<MapDir *>(parent_))
+    md->counted(n, ts);
+  return read_helper(data, buf, size, offset, fi);
+}
+
+MapKeysFile::MapKeysFile(const TableInfo *table)
+    : File(direct_e), table_(table) {
+}
+
+int MapKeysFile::open(struct fuse_file_info *fi) {
+  if (int rc = File::open(fi))
+    return rc;
+  handle(fi)->watch(WatchTarget(WatchTarget::keys_e, table_->fd, table_->key_size,
+                                table_->leaf_size));
+  return 0;
+}
+
+int MapKeysFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  string &data = handle(fi)->data();
+  if (offset && !data.empty())
+    return read_helper(data, buf, size, offset, fi);
+  Scheduler::Slot slot;
+  if (int rc = admit_scan(*table_, &slot))
+    return rc;
+  const TableCodec &codec = *table_->codec;
+  Scratch key(table_->key_size);
+  void *prev = nullptr;
+  data.clear();
+  uint64_t ts = now_ns();
+  size_t n = 0;
+  while (bpf_get_next_key(table_->fd, prev, key.get()) == 0) {
+    prev = key.get();
+    ++n;
+    if (codec.format_key(key.get(), &data))
+      return -EIO;
+    data.push_back('\n');
+  }
+  if (MapDir *md = dynamic_cast<MapDir *>(parent_))
+    md->counted(n, ts);
+  return read_helper(data, buf, size, offset, fi);
+}
+
+MapChangesFile::MapChangesFile(const TableInfo *table)
+    : File(direct_e), table_(table) {
+}
+
+int MapChangesFile::open(struct fuse_file_info *fi) {
+  ChangesHandle *h = new ChangesHandle(this, table_->key_size);
+  h->watch(WatchTarget(WatchTarget::map_e, table_->fd, table_->key_size, table_->leaf_size));
+  fi->fh = (uintptr_t)h;
+  set_cache(fi);
+  return 0;
+}
+
+// the changes are taken once per pass, the handle serves the rest of them
+int MapChangesFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  ChangesHandle *h = static_cast<ChangesHandle *>(handle(fi));
+  string &data = h->data();
+  if (offset && !data.empty())
+    return read_helper(data, buf, size, offset, fi);
+  Scheduler::Slot slot;
+  if (int rc = admit_scan(*table_, &slot))
+    return rc;
+  size_t max_keys = mount_->changes_max_keys();
+  data.clear();
+  int rc = h->resync ? 1 : diff_changes(*table_, max_keys, h, &data);
+  if (rc == 1)
+    rc = resync_changes(*table_, max_keys, h, &data);
+  if (rc) {
+    // whatever the client had is of no use after a failed read
+    h->resync = true;
+    data.clear();
+    return rc;
+  }
+  return read_helper(data, buf, size, offset, fi);
+}
+
+int ControlFile::write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  if (offset > (off_t)text_.size())
+    offset = text_.size();
+  text_.replace(offset, size, buf, size);
+  dirty_ = true;
+  return size;
+}
+
+int ControlFile::truncate(off_t newsize) {
+  text_.resize(newsize);
+  dirty_ = true;
+  return 0;
+}
+
+int ControlFile::flush(struct fuse_file_info *fi) {
+  if (!dirty_)
+    return 0;
+  dirty_ = false;
+  if (text_.empty())
+    return 0;
+  return apply(text_);
+}
+
+int SchedFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  string data = mount_->scheduler()->stats();
+  return read_helper(data, buf, size, offset, fi);
+}
+
+int SchedFile::apply(const string &text) {
+  uid_t uid = Mount::caller_uid();
+  if (uid && uid != getuid())
+    return -EPERM;
+  return mount_->scheduler()->configure(text);
+}
+
+#define DEFAULT_TOP_K 10
+#define MAX_TOP_K 65536
+MapTopFile::MapTopFile(const TableInfo *table)
+    : ControlFile(), table_(table), k_(0) {
+  // integer leaves have a query that works without being set
+  if (const Layout::Field *f = table_->codec->leaf_layout().field("")) {
+    k_ = DEFAULT_TOP_K;
+    field_ = *f;
+  }
+}
+
+int MapTopFile::open(struct fuse_file_info *fi) {
+  if (int rc = File::open(fi))
+    return rc;
+  handle(fi)->watch(WatchTarget(WatchTarget::map_e, table_->fd, table_->key_size,
+                                table_->leaf_size));
+  return 0;
+}
+
+int MapTopFile::apply(const string &text) {
+  unsigned long k;
+  char name[64] = "";
+  int end = 0;
+  if (sscanf(text.c_str(), "%lu %n%63s %n", &k, &end, name, &end) < 1 ||
+      end != (int)text.size() || !k || k > MAX_TOP_K)
+    return -EINVAL;
+  const Layout::Field *f = table_->codec->leaf_layout().field(name);
+  if (!f || f->count)
+    return -EINVAL;
+  k_ = k;
+  field_ = *f;
+  return 0;
+}
+
+// one pass over the map, holding only the k largest seen so far in a min-heap
+int MapTopFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  string &data = handle(fi)->data();
+  if (offset && !data.empty())
+    return read_helper(data, buf, size, offset, fi);
+  Scheduler::Slot slot;
+  if (int rc = admit_scan(*table_, &slot))
+    return rc;
+  if (!k_)
+    return -EINVAL;
+  size_t key_size = table_->key_size, leaf_size = table_->leaf_size;
+  size_t entry_size = key_size + leaf_size;
+  vector<uint8_t> entries;
+  vector<std::pair<uint64_t, size_t>> heap;
+  std::greater<std::pair<uint64_t, size_t>> later;
+  Scratch key(key_size), leaf(leaf_size);
+  void *prev = nullptr;
+  while (bpf_get_next_key(table_->fd, prev, key.get()) == 0) {
+    prev = key.get();
+    if (bpf_lookup_elem(table_->fd, key.get(), leaf.get()))
+      continue;
+    uint64_t rank = field_rank(leaf.get(), field_);
+    size_t slot;
+    if (heap.size() < k_) {
+      slot = heap.size();
+      entries.resize((slot + 1) * entry_size);
+    } else if (rank > heap.front().first) {
+      std::pop_heap(heap.begin(), heap.end(), later);
+      slot = heap.back().second;
+      heap.pop_back();
+    } else {
+      continue;
+    }
+    memcpy(&entries[slot * entry_size], key.get(), key_size);
+    memcpy(&entries[slot * entry_size + key_size], leaf.get(), leaf_size);
+    heap.push_back(std::make_pair(rank, slot));
+    std::push_heap(heap.begin(), heap.end(), later);
+  }
+  std::sort(heap.begin(), heap.end(), later);
+  const TableCodec &codec = *table_->codec;
+  data.clear();
+  for (auto &h : heap) {
+    const uint8_t *e = &entries[h.second * entry_size];
+    if (codec.format_key(e, &data))
+      return -EIO;
+    data.push_back(' ');
+    if (codec.format_leaf(e + key_size, &data))
+      return -EIO;
+    data.push_back('\n');
+  }
+  return read_helper(data, buf, size, offset, fi);
+}
+
+MapQueryFile::MapQueryFile(const TableInfo *table)
+    : ControlFile(), table_(table) {
+}
+
+int MapQueryFile::open(struct fuse_file_info *fi) {
+  if (int rc = File::open(fi))
+    return rc;
+  handle(fi)->watch(WatchTarget(WatchTarget::map_e, table_->fd, table_->key_size,
+                                table_->leaf_size));
+  return 0;
+}
+
+int MapQueryFile::apply(const string &text) {
+  return query_.compile(text, *table_->codec);
+}
+
+// keys are tested before their leaf is even looked up, and only matching
+// entries are formatted
+int MapQueryFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  string &data = handle(fi)->data();
+  if (offset && !data.empty())
+    return read_helper(data, buf, size, offset, fi);
+  Scheduler::Slot slot;
+  if (int rc = admit_scan(*table_, &slot))
+    return rc;
+  const TableCodec &codec = *table_->codec;
+  size_t key_size = table_->key_size, leaf_size = table_->leaf_size;
+  bool binary = query_.format() == Query::binary_e;
+  Scratch key(key_size), leaf(leaf_size);
+  void *prev = nullptr;
+  data.clear();
+  while (bpf_get_next_key(table_->fd, prev, key.get()) == 0) {
+    prev = key.get();
+    if (!query_.match_key(key.get()) || bpf_lookup_elem(table_->fd, key.get(), leaf.get()) ||
+        !query_.match_leaf(leaf.get()))
+      continue;
+    if (binary) {
+      data.append((const char *)key.get(), key_size);
+      data.append((const char *)leaf.get(), leaf_size);
+      continue;
+    }
+    if (codec.format_key(key.get(), &data))
+      return -EIO;
+    data.push_back(' ');
+    if (codec.format_leaf(leaf.get(), &data))
+      return -EIO;
+    data.push_back('\n');
+  }
+  return read_helper(data, buf, size, offset, fi);
+}
+
+MapLookupFile::MapLookupFile(const TableInfo *table, bool binary)
+    : File(direct_e), table_(table), binary_(binary) {
+}
+
+int MapLookupFile::open(struct fuse_file_info *fi) {
+  fi->fh = (uintptr_t)new LookupHandle(this);
+  set_cache(fi);
+  return 0;
+}
+
+// a write after a read starts the next batch
+#define MAX_LOOKUP_BYTES (16 << 20)
+int MapLookupFile::write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  LookupHandle *h = static_cast<LookupHandle *>(handle(fi));
+  // leaves are answered at leaf size, a per-cpu value does not fit
+  if (percpu_map(table_->type))
+    return -EINVAL;
+  if (h->taken) {
+    h->input.clear();
+    h->taken = false;
+  }
+  if (h->input.size() + size > MAX_LOOKUP_BYTES)
+    return -E2BIG;
+  h->input.append(buf, size);
+  return size;
+}
+
+int MapLookupFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  LookupHandle *h = static_cast<LookupHandle *>(handle(fi));
+  string &data = h->data();
+  if (offset && !data.empty())
+    return read_helper(data, buf, size, offset, fi);
+  const TableCodec &codec = *table_->codec;
+  size_t key_size = table_->key_size, leaf_size = table_->leaf_size;
+  if (!h->taken) {
+    h->taken = true;
+    h->keys.clear();
+    if (binary_) {
+      if (h->input.size() % key_size) {
+        h->input.clear();
+        return -EINVAL;
+      }
+      h->keys.assign(h->input.begin(), h->input.end());
+    } else {
+      string line;
+      for (size_t pos = 0, end; pos < h->input.size(); pos = end + 1) {
+        end = h->input.find('\n', pos);
+        if (end == string::npos)
+          end = h->input.size();
+        line.assign(h->input, pos, end - pos);
+        if (line.empty())
+          continue;
+        h->keys.resize(h->keys.size() + key_size);
+        if (codec.parse_key(line.c_str(), &h->keys[h->keys.size() - key_size])) {
+          h->keys.clear();
+          h->input.clear();
+          return -EINVAL;
+        }
+      }
+    }
+    h->input.clear();
+  }
+  size_t n = h->keys.size() / key_size;
+  int fd = table_->fd;
+  data.clear();
+  if (binary_) {
+    data.assign(n * (1 + leaf_size), 0);
+    uint8_t *found = (uint8_t *)&data[0], *leaves = found + n;
+    for (size_t i = 0; i < n; ++i)
+      found[i] = bpf_lookup_elem(fd, &h->keys[i * key_size], leaves + i * leaf_size) == 0;
+    return read_helper(data, buf, size, offset, fi);
+  }
+  Scratch leaf(leaf_size);
+  for (size_t i = 0; i < n; ++i) {
+    uint8_t *key = &h->keys[i * key_size];
+    if (codec.format_key(key, &data))
+      return -EIO;
+    if (bpf_lookup_elem(fd, key, leaf.get())) {
+      data.append(" -\n");
+      continue;
+    }
+    data.push_back(' ');
+    if (codec.format_leaf(leaf.get(), &data))
+      return -EIO;
+    data.push_back('\n');
+  }
+  return read_helper(data, buf, size, offset, fi);
+}
+
+MapClearFile::MapClearFile(const TableInfo *table)
+    : ControlFile(), table_(table), cleared_(0) {
+}
+
+int MapClearFile::apply(const string &text) {
+  Scheduler::Slot slot;
+  if (int rc = admit_scan(*table_, &slot))
+    return rc;
+  cleared_ = clear_map(*table_);
+  if (MapDir *md = dynamic_cast<MapDir *>(parent_))
+    md->refresh(true);
+  return 0;
+}
+
+int MapClearFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  return read_helper(std::to_string(cleared_) + "\n", buf, size, offset, fi);
+}
+
+MapSwapFile::MapSwapFile(const TableInfo *table, const TableInfo *alt, const TableInfo *sel)
+    : File(direct_e), table_(table), alt_(alt), sel_(sel), listed_any_(false),
+      listed_(table->key_size) {
+}
+
+// The copy the program goes back to was retired by the previous read, so
+// runs that picked it before that switch had a whole interval to finish.
+// What they added after it was listed is counted in this read before the
+// copy is cleared. Leaves that are not integers cannot be added up: a late
+// one is only listed when the key is missing from the other copy.
+int MapSwapFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  string &data = handle(fi)->data();
+  if (offset && !data.empty())
+    return read_helper(data, buf, size, offset, fi);
+  Scheduler::Slot slot;
+  if (int rc = admit_scan(*table_, &slot))
+    return rc;
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint32_t zero = 0, cur = 0;
+  if (bpf_lookup_elem(sel_->fd, &zero, &cur))
+    cur = 0;
+  const TableInfo &old = cur ? *alt_ : *table_, &spare = cur ? *table_ : *alt_;
+  const Layout &layout = old.codec->leaf_layout();
+  size_t key_size = old.key_size, leaf_size = old.leaf_size;
+  Scratch key(key_size), leaf(leaf_size);
+  KeySet late(key_size);
+  vector<uint8_t> late_leaves;
+  void *prev = nullptr;
+  while (listed_any_ && bpf_get_next_key(spare.fd, prev, key.get()) == 0) {
+    prev = key.get();
+    if (bpf_lookup_elem(spare.fd, key.get(), leaf.get()))
+      continue;
+    size_t pos = listed_.find(key.get());
+    if (pos != KeySet::npos) {
+      const uint8_t *was = &listed_leaves_[pos * leaf_size];
+      if (!memcmp(was, leaf.get(), leaf_size))
+        continue;
+      add_counts(layout, leaf.get(), was, true);
+    }
+    late.insert(key.get());
+    late_leaves.insert(late_leaves.end(), leaf.get(), leaf.get() + leaf_size);
+  }
+  clear_map(spare);
+  uint32_t next = cur ? 0 : 1;
+  if (bpf_update_elem(sel_->fd, &zero, &next, BPF_ANY))
+    return -EIO;
+  usleep(mount_->swap_grace_us());
+
+  const TableCodec &codec = *old.codec;
+  vector<bool> added(late.size(), false);
+  listed_.clear();
+  listed_leaves_.clear();
+  data.clear();
+  prev = nullptr;
+  while (bpf_get_next_key(old.fd, prev, key.get()) == 0) {
+    prev = key.get();
+    if (bpf_lookup_elem(old.fd, key.get(), leaf.get()))
+      continue;
+    listed_.insert(key.get());
+    listed_leaves_.insert(listed_leaves_.end(), leaf.get(), leaf.get() + leaf_size);
+    size_t pos = late.find(key.get());
+    if (pos != KeySet::npos && add_counts(layout, leaf.get(), &late_leaves[pos * leaf_size], false))
+      added[pos] = true;
+    if (append_entry(codec, key.get(), leaf.get(), &data))
+      return -EIO;
+  }
+  listed_any_ = true;
+  for (size_t pos = 0; pos < late.size(); ++pos) {
+    if (added[pos] || listed_.find(late.key(pos)) != KeySet::npos)
+      continue;
+    if (append_entry(codec, late.key(pos), &late_leaves[pos * leaf_size], &data))
+      return -EIO;
+  }
+  if (&spare == table_) {
+    if (MapDir *md = dynamic_cast<MapDir *>(parent_))
+      md->refresh(true);
+  }
+  return read_helper(data, buf, size, offset, fi);
+}
+
+#define MAX_SAMPLE_FRAMES 3600
+MapSampleFile::MapSampleFile(const TableInfo *table)
+    : ControlFile(), table_(table) {
+}
+
+int MapSampleFile::apply(const string &text) {
+  MapDir *md = dynamic_cast<MapDir *>(parent_);
+  if (!md) return -EBADF;
+
+  unsigned interval_ms = 0;
+  unsigned long frames = 0;
+  char name[64] = "";
+  int end = 0;
+  int n = sscanf(text.c_str(), "%u %n%lu %n%63s %n", &interval_ms, &end, &frames, &end, name,
+                 &end);
+  if (n < 1 || end != (int)text.size())
+    return -EINVAL;
+  if (!interval_ms) {
+    md->set_sampler(nullptr);
+    return 0;
+  }
+  if (n < 2 || frames < 2 || frames > MAX_SAMPLE_FRAMES)
+    return -EINVAL;
+  const Layout::Field *f = table_->codec->leaf_layout().field(name);
+  if (!f || f->count)
+    return -EINVAL;
+  // stop the old sampler before the new one takes its first frame
+  md->set_sampler(nullptr);
+  md->set_sampler(make_unique<Sampler>(table_, *f, interval_ms, frames));
+  return 0;
+}
+
+int MapSampleFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  MapDir *md = dynamic_cast<MapDir *>(parent_);
+  if (!md) return -EBADF;
+
+  std::shared_ptr<Sampler> sampler = md->sampler();
+  string data = sampler ? sampler->config() : "0\n";
+  return read_helper(data, buf, size, offset, fi);
+}
+
+MapPublishFile::MapPublishFile(const TableInfo *table)
+    : ControlFile(), table_(table) {
+}
+
+int MapPublishFile::apply(const string &text) {
+  MapDir *md = dynamic_cast<MapDir *>(parent_);
+  if (!md) return -EBADF;
+
+  unsigned interval_ms = 0;
+  int end = 0;
+  if (sscanf(text.c_str(), "%u %n", &interval_ms, &end) < 1 || end != (int)text.size())
+    return -EINVAL;
+  md->set_publisher(nullptr);
+  if (!interval_ms)
+    return 0;
+  unique_ptr<Publisher> publisher = Publisher::create(table_, interval_ms);
+  if (!publisher)
+    return -errno;
+  md->set_publisher(move(publisher));
+  return 0;
+}
+
+int MapPublishFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  MapDir *md = dynamic_cast<MapDir *>(parent_);
+  if (!md) return -EBADF;
+
+  std::shared_ptr<Publisher> publisher = md->publisher();
+  string data = publisher ? publisher->config() : "0\n";
+  return read_helper(data, buf, size, offset, fi);
+}
+
+MapMetricsFile::MapMetricsFile(const TableInfo *table)
+    : ControlFile(), table_(table) {
+}
+
+int MapMetricsFile::apply(const string &text) {
+  MapDir *md = dynamic_cast<MapDir *>(parent_);
+  if (!md) return -EBADF;
+
+  auto metrics = make_unique<MetricSet>();
+  if (int rc = metrics->compile(text, *table_->codec))
+    return rc;
+  // /metrics holds the families of every program, each name once
+  vector<MapDir *> maps;
+  if (RootDir *root = dynamic_cast<RootDir *>(mount_->root()))
+    root->metric_maps(&maps);
+  for (MapDir *other : maps)
+    if (other != md) {
+      std::shared_ptr<const MetricSet> theirs = other->metrics();
+      if (theirs && metrics->clashes(*theirs))
+        return -EINVAL;
+    }
+  md->set_metrics(metrics->empty() ? nullptr : move(metrics));
+  return 0;
+}
+
+int MapMetricsFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  MapDir *md = dynamic_cast<MapDir *>(parent_);
+  if (!md) return -EBADF;
+
+  std::shared_ptr<const MetricSet> metrics = md->metrics();
+  string data = metrics ? metrics->text() : string();
+  return read_helper(data, buf, size, offset, fi);
+}
+
+// one walk per configured map; the walks go through the scheduler like any
+// other, and scrapes take turns on the buffers once they have their slot
+int MetricsFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  string &data = handle(fi)->data();
+  if (offset && !data.empty())
+    return read_helper(data, buf, size, offset, fi);
+  vector<MapDir *> maps;
+  if (RootDir *root = dynamic_cast<RootDir *>(parent_))
+    root->metric_maps(&maps);
+  else if (ProgramDir *pd = dynamic_cast<ProgramDir *>(parent_))
+    pd->metric_maps(&maps);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (spare_.capacity() > data.capacity())
+      data.swap(spare_);
+  }
+  data.clear();
+  for (MapDir *md : maps) {
+    Scheduler::Slot slot;
+    if (int rc = admit_scan(md->table(), &slot))
+      return rc;
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::shared_ptr<const MetricSet> metrics = md->metrics();
+    uint64_t ts = now_ns();
+    if (metrics)
+      md->counted(metrics->render(md->table(), &data, &sections_), ts);
+  }
+  data.append("# EOF\n");
+  return read_helper(data, buf, size, offset, fi);
+}
+
+// the text of this scrape is where the next one starts
+int MetricsFile::release(struct fuse_file_info *fi) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  string &data = handle(fi)->data();
+  if (data.capacity() > spare_.capacity())
+    spare_.swap(data);
+  return 0;
+}
+
+int MapSeriesFile::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  MapDir *md = dynamic_cast<MapDir *>(parent_);
+  if (!md) return -EBADF;
+
+  string &data = handle(fi)->data();
+  if (offset && !data.empty())
+    return read_helper(data, buf, size, offset, fi);
+  data.clear();
+  if (std::shared_ptr<Sampler> sampler = md->sampler()) {
+    if (int rc = rate_ ? sampler->rate(&data) : sampler->series(&data))
+      return rc;
+  }
+  return read_helper(data, buf, size, offset, fi);
 }
 
 MapEntry::MapEntry(unique_ptr<uint8_t[]> key, size_t leaf_size)
-    : StringFile(), key_(move(key)), leaf_size_(leaf_size), dirty_(false) {
+    : StringFile(direct_e), key_(move(key)), leaf_size_(leaf_size), dirty_(false), opens_(0),
+      used_(0) {
   refresh();
 }
 
 int MapEntry::getattr(struct stat *st) {
+  MapDir *md = dynamic_cast<MapDir *>(parent_);
+  size_t size;
+  if (!dirty_ && md && md->cached_size(&key_[0], &size)) {
+    StringFile::getattr(st);
+    st->st_size = size;
+    return 0;
+  }
   if (int rc = refresh())
     return rc;
   return StringFile::getattr(st);
 }
 
 int MapEntry::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  // a poller reads the same handle again once told the value changed
+  if (offset == 0) {
+    if (int rc = refresh())
+      return rc;
+  }
   return read_helper(data_, buf, size, offset, fi);
 }
 
 int MapEntry::truncate(off_t newsize) {
-  if (data_.size() != (size_t)newsize)
-    dirty_ = true;
+  dirty_ = true;
   data_.resize(newsize);
+  changed();
   return 0;
 }
 
 int MapEntry::flush(struct fuse_file_info *fi) {
-  unique_ptr<uint8_t[]> leaf(new uint8_t[leaf_size_]);
   MapDir *md = dynamic_cast<MapDir *>(parent_);
   if (!md) return -EBADF;
 
   if (!dirty_)
     return 0;
-  if (data_.empty() || data_ == "\n")
+  if (data_.empty() || data_ == "\n") {
+    dirty_ = false;
     return 0;
+  }
   int fd = md->map_fd();
-  if (bpf_table_leaf_sscanf(md->mod(), md->map_id(), data_.c_str(), &leaf[0]))
+  Scratch leaf(leaf_size_);
+  if (md->codec().parse_leaf(data_.c_str(), leaf.get()))
     return -EIO;
-  if (bpf_update_elem(fd, &key_[0], &leaf[0], 0))
+  if (bpf_update_elem(fd, &key_[0], leaf.get(), 0))
     return -EIO;
+  md->forget_sizes();
+  dirty_ = false;
+  return 0;
+}
+
+// once idle, the map directory may evict the inode
+int MapEntry::release(struct fuse_file_info *fi) {
+  if (opens_ > 0)
+    --opens_;
   return 0;
 }
 
@@ -217,24 +1069,122 @@ int MapEntry::write(const char *buf, size_t size, off_t offset, struct fuse_file
 }
 
 int MapEntry::refresh() {
-  unique_ptr<uint8_t[]> leaf(new uint8_t[leaf_size_]);
-  unique_ptr<char[]> leaf_str(new char[leaf_size_ * 8]);
   MapDir *md = dynamic_cast<MapDir *>(parent_);
   if (!md) return -EBADF;
 
+  // keep what a writer truncated or wrote until it is flushed
+  if (dirty_)
+    return 0;
   int fd = md->map_fd();
-  if (bpf_lookup_elem(fd, &key_[0], &leaf[0]))
+  Scratch leaf(leaf_size_);
+  if (bpf_lookup_elem(fd, &key_[0], leaf.get()))
     return 0;
-  if (bpf_table_leaf_snprintf(md->mod(), md->map_id(), &leaf_str[0], leaf_size_ * 8, &leaf[0]))
+  data_.clear();
+  if (md->codec().format_leaf(leaf.get(), &data_))
     return -EIO;
-  data_ = string(&leaf_str[0]) + "\n";
+  data_.push_back('\n');
   return 0;
 }
 
 int MapEntry::open(struct fuse_file_info *fi) {
+  MapDir *md = dynamic_cast<MapDir *>(parent_);
+  if (!md) return -EBADF;
+
+  if (int rc = refresh())
+    return rc;
+  if (int rc = File::open(fi))
+    return rc;
+  ++opens_;
+  handle(fi)->watch(WatchTarget(WatchTarget::leaf_e, md->map_fd(), md->table().key_size,
+                                leaf_size_, &key_[0]));
+  return 0;
+}
+
+RawMapEntry::RawMapEntry(unique_ptr<uint8_t[]> key, size_t leaf_size, bool created)
+    : File(direct_e), key_(move(key)), leaf_(new uint8_t[leaf_size]), leaf_size_(leaf_size),
+    dirty_(created), opens_(0) {
+  memset(&leaf_[0], 0, leaf_size_);
+}
+
+int RawMapEntry::refresh() {
+  RawMapDir *rd = dynamic_cast<RawMapDir *>(parent_);
+  if (!rd) return -EBADF;
+
+  // a created entry that has not been flushed yet is not in the map
+  if (dirty_)
+    return 0;
+  if (bpf_lookup_elem(rd->map_fd(), &key_[0], &leaf_[0]))
+    return -ENOENT;
+  return 0;
+}
+
+int RawMapEntry::getattr(struct stat *st) {
+  if (int rc = refresh())
+    return rc;
+  st->st_mode = S_IFREG | mode_;
+  st->st_nlink = 1;
+  st->st_size = leaf_size_;
+  return 0;
+}
+
+int RawMapEntry::open(struct fuse_file_info *fi) {
   if (int rc = refresh())
     return rc;
+  ++opens_;
   return File::open(fi);
 }
 
+int RawMapEntry::read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  if (offset >= (off_t)leaf_size_)
+    return 0;
+  if (offset + size > leaf_size_)
+    size = leaf_size_ - offset;
+  memcpy(buf, &leaf_[offset], size);
+  return size;
+}
+
+int RawMapEntry::write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  if (offset + size > leaf_size_)
+    return -EFBIG;
+  memcpy(&leaf_[offset], buf, size);
+  dirty_ = true;
+  return size;
+}
+
+// the value has a fixed size, truncating only zeroes the tail
+int RawMapEntry::truncate(off_t newsize) {
+  if (newsize > (off_t)leaf_size_)
+    return -EFBIG;
+  memset(&leaf_[newsize], 0, leaf_size_ - newsize);
+  dirty_ = true;
+  return 0;
+}
+
+int RawMapEntry::flush(struct fuse_file_info *fi) {
+  RawMapDir *rd = dynamic_cast<RawMapDir *>(parent_);
+  if (!rd) return -EBADF;
+
+  if (!dirty_)
+    return 0;
+  dirty_ = false;
+  if (bpf_update_elem(rd->map_fd(), &key_[0], &leaf_[0], 0))
+    return -EIO;
+  return 0;
+}
+
+int RawMapEntry::release(struct fuse_file_info *fi) {
+  if (opens_ > 0)
+    --opens_;
+  return 0;
+}
+
+int RawMapEntry::unlink() {
+  RawMapDir *rd = dynamic_cast<RawMapDir *>(parent_);
+  if (!rd) return -EBADF;
+
+  if (bpf_delete_elem(rd->map_fd(), &key_[0]))
+    return -ENOENT;
+  return 0;
+}
+
 }  // namespace bcc
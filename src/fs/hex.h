@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace bcc {
+
+// Fixed width lowercase hex, two characters per byte, in memory order.
+// The SSE2 paths handle 16 bytes at a time, the scalar loops the tail.
+
+static inline
+char * hex_encode(const uint8_t *src, size_t n, char *dst) {
+  static const char digits[] = "0123456789abcdef";
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i alpha = _mm_set1_epi8('a' - '0' - 10);
+  for (; i + 16 <= n; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i lo = _mm_and_si128(in, mask);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), mask);
+    __m128i a = _mm_unpacklo_epi8(hi, lo);
+    __m128i b = _mm_unpackhi_epi8(hi, lo);
+    a = _mm_add_epi8(_mm_add_epi8(a, zero), _mm_and_si128(_mm_cmpgt_epi8(a, nine), alpha));
+    b = _mm_add_epi8(_mm_add_epi8(b, zero), _mm_and_si128(_mm_cmpgt_epi8(b, nine), alpha));
+    _mm_storeu_si128((__m128i *)(dst + 2 * i), a);
+    _mm_storeu_si128((__m128i *)(dst + 2 * i + 16), b);
+  }
+#endif
+  for (; i < n; ++i) {
+    dst[2 * i] = digits[src[i] >> 4];
+    dst[2 * i + 1] = digits[src[i] & 0xf];
+  }
+  return dst + 2 * n;
+}
+
+static inline
+int hex_nibble(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+// decode 2*n characters of either case into n bytes, false on bad input
+static inline
+bool hex_decode(const char *src, size_t n, uint8_t *dst) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i lower = _mm_set1_epi8(0x20);
+  const __m128i a = _mm_set1_epi8('a');
+  const __m128i five = _mm_set1_epi8(5);
+  const __m128i ten = _mm_set1_epi8(10);
+  const __m128i lo_byte = _mm_set1_epi16(0x00ff);
+  for (; i + 16 <= n; i += 16) {
+    __m128i w[2];
+    for (int j = 0; j < 2; ++j) {
+      __m128i c = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16 * j));
+      __m128i d = _mm_sub_epi8(c, zero);
+      __m128i is_d = _mm_cmpeq_epi8(_mm_max_epu8(d, nine), nine);
+      __m128i l = _mm_sub_epi8(_mm_or_si128(c, lower), a);
+      __m128i is_l = _mm_cmpeq_epi8(_mm_max_epu8(l, five), five);
+      if (_mm_movemask_epi8(_mm_or_si128(is_d, is_l)) != 0xffff)
+        return false;
+      __m128i v = _mm_or_si128(_mm_and_si128(is_d, d),
+                               _mm_andnot_si128(is_d, _mm_add_epi8(l, ten)));
+      // high nibble in the even byte, low nibble in the odd byte
+      w[j] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, lo_byte), 4), _mm_srli_epi16(v, 8));
+    }
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(w[0], w[1]));
+  }
+#endif
+  for (; i < n; ++i) {
+    int hi = hex_nibble(src[2 * i]), lo = hex_nibble(src[2 * i + 1]);
+    if (hi < 0 || lo < 0)
+      return false;
+    dst[i] = (hi << 4) | lo;
+  }
+  return true;
+}
+
+}  // namespace bcc
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "hash.h"
+#include "keyset.h"
+
+namespace bcc {
+
+const size_t KeySet::npos;
+
+KeySet::KeySet(size_t key_size)
+    : key_size_(key_size), size_(0) {
+}
+
+void KeySet::clear() {
+  // keep the capacity, a refresh refills with about as many keys
+  size_ = 0;
+  keys_.clear();
+  std::fill(slots_.begin(), slots_.end(), 0);
+}
+
+// slot holding key, or the empty slot where it would go
+size_t KeySet::slot_of(const void *key) const {
+  size_t mask = slots_.size() - 1;
+  for (size_t i = hash_bytes(key, key_size_) & mask;; i = (i + 1) & mask) {
+    uint32_t s = slots_[i];
+    if (!s || !memcmp(&keys_[(s - 1) * key_size_], key, key_size_))
+      return i;
+  }
+}
+
+size_t KeySet::insert(const void *key) {
+  if ((size_ + 1) * 4 > slots_.size() * 3)
+    grow();
+  size_t i = slot_of(key);
+  if (slots_[i])
+    return slots_[i] - 1;
+  const uint8_t *k = (const uint8_t *)key;
+  keys_.insert(keys_.end(), k, k + key_size_);
+  slots_[i] = ++size_;
+  return size_ - 1;
+}
+
+size_t KeySet::find(const void *key) const {
+  if (!size_)
+    return npos;
+  uint32_t s = slots_[slot_of(key)];
+  return s ? s - 1 : npos;
+}
+
+void KeySet::erase(const void *key) {
+  if (!size_)
+    return;
+  size_t mask = slots_.size() - 1;
+  size_t i = slot_of(key);
+  if (!slots_[i])
+    return;
+  size_t pos = slots_[i] - 1;
+  // shift later members of the probe run back so lookups need no tombstones
+  for (size_t j = (i + 1) & mask; slots_[j]; j = (j + 1) & mask) {
+    size_t home = hash_bytes(&keys_[(slots_[j] - 1) * key_size_], key_size_) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      slots_[i] = slots_[j];
+      i = j;
+    }
+  }
+  slots_[i] = 0;
+  // keep positions dense by moving the last key into the hole
+  size_t last = --size_;
+  if (pos != last) {
+    slots_[slot_of(&keys_[last * key_size_])] = pos + 1;
+    memcpy(&keys_[pos * key_size_], &keys_[last * key_size_], key_size_);
+  }
+  keys_.resize(size_ * key_size_);
+}
+
+void KeySet::grow() {
+  slots_.assign(slots_.empty() ? 16 : slots_.size() * 2, 0);
+  size_t mask = slots_.size() - 1;
+  for (size_t pos = 0; pos < size_; ++pos) {
+    size_t i = hash_bytes(&keys_[pos * key_size_], key_size_) & mask;
+    while (slots_[i])
+      i = (i + 1) & mask;
+    slots_[i] = pos + 1;
+  }
+}
+
+size_t KeySet::memory() const {
+  return keys_.capacity() + slots_.capacity() * sizeof(slots_[0]);
+}
+
+}  // namespace bcc
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace bcc {
+
+// Set of fixed size keys, stored back to back in one array and indexed by
+// an open addressing table of positions. Per key this costs the key itself
+// plus at most 8 bytes of index.
+class KeySet {
+ public:
+  explicit KeySet(size_t key_size);
+  void clear();
+  // add key unless present, return its position
+  size_t insert(const void *key);
+  // position of key, or npos
+  size_t find(const void *key) const;
+  void erase(const void *key);
+  size_t size() const { return size_; }
+  // positions are dense, 0 .. size() - 1
+  const uint8_t * key(size_t pos) const { return &keys_[pos * key_size_]; }
+  size_t memory() const;
+
+  static const size_t npos = (size_t)-1;
+ private:
+  size_t slot_of(const void *key) const;
+  void grow();
+  size_t key_size_;
+  size_t size_;
+  std::vector<uint8_t> keys_;
+  // position + 1, 0 for an empty slot
+  std::vector<uint32_t> slots_;
+};
+
+}  // namespace bcc
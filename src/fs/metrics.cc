@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <bcc/libbpf.h>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+
+using std::string;
+using std::vector;
+
+namespace bcc {
+
+namespace {
+
+bool is_name(const string &s, bool colons) {
+  if (s.empty() || isdigit((unsigned char)s[0]))
+    return false;
+  for (char c : s)
+    if (!isalnum((unsigned char)c) && c != '_' && !(colons && c == ':'))
+      return false;
+  return true;
+}
+
+bool is_integer(const Layout::Field &f) {
+  return !f.count && (f.size == 1 || f.size == 2 || f.size == 4 || f.size == 8);
+}
+
+bool is_string(const Layout::Field &f) {
+  return f.count && f.size == 1;
+}
+
+// "leaf.bytes" or "key", the field must be an integer or, for labels, a
+// char array
+const Layout::Field * parse_ref(const string &s, const Layout &layout, const char *side,
+                                bool label) {
+  size_t n = strlen(side);
+  if (s.compare(0, n, side) || (s.size() > n && s[n] != '.'))
+    return nullptr;
+  const Layout::Field *f = layout.field(s.size() > n ? s.substr(n + 1) : string());
+  if (!f || !(is_integer(*f) || (label && is_string(*f))))
+    return nullptr;
+  return f;
+}
+
+void append_dec(const uint8_t *p, const Layout::Field &f, string *out) {
+  uint64_t v = 0;
+  memcpy(&v, p + f.offset, f.size);
+  bool negative = false;
+  if (f.is_signed) {
+    unsigned shift = 64 - 8 * f.size;
+    int64_t s = (int64_t)(v << shift) >> shift;
+    negative = s < 0;
+    v = negative ? -(uint64_t)s : (uint64_t)s;
+  }
+  char buf[24];
+  char *end = buf + sizeof(buf), *q = end;
+  do {
+    *--q = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  if (negative)
+    *--q = '-';
+  out->append(q, end - q);
+}
+
+// up to the first NUL, with the escapes of the exposition format
+void append_string(const uint8_t *p, const Layout::Field &f, string *out) {
+  const char *s = (const char *)p + f.offset;
+  for (size_t i = 0; i < f.count && s[i]; ++i) {
+    switch (s[i]) {
+      case '\\': out->append("\\\\"); break;
+      case '"': out->append("\\\""); break;
+      case '\n': out->append("\\n"); break;
+      default: out->push_back(s[i]);
+    }
+  }
+}
+
+}  // namespace
+
+bool MetricSet::clashes(const MetricSet &other) const {
+  for (auto &m : metrics_)
+    for (auto &o : other.metrics_)
+      if (m.name == o.name)
+        return true;
+  return false;
+}
+
+int MetricSet::compile(const string &text, const TableCodec &codec) {
+  const Layout &key = codec.key_layout(), &leaf = codec.leaf_layout();
+  std::istringstream lines(text);
+  string config;
+  vector<Metric> metrics;
+  for (string line; std::getline(lines, line);) {
+    std::istringstream in(line);
+    vector<string> words;
+    for (string w; in >> w;)
+      words.push_back(w);
+    if (words.empty())
+      continue;
+    if ((words.size() != 3 && words.size() != 5) || (words.size() == 5 && words[3] != "by"))
+      return -EINVAL;
+    Metric m;
+    m.name = words[0];
+    if (!is_name(m.name, true) || (words[1] != "counter" && words[1] != "gauge"))
+      return -EINVAL;
+    for (auto &other : metrics)
+      if (other.name == m.name)
+        return -EINVAL;
+    m.counter = words[1] == "counter";
+    m.sample = m.counter ? m.name + "_total" : m.name;
+    const Layout::Field *value = parse_ref(words[2], leaf, "leaf", false);
+    if (!value)
+      return -EINVAL;
+    m.value = *value;
+    if (words.size() == 5) {
+      std::istringstream refs(words[4]);
+      for (string ref; std::getline(refs, ref, ',');) {
+        const Layout::Field *f = parse_ref(ref, key, "key", true);
+        if (!f)
+          return -EINVAL;
+        m.labels.push_back(Label{f->name.empty() ? "key" : f->name, *f});
+      }
+    } else if (key.kind != Layout::opaque_e) {
+      for (auto &f : key.fields)
+        if (is_integer(f) || is_string(f))
+          m.labels.push_back(Label{f.name.empty() ? "key" : f.name, f});
+    }
+    for (auto &l : m.labels)
+      if (!is_name(l.name, false))
+        return -EINVAL;
+    config += line + "\n";
+    metrics.push_back(m);
+  }
+  text_.swap(config);
+  metrics_.swap(metrics);
+  return 0;
+}
+
+void MetricSet::append_sample(const Metric &m, const uint8_t *key, const uint8_t *leaf,
+                              string *out) {
+  out->append(m.sample);
+  if (!m.labels.empty()) {
+    char sep = '{';
+    for (auto &l : m.labels) {
+      out->push_back(sep);
+      out->append(l.name);
+      out->append("=\"");
+      if (is_string(l.field))
+        append_string(key, l.field, out);
+      else
+        append_dec(key, l.field, out);
+      out->push_back('"');
+      sep = ',';
+    }
+    out->push_back('}');
+  }
+  out->push_back(' ');
+  append_dec(leaf, m.value, out);
+  out->push_back('\n');
+}
+
+size_t MetricSet::render(const TableInfo &table, string *out, vector<string> *sections) const {
+  if (metrics_.empty())
+    return 0;
+  if (sections->size() < metrics_.size())
+    sections->resize(metrics_.size());
+  for (size_t i = 0; i < metrics_.size(); ++i) {
+    string *s = i ? &(*sections)[i] : out;
+    if (i)
+      s->clear();
+    s->append("# TYPE ");
+    s->append(metrics_[i].name);
+    s->append(metrics_[i].counter ? " counter\n" : " gauge\n");
+  }
+  Scratch key(table.key_size), leaf(table.leaf_size);
+  void *prev = nullptr;
+  size_t n = 0;
+  while (bpf_get_next_key(table.fd, prev, key.get()) == 0) {
+    prev = key.get();
+    if (bpf_lookup_elem(table.fd, key.get(), leaf.get()))
+      continue;
+    ++n;
+    for (size_t i = 0; i < metrics_.size(); ++i)
+      append_sample(metrics_[i], key.get(), leaf.get(), i ? &(*sections)[i] : out);
+  }
+  for (size_t i = 1; i < metrics_.size(); ++i)
+    out->append((*sections)[i]);
+  return n;
+}
+
+}  // namespace bcc
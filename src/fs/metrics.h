@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "codec.h"
+#include "module.h"
+
+namespace bcc {
+
+// OpenMetrics families rendered from the entries of one table, one family
+// per line of the config:
+//
+//   NAME counter|gauge VALUE [by LABEL[,LABEL]...]
+//   VALUE := leaf [.FIELD]
+//   LABEL := key [.FIELD]
+//
+// VALUE is an integer field of the leaf. Without "by", every integer and
+// char array field of the key is a label, named after the field ("key" for
+// an integer key). Char arrays are labelled as strings, integers in decimal.
+class MetricSet {
+ public:
+  // 0, or -EINVAL if the text does not parse against the table's layouts
+  int compile(const std::string &text, const TableCodec &codec);
+  bool empty() const { return metrics_.empty(); }
+  // whether both sets name a family the same, which one scrape cannot hold
+  bool clashes(const MetricSet &other) const;
+  // the config, one metric per line
+  const std::string & text() const { return text_; }
+  // append all families to out in one walk over the map; the families after
+  // the first are built in sections, kept by the caller for reuse. Returns
+  // the entries the walk found.
+  size_t render(const TableInfo &table, std::string *out,
+              std::vector<std::string> *sections) const;
+
+  struct Label {
+    std::string name;
+    Layout::Field field;
+  };
+  struct Metric {
+    // the family name, and what each sample starts with
+    std::string name;
+    std::string sample;
+    bool counter;
+    Layout::Field value;
+    std::vector<Label> labels;
+  };
+ private:
+  static void append_sample(const Metric &m, const uint8_t *key, const uint8_t *leaf,
+                            std::string *out);
+  std::string text_;
+  std::vector<Metric> metrics_;
+};
+
+}  // namespace bcc
@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <malloc.h>
+#include <unistd.h>
+#include <vector>
+#include <bcc/bpf_common.h>
+#include <bcc/libbpf.h>
+
+#include "module.h"
+
+using std::move;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace bcc {
+
+namespace {
+
+size_t heap_in_use() {
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+  struct mallinfo2 mi = mallinfo2();
+#else
+  struct mallinfo mi = mallinfo();
+#endif
+  return mi.uordblks + mi.hblkhd;
+}
+
+size_t round_up(size_t n, size_t align) {
+  return (n + align - 1) / align * align;
+}
+
+// of the kernel's list, as in "0-7" or "0,2-3"
+size_t read_possible_cpus() {
+  FILE *f = fopen("/sys/devices/system/cpu/possible", "r");
+  if (!f)
+    return 1;
+  size_t n = 0;
+  unsigned lo, hi;
+  int c;
+  while (fscanf(f, "%u", &lo) == 1) {
+    hi = lo;
+    if ((c = fgetc(f)) == '-') {
+      if (fscanf(f, "%u", &hi) != 1)
+        break;
+      c = fgetc(f);
+    }
+    n += hi >= lo ? hi - lo + 1 : 0;
+    if (c != ',')
+      break;
+  }
+  fclose(f);
+  return n ? n : 1;
+}
+
+size_t layout_bytes(const Layout &layout) {
+  size_t n = layout.fields.capacity() * sizeof(Layout::Field);
+  for (auto &f : layout.fields)
+    n += f.name.capacity();
+  return n;
+}
+
+}  // namespace
+
+unique_ptr<Module> Module::create(const char *text) {
+  // an estimate, other threads allocating meanwhile are counted too
+  size_t before = heap_in_use();
+  void *m = bpf_module_create_c_from_string(text, 0);
+  if (!m)
+    return nullptr;
+  size_t after = heap_in_use();
+  unique_ptr<Module> mod(new Module);
+  mod->bpf_module_ = m;
+  mod->module_bytes_ = after > before ? after - before : 0;
+  mod->license_ = bpf_module_license(m);
+  mod->kern_version_ = bpf_module_kern_version(m);
+  for (size_t i = 0; i < bpf_num_tables(m); ++i) {
+    unique_ptr<TableInfo> t(new TableInfo);
+    t->name = bpf_table_name(m, i);
+    t->fd = dup(bpf_table_fd_id(m, i));
+    t->type = bpf_table_type_id(m, i);
+    t->max_entries = bpf_table_max_entries_id(m, i);
+    t->key_size = bpf_table_key_size_id(m, i);
+    t->leaf_size = bpf_table_leaf_size_id(m, i);
+    t->codec.reset(new TableCodec(m, i));
+    mod->tables_.push_back(move(t));
+  }
+  mod->functions_.resize(bpf_num_functions(m));
+  for (size_t i = 0; i < mod->functions_.size(); ++i) {
+    FunctionInfo &fn = mod->functions_[i];
+    const uint8_t *start = (const uint8_t *)bpf_function_start_id(m, i);
+    fn.name = bpf_function_name(m, i);
+    fn.insns.assign(start, start + bpf_function_size_id(m, i));
+  }
+  // the code refers to the maps by our fds, which outlive a compacted module
+  for (size_t i = 0; i < mod->tables_.size(); ++i) {
+    if (mod->tables_[i]->fd < 0)
+      return nullptr;
+    mod->repoint(bpf_table_fd_id(m, i), mod->tables_[i]->fd);
+  }
+  return mod;
+}
+
+// libbcc closes the fds it created itself, fd sockets hold duplicates
+Module::~Module() {
+  if (bpf_module_)
+    bpf_module_destroy(bpf_module_);
+  for (auto &t : tables_)
+    if (t->fd >= 0)
+      close(t->fd);
+}
+
+void Module::repoint(int from, int to) {
+  for (auto &fn : functions_) {
+    bpf_insn *insns = (bpf_insn *)fn.insns.data();
+    size_t n = fn.insns.size() / sizeof(bpf_insn);
+    for (size_t i = 0; i < n; ++i) {
+      if (insns[i].code == (BPF_LD | BPF_IMM | BPF_DW) && insns[i].src_reg == BPF_PSEUDO_MAP_FD &&
+          insns[i].imm == from)
+        insns[i].imm = to;
+    }
+  }
+}
+
+bool Module::compact() {
+  if (!bpf_module_)
+    return true;
+  for (auto &t : tables_)
+    if (t->codec->key().generic() || t->codec->leaf().generic())
+      return false;
+  bpf_module_destroy(bpf_module_);
+  bpf_module_ = nullptr;
+  return true;
+}
+
+const TableInfo * Module::find_table(const std::string &name) const {
+  for (auto &t : tables_)
+    if (t->name == name)
+      return &*t;
+  return nullptr;
+}
+
+int Module::adopt_table(size_t id, const TableInfo &old) {
+  TableInfo &t = *tables_[id];
+  // the old fd goes away with the old module, the map stays with the
+  // duplicate; this module's own map is left to libbcc
+  int fd = dup(old.fd);
+  if (fd < 0)
+    return -errno;
+  repoint(t.fd, fd);
+  close(t.fd);
+  t.fd = fd;
+  return 0;
+}
+
+size_t Module::metadata_bytes() const {
+  size_t n = sizeof(*this) + license_.capacity();
+  n += tables_.capacity() * sizeof(tables_[0]);
+  for (auto &t : tables_) {
+    n += sizeof(*t) + t->name.capacity() + sizeof(TableCodec) + 2 * sizeof(TypeCodec);
+    n += layout_bytes(t->codec->key_layout()) + layout_bytes(t->codec->leaf_layout());
+  }
+  n += functions_.capacity() * sizeof(functions_[0]);
+  for (auto &fn : functions_)
+    n += fn.name.capacity() + fn.insns.capacity();
+  return n;
+}
+
+bool percpu_map(int type) {
+  return type == BPF_MAP_TYPE_PERCPU_HASH || type == BPF_MAP_TYPE_PERCPU_ARRAY ||
+         type == BPF_MAP_TYPE_LRU_PERCPU_HASH;
+}
+
+size_t possible_cpus() {
+  static const size_t n = read_possible_cpus();
+  return n;
+}
+
+size_t value_size(const TableInfo &t) {
+  return percpu_map(t.type) ? round_up(t.leaf_size, 8) * possible_cpus() : t.leaf_size;
+}
+
+size_t map_memory(const TableInfo &t) {
+  size_t key = round_up(t.key_size, 8), leaf = round_up(t.leaf_size, 8);
+  // per-cpu elements hold a pointer to a copy of the leaf for each cpu
+  if (percpu_map(t.type))
+    leaf = 8 + leaf * possible_cpus();
+  switch (t.type) {
+    case BPF_MAP_TYPE_ARRAY:
+    case BPF_MAP_TYPE_PERCPU_ARRAY:
+    case BPF_MAP_TYPE_PROG_ARRAY:
+    case BPF_MAP_TYPE_PERF_EVENT_ARRAY:
+      return t.max_entries * leaf;
+    default: {
+      // element header (list node, hash, rcu head) plus one bucket each
+      size_t buckets = 1;
+      while (buckets < t.max_entries)
+        buckets <<= 1;
+      return t.max_entries * (48 + key + leaf) + buckets * 8;
+    }
+  }
+}
+
+const char * map_type_name(int type) {
+  switch (type) {
+    case BPF_MAP_TYPE_HASH: return "hash";
+    case BPF_MAP_TYPE_ARRAY: return "array";
+    case BPF_MAP_TYPE_PROG_ARRAY: return "prog_array";
+    case BPF_MAP_TYPE_PERF_EVENT_ARRAY: return "perf_event_array";
+    case BPF_MAP_TYPE_PERCPU_HASH: return "percpu_hash";
+    case BPF_MAP_TYPE_PERCPU_ARRAY: return "percpu_array";
+    case BPF_MAP_TYPE_STACK_TRACE: return "stack_trace";
+    case BPF_MAP_TYPE_LRU_HASH: return "lru_hash";
+    case BPF_MAP_TYPE_LRU_PERCPU_HASH: return "lru_percpu_hash";
+    default: return "unknown";
+  }
+}
+
+const char * table_mismatch(const TableInfo &t, const TableInfo &old) {
+  if (t.type != old.type)
+    return "type changed";
+  if (t.max_entries != old.max_entries)
+    return "max_entries changed";
+  if (t.key_size != old.key_size || t.codec->key_layout() != old.codec->key_layout())
+    return "key type changed";
+  if (t.leaf_size != old.leaf_size || t.codec->leaf_layout() != old.codec->leaf_layout())
+    return "leaf type changed";
+  return nullptr;
+}
+
+#define CLEAR_BATCH 4096
+size_t clear_map(const TableInfo &t) {
+  size_t n = 0;
+  switch (t.type) {
+    case BPF_MAP_TYPE_ARRAY:
+    case BPF_MAP_TYPE_PERCPU_ARRAY: {
+      // array elements always exist, they can only be overwritten
+      vector<uint8_t> zero(value_size(t), 0);
+      for (uint32_t i = 0; i < t.max_entries; ++i)
+        n += bpf_update_elem(t.fd, &i, &zero[0], BPF_EXIST) == 0;
+      return n;
+    }
+  }
+  Scratch key(t.key_size);
+  vector<uint8_t> batch(CLEAR_BATCH * t.key_size);
+  for (;;) {
+    // a walk from no key starts at the first one, whichever keys exist
+    size_t count = 0;
+    void *prev = nullptr;
+    while (count < CLEAR_BATCH && bpf_get_next_key(t.fd, prev, key.get()) == 0) {
+      memcpy(&batch[count++ * t.key_size], key.get(), t.key_size);
+      prev = key.get();
+    }
+    size_t deleted = 0;
+    for (size_t i = 0; i < count; ++i)
+      deleted += bpf_delete_elem(t.fd, &batch[i * t.key_size]) == 0;
+    n += deleted;
+    if (!deleted)
+      break;
+  }
+  return n;
+}
+
+}  // namespace bcc
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "codec.h"
+
+namespace bcc {
+
+// What the filesystem needs to know about one table
+struct TableInfo {
+  std::string name;
+  // a duplicate owned by the Module, libbcc closes its own with the module
+  int fd;
+  int type;
+  size_t max_entries;
+  size_t key_size;
+  size_t leaf_size;
+  std::unique_ptr<TableCodec> codec;
+};
+
+struct FunctionInfo {
+  std::string name;
+  std::vector<uint8_t> insns;
+};
+
+// A compiled program. Table and function metadata are copied out of the bcc
+// module when it is created, so that the module itself (clang/llvm state,
+// jit context) can be released once nothing needs libbcc's generated
+// printf/scanf anymore.
+class Module {
+ public:
+  // compile text, nullptr on failure
+  static std::unique_ptr<Module> create(const char *text);
+  ~Module();
+  // destroy the bcc module, unless a table still formats through it
+  bool compact();
+  bool compacted() const { return !bpf_module_; }
+
+  size_t num_tables() const { return tables_.size(); }
+  const TableInfo & table(size_t id) const { return *tables_[id]; }
+  // table by name, or nullptr
+  const TableInfo * find_table(const std::string &name) const;
+  // use the map of a table from an earlier module instead of this module's
+  // own, for table id and in the code of every function
+  int adopt_table(size_t id, const TableInfo &old);
+  size_t num_functions() const { return functions_.size(); }
+  const FunctionInfo & function(size_t id) const { return functions_[id]; }
+  const std::string & license() const { return license_; }
+  unsigned kern_version() const { return kern_version_; }
+
+  // heap taken by libbcc to build the module, 0 once it is released
+  size_t module_bytes() const { return bpf_module_ ? module_bytes_ : 0; }
+  // heap taken by the copied metadata
+  size_t metadata_bytes() const;
+ private:
+  Module() : bpf_module_(nullptr), kern_version_(0), module_bytes_(0) {}
+  Module(const Module &) = delete;
+  // point the map references of every function at fd to to instead
+  void repoint(int from, int to);
+  void *bpf_module_;
+  std::vector<std::unique_ptr<TableInfo>> tables_;
+  std::vector<FunctionInfo> functions_;
+  std::string license_;
+  unsigned kern_version_;
+  size_t module_bytes_;
+};
+
+// whether the map keeps a value per cpu
+bool percpu_map(int type);
+
+// CPUs the kernel keeps a copy of each per-cpu map value for
+size_t possible_cpus();
+
+// Bytes bpf_lookup_elem() copies out of one element: the leaf, or the leaf
+// of each possible cpu, 8 byte aligned, for per-cpu maps
+size_t value_size(const TableInfo &table);
+
+// Estimate of the kernel memory behind a map when full, from its type and
+// sizes; allocator slack and per-cpu freelists are not counted
+size_t map_memory(const TableInfo &table);
+
+// Short name of a map type, as in "hash" or "lru_hash"
+const char * map_type_name(int type);
+
+// Why a table of a new module cannot take over the map of an old one, or
+// nullptr if it can
+const char * table_mismatch(const TableInfo &table, const TableInfo &old);
+
+// Delete every entry, or zero every element of an array, and return how
+// many there were. Keys are collected and deleted in batches, so that
+// deleting does not disturb the walk over the map.
+size_t clear_map(const TableInfo &table);
+
+}  // namespace bcc
@@ -15,9 +15,12 @@
  */
 
 #include <algorithm>
+#include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <fuse.h>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "mount.h"
@@ -25,12 +28,21 @@
 
 namespace bcc {
 
+namespace {
+
+__thread Mount *thread_mount = nullptr;
+
+}  // namespace
+
 using std::find;
+using std::move;
 using std::string;
 using std::vector;
 
-Mount::Mount() : flags_(0) {
+Mount::Mount() : flags_(0), changes_max_keys_(1 << 20), entry_cache_(1024),
+                 swap_grace_us_(1000) {
   log_ = fopen("/tmp/bcc-fuse.log", "w");
+  pthread_rwlock_init(&tree_lock_, nullptr);
   oper_.reset(new fuse_operations);
   root_.reset(new RootDir(0755));
   root_->set_mount(this);
@@ -46,18 +58,45 @@ Mount::Mount() : flags_(0) {
   oper_->write = write_;
   oper_->truncate = truncate_;
   oper_->flush = flush_;
+  oper_->release = release_;
   oper_->readlink = readlink_;
   oper_->ioctl = ioctl_;
+  oper_->poll = poll_;
+  scheduler_.reset(new Scheduler(std::thread::hardware_concurrency()));
+  auto sched = make_unique<SchedFile>();
+  sched->set_mount(this);
+  root_->add_child("sched", move(sched));
+  auto metrics = make_unique<MetricsFile>();
+  metrics->set_mount(this);
+  root_->add_child("metrics", move(metrics));
 }
 
 Mount::~Mount() {
+  // pending compiles would land in a tree that is going away
+  debouncer_.reset();
+  root_.reset();
+  pthread_rwlock_destroy(&tree_lock_);
   fclose(log_);
 }
 
 Mount * Mount::instance() {
+  if (thread_mount)
+    return thread_mount;
   return static_cast<Mount *>(fuse_get_context()->private_data);
 }
 
+void Mount::adopt_thread() {
+  thread_mount = this;
+}
+
+void Mount::set_debounce(unsigned window_ms) {
+  debouncer_.reset(window_ms ? new Debouncer(window_ms) : nullptr);
+}
+
+uid_t Mount::caller_uid() {
+  return fuse_get_context()->uid;
+}
+
 int Mount::getattr(const char *path, struct stat *st) {
   log("getattr: %s\n", path);
   memset(st, 0, sizeof(*st));
@@ -90,7 +129,7 @@ int Mount::mkdir(const char *path, mode_t mode) {
   if (p.next())
     return -ENOENT;
   if (Dir *dir = dynamic_cast<Dir *>(leaf))
-    return dir->mkdir(p.cur(), mode);
+    return dir->mkdir(p.cur().str().c_str(), mode);
   return -ENOTDIR;
 }
 
@@ -107,7 +146,7 @@ int Mount::mknod(const char *path, mode_t mode, dev_t rdev) {
   if (p.next())
     return -ENOENT;
   if (Dir *dir = dynamic_cast<Dir *>(leaf))
-    return dir->mknod(p.cur(), mode, rdev);
+    return dir->mknod(p.cur().str().c_str(), mode, rdev);
   return -ENOTDIR;
 }
 
@@ -121,7 +160,7 @@ int Mount::create(const char *path, mode_t mode, struct fuse_file_info *fi) {
   if (p.next())
     return -ENOENT;
   if (Dir *dir = dynamic_cast<Dir *>(leaf))
-    return dir->create(p.cur(), mode, fi);
+    return dir->create(p.cur().str().c_str(), mode, fi);
   return -ENOTDIR;
 }
 
@@ -131,8 +170,9 @@ int Mount::unlink(const char *path) {
   Inode *leaf = root_->leaf(&p);
   if (!leaf || p.next())
     return -ENOENT;
-  if (Dir *dir = dynamic_cast<MapDir *>(leaf->parent()))
-    return dir->unlink(p.cur());
+  Dir *dir = leaf->parent();
+  if (dynamic_cast<MapDir *>(dir) || dynamic_cast<RawMapDir *>(dir))
+    return dir->unlink(p.cur().str().c_str());
   return -EPERM;
 }
 
@@ -142,31 +182,36 @@ int Mount::open(const char *path, struct fuse_file_info *fi) {
   Inode *leaf = root_->leaf(&p);
   if (!leaf || p.next())
     return -ENOENT;
-  if (File *file = dynamic_cast<File *>(leaf))
-    return file->open(fi);
-  return -EISDIR;
+  File *file = dynamic_cast<File *>(leaf);
+  if (!file)
+    return -EISDIR;
+  if (int rc = file->open(fi))
+    return rc;
+  // later requests on the handle do not carry the open flags
+  File::handle(fi)->set_writable((fi->flags & O_ACCMODE) != O_RDONLY);
+  return 0;
 }
 
 int Mount::read(const char *path, char *buf, size_t size, off_t offset,
                 struct fuse_file_info *fi) {
   log("read: %s sz=%zu off=%zu\n", path, size, offset);
-  Inode *leaf = (Inode *)fi->fh;
-  if (!leaf)
+  Handle *h = File::handle(fi);
+  if (!h)
     return -ENOENT;
-  if (File *file = dynamic_cast<File *>(leaf))
-    return file->read(buf, size, offset, fi);
-  return -EISDIR;
+  // what a read from the start shows is what a later poll compares against,
+  // for a handle that polls at all
+  if (offset == 0 && h->target() && h->polled())
+    h->set_seen(h->target()->hash());
+  return h->file()->read(buf, size, offset, fi);
 }
 
 int Mount::write(const char *path, const char *buf, size_t size, off_t offset,
                  struct fuse_file_info *fi) {
   log("write: %s sz=%zu off=%zu\n", path, size, offset);
-  Inode *leaf = (Inode *)fi->fh;
-  if (!leaf)
+  Handle *h = File::handle(fi);
+  if (!h)
     return -ENOENT;
-  if (File *file = dynamic_cast<File *>(leaf))
-    return file->write(buf, size, offset, fi);
-  return -EISDIR;
+  return h->file()->write(buf, size, offset, fi);
 }
 
 int Mount::truncate(const char *path, off_t newsize) {
@@ -182,12 +227,23 @@ int Mount::truncate(const char *path, off_t newsize) {
 
 int Mount::flush(const char *path, struct fuse_file_info *fi) {
   log("flush: %s\n", path);
-  Inode *leaf = (Inode *)fi->fh;
-  if (!leaf)
+  Handle *h = File::handle(fi);
+  if (!h)
     return -ENOENT;
-  if (File *file = dynamic_cast<File *>(leaf))
-    return file->flush(fi);
-  return -EISDIR;
+  return h->file()->flush(fi);
+}
+
+int Mount::release(const char *path, struct fuse_file_info *fi) {
+  log("release: %s\n", path);
+  Handle *h = File::handle(fi);
+  if (!h)
+    return 0;
+  int rc = h->file()->release(fi);
+  if (watcher_)
+    watcher_->forget(h);
+  delete h;
+  fi->fh = 0;
+  return rc;
 }
 
 int Mount::readlink(const char *path, char *buf, size_t size) {
@@ -205,12 +261,64 @@ int Mount::readlink(const char *path, char *buf, size_t size) {
 int Mount::ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                  unsigned int flags, void *data) {
   log("ioctl: %s\n", path);
-  return 0;
+  // files go by their handle, a directory by its path
+  Inode *node = nullptr;
+  Handle *h = flags & FUSE_IOCTL_DIR ? nullptr : File::handle(fi);
+  if (h) {
+    node = h->file();
+  } else {
+    Path p(path);
+    node = root_->leaf(&p);
+    if (!node || p.next())
+      return -ENOENT;
+  }
+  MapDir *md = dynamic_cast<MapDir *>(node);
+  if (!md)
+    md = dynamic_cast<MapDir *>(node->parent());
+  if (!md)
+    return -ENOTTY;
+  // a directory is only ever open for reading
+  return md->ioctl(cmd, data, h && h->writable());
+}
+
+int Mount::poll(const char *path, struct fuse_file_info *fi, struct fuse_pollhandle *ph,
+                unsigned *reventsp) {
+  log("poll: %s\n", path);
+  Handle *h = File::handle(fi);
+  if (!h || !watcher_) {
+    if (ph)
+      fuse_pollhandle_destroy(ph);
+    return -ENOENT;
+  }
+  return watcher_->poll(h, ph, reventsp);
 }
 
 int Mount::run(int argc, char **argv) {
-  mountpath_.assign(argv[argc - 1]);
-  return fuse_main(argc, argv, &*oper_, this);
+  // take out our own options, pass the rest on to fuse
+  vector<char *> args;
+  unsigned poll_interval_ms = 100;
+  for (int i = 0; i < argc; ++i) {
+    if (!strcmp(argv[i], "--compact"))
+      flags_ |= compact_e;
+    else if (!strncmp(argv[i], "--poll-interval=", 16))
+      poll_interval_ms = std::max(1, atoi(argv[i] + 16));
+    else if (!strncmp(argv[i], "--changes-max-keys=", 19))
+      changes_max_keys_ = strtoul(argv[i] + 19, nullptr, 0);
+    else if (!strncmp(argv[i], "--entry-cache=", 14))
+      entry_cache_ = std::max(1, atoi(argv[i] + 14));
+    else if (!strncmp(argv[i], "--swap-grace-us=", 16))
+      swap_grace_us_ = std::max(0, atoi(argv[i] + 16));
+    else if (!strncmp(argv[i], "--sched-slots=", 14))
+      scheduler_.reset(new Scheduler(std::max(1, atoi(argv[i] + 14))));
+    else if (!strncmp(argv[i], "--debounce-ms=", 14))
+      set_debounce(std::max(0, atoi(argv[i] + 14)));
+    else
+      args.push_back(argv[i]);
+  }
+  watcher_.reset(new Watcher(poll_interval_ms));
+  mountpath_.assign(args.back());
+  args.push_back(nullptr);
+  return fuse_main(args.size() - 1, &args[0], &*oper_, this);
 }
 
 }  // namespace bcc
@@ -16,18 +16,34 @@
 
 #pragma once
 
+#include <atomic>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <pthread.h>
 #include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <thread>
 #include <vector>
 
+#include "codec.h"
+#include "debounce.h"
+#include "keyset.h"
+#include "metrics.h"
+#include "module.h"
+#include "namemap.h"
+#include "publish.h"
+#include "query.h"
+#include "sampler.h"
+#include "sched.h"
+#include "watch.h"
+
 // forward declarations from fuse.h
 extern "C" {
 struct fuse_operations;
 struct fuse_file_info;
+struct fuse_pollhandle;
 }
 
 namespace bcc {
@@ -35,57 +51,107 @@ namespace bcc {
 class Mount;
 class Inode;
 class Dir;
+class MapDir;
 class File;
-class Path;
 
 typedef int (*fuse_fill_dir_t) (void *buf, const char *name,
         const struct stat *stbuf, off_t off);
 class Mount {
  private:
+  // Requests share the tree while programs are compiled on the debounce
+  // thread, which takes it for itself to put a program in place
+  struct Reader {
+    explicit Reader(Mount *m) : lock(m->debouncer_ ? &m->tree_lock_ : nullptr) {
+      if (lock)
+        pthread_rwlock_rdlock(lock);
+    }
+    ~Reader() {
+      if (lock)
+        pthread_rwlock_unlock(lock);
+    }
+    pthread_rwlock_t *lock;
+  };
 
   // wrapper functions, to be registered with fuse
   static int getattr_(const char *path, struct stat *st) {
-    return instance()->getattr(path, st);
+    Mount *m = instance();
+    Reader reader(m);
+    return m->getattr(path, st);
   }
   static int readdir_(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
                       struct fuse_file_info *fi) {
-    return instance()->readdir(path, buf, filler, offset, fi);
+    Mount *m = instance();
+    Reader reader(m);
+    return m->readdir(path, buf, filler, offset, fi);
   }
   static int mkdir_(const char *path, mode_t mode) {
-    return instance()->mkdir(path, mode);
+    Mount *m = instance();
+    Reader reader(m);
+    return m->mkdir(path, mode);
   }
   static int mknod_(const char *path, mode_t mode, dev_t rdev) {
-    return instance()->mknod(path, mode, rdev);
+    Mount *m = instance();
+    Reader reader(m);
+    return m->mknod(path, mode, rdev);
   }
   static int create_(const char *path, mode_t mode, struct fuse_file_info *fi) {
-    return instance()->create(path, mode, fi);
+    Mount *m = instance();
+    Reader reader(m);
+    return m->create(path, mode, fi);
   }
   static int unlink_(const char *path) {
-    return instance()->unlink(path);
+    Mount *m = instance();
+    Reader reader(m);
+    return m->unlink(path);
   }
   static int open_(const char *path, struct fuse_file_info *fi) {
-    return instance()->open(path, fi);
+    Mount *m = instance();
+    Reader reader(m);
+    return m->open(path, fi);
   }
   static int read_(const char *path, char *buf, size_t size, off_t offset,
                    struct fuse_file_info *fi) {
-    return instance()->read(path, buf, size, offset, fi);
+    Mount *m = instance();
+    Reader reader(m);
+    return m->read(path, buf, size, offset, fi);
   }
   static int write_(const char *path, const char *buf, size_t size, off_t offset,
                     struct fuse_file_info *fi) {
-    return instance()->write(path, buf, size, offset, fi);
+    Mount *m = instance();
+    Reader reader(m);
+    return m->write(path, buf, size, offset, fi);
   }
   static int truncate_(const char *path, off_t newsize) {
-    return instance()->truncate(path, newsize);
+    Mount *m = instance();
+    Reader reader(m);
+    return m->truncate(path, newsize);
   }
   static int flush_(const char *path, struct fuse_file_info *fi) {
-    return instance()->flush(path, fi);
+    Mount *m = instance();
+    Reader reader(m);
+    return m->flush(path, fi);
+  }
+  static int release_(const char *path, struct fuse_file_info *fi) {
+    Mount *m = instance();
+    Reader reader(m);
+    return m->release(path, fi);
   }
   static int readlink_(const char *path, char *buf, size_t size) {
-    return instance()->readlink(path, buf, size);
+    Mount *m = instance();
+    Reader reader(m);
+    return m->readlink(path, buf, size);
   }
   static int ioctl_(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                     unsigned int flags, void *data) {
-    return instance()->ioctl(path, cmd, arg, fi, flags, data);
+    Mount *m = instance();
+    Reader reader(m);
+    return m->ioctl(path, cmd, arg, fi, flags, data);
+  }
+  static int poll_(const char *path, struct fuse_file_info *fi, struct fuse_pollhandle *ph,
+                   unsigned *reventsp) {
+    Mount *m = instance();
+    Reader reader(m);
+    return m->poll(path, fi, ph, reventsp);
   }
 
   // implementations of fuse callbacks
@@ -103,22 +169,53 @@ class Mount {
   int write(const char *path, const char *buf, size_t size, off_t offset,
             struct fuse_file_info *fi);
   int flush(const char *path, struct fuse_file_info *fi);
+  int release(const char *path, struct fuse_file_info *fi);
   int truncate(const char *path, off_t newsize);
   int readlink(const char *path, char *buf, size_t size);
   int ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
             unsigned int flags, void *data);
+  int poll(const char *path, struct fuse_file_info *fi, struct fuse_pollhandle *ph,
+           unsigned *reventsp);
 
  public:
   Mount();
   ~Mount();
   int run(int argc, char **argv);
 
-  // fetch this from fuse private_data
+  // fetch this from fuse private_data, or the one adopted by this thread
   static Mount * instance();
-
+  // for threads of the daemon's own, which have no fuse context
+  void adopt_thread();
+  // uid of the process the current request is for
+  static uid_t caller_uid();
+
+  enum Flags {
+    // release the bcc module after a program is loaded
+    compact_e = 1 << 0,
+  };
   unsigned flags() const { return flags_; }
 
   const std::string & mountpath() const { return mountpath_; }
+  Dir * root() const { return root_.get(); }
+  Watcher * watcher() const { return watcher_.get(); }
+  // keys a `changes` handle remembers before it falls back to full resyncs
+  size_t changes_max_keys() const { return changes_max_keys_; }
+  // entry inodes a map dir keeps built before it evicts idle ones
+  size_t entry_cache() const { return entry_cache_; }
+  // how long a swap waits after flipping the selector before it reads the
+  // old copy; program runs slower than that still write to it
+  unsigned swap_grace_us() const { return swap_grace_us_; }
+  Scheduler * scheduler() const { return scheduler_.get(); }
+  // wait for the caller's turn at a compile or a walk over a whole map
+  int admit(Scheduler::Kind kind, size_t bytes, Scheduler::Slot *slot) {
+    return scheduler_->admit(caller_uid(), kind, bytes, slot);
+  }
+  // nullptr while sources compile as soon as they are flushed
+  Debouncer * debouncer() const { return debouncer_.get(); }
+  // merge flushes of a source that come within window_ms, 0 to stop
+  void set_debounce(unsigned window_ms);
+  // held exclusively while a debounced compile puts its program in place
+  pthread_rwlock_t * tree_lock() { return &tree_lock_; }
 
   template <typename... Args>
   void log(const char *fmt, Args&&... args) {
@@ -135,6 +232,13 @@ class Mount {
   std::unique_ptr<Dir> root_;
   unsigned flags_;
   std::string mountpath_;
+  std::unique_ptr<Watcher> watcher_;
+  size_t changes_max_keys_;
+  size_t entry_cache_;
+  unsigned swap_grace_us_;
+  std::unique_ptr<Scheduler> scheduler_;
+  pthread_rwlock_t tree_lock_;
+  std::unique_ptr<Debouncer> debouncer_;
 };
 
 // Inode base class
@@ -188,13 +292,17 @@ class Socket : public Inode {
   dev_t rdev_;
 };
 
+// Hands fd to every client that connects, and closes it when done
 class FDSocket : public Socket {
  public:
   FDSocket(mode_t mode, dev_t rdev, int fd);
   ~FDSocket();
   int getattr(struct stat *st) override;
   int mknod();
+  // hand out fd from now on, closing the one before
+  void set_fd(int fd);
  private:
+  std::mutex mtx_;
   int fd_;
   int sock_;
   std::thread thread_;
@@ -207,6 +315,10 @@ class Dir : public Inode {
   Inode * leaf(Path *path) override;
   void add_child(const std::string &name, std::unique_ptr<Inode> node);
   void remove_child(const std::string &name);
+  // remove a child and hand it over, nullptr if there is none
+  std::unique_ptr<Inode> take_child(const std::string &name);
+  // nullptr if there is none
+  Inode * child(const std::string &name);
   int getattr(struct stat *st) override;
   virtual int readdir(void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
   virtual int mkdir(const char *name, mode_t mode) { return -EACCES; }
@@ -215,7 +327,7 @@ class Dir : public Inode {
   virtual int unlink(const char *name);
   std::string path(const Inode *node) const;
  protected:
-  std::map<std::string, std::unique_ptr<Inode>> children_;
+  NameMap<std::unique_ptr<Inode>> children_;
   size_t n_files_;
   size_t n_dirs_;
 };
@@ -224,6 +336,8 @@ class RootDir : public Dir {
  public:
   explicit RootDir(mode_t mode) : Dir(mode) {}
   int mkdir(const char *name, mode_t mode);
+  // the map dirs of all programs that have metrics configured
+  void metric_maps(std::vector<MapDir *> *out);
 };
 
 class ProgramDir : public Dir {
@@ -231,58 +345,187 @@ class ProgramDir : public Dir {
   ProgramDir(mode_t mode);
   ~ProgramDir();
   int load(const char *text);
+  // load text on the debounce thread, unless a newer text overtakes it
+  void load_later(const std::string &text);
   void unload();
+  // the map dirs that have metrics configured
+  void metric_maps(std::vector<MapDir *> *out);
  private:
-  void *bpf_module_;
+  std::string memory() const;
+  // nullptr if the compile failed or uid may not compile text
+  std::unique_ptr<Module> compile(const char *text, uid_t uid);
+  // put module in place of the loaded one, or mark the program invalid
+  int install(std::unique_ptr<Module> module);
+  std::unique_ptr<Module> module_;
 };
 
+// Keys of the map are kept in a KeySet and named when listed. Entries are
+// built as inodes when looked up, and dropped again once idle on the next
+// refresh or when too many idle ones pile up.
 class MapDir : public Dir {
  public:
-  MapDir(mode_t mode, void *bpf_module_, int id);
+  // fd, if given, is the socket of the map dir this one replaces
+  MapDir(mode_t mode, const TableInfo *table, std::unique_ptr<Inode> fd = nullptr);
+  Inode * leaf(Path *path) override;
   int getattr(struct stat *st) override;
   int readdir(void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) override;
   int create(const char *name, mode_t mode, struct fuse_file_info *fi) override;
-  void * mod() const { return bpf_module_; }
-  int map_id() const { return id_; }
-  int map_fd() const;
+  int unlink(const char *name) override;
+  // the BCC_MAP_* ioctls of client.h, on data in place; update and delete
+  // only through a handle open for writing
+  int ioctl(unsigned cmd, void *data, bool writable);
+  const TableInfo & table() const { return *table_; }
+  int map_fd() const { return table_->fd; }
+  const TableCodec & codec() const { return *table_->codec; }
+  // rebuild the list of entries, at most once a second unless forced
+  int refresh(bool force = false);
+  const KeySet & keys() const { return keys_; }
+  // number of entries seen by the last walk over the map, and when
+  void counted(size_t count, uint64_t ts);
+  // entry count from the latest walk over the map, and the time it was
+  // taken; 0 if nothing has walked it yet
+  int occupancy(size_t *count, uint64_t *ts);
+  // size of an entry's text, for all the keys of a recent listing at once
+  bool cached_size(const uint8_t *key, size_t *size);
+  void forget_sizes() { sizes_.clear(); listed_ts_ = 0; }
+  // entry inodes built now, and how many idle ones have been evicted
+  size_t cached() const;
+  uint64_t evictions() const { return evictions_; }
+  // add a `swap` file for a map kept in two copies
+  void enable_swap(const TableInfo *alt, const TableInfo *sel);
+  // Readers on other fuse threads keep what they got alive while a write
+  // to `sample`, `publish` or `metrics.conf` replaces it
+  std::shared_ptr<Sampler> sampler() const;
+  void set_sampler(std::shared_ptr<Sampler> sampler);
+  std::shared_ptr<Publisher> publisher() const;
+  // also adds or removes the `snapshot` socket
+  void set_publisher(std::shared_ptr<Publisher> publisher);
+  std::shared_ptr<const MetricSet> metrics() const;
+  void set_metrics(std::shared_ptr<const MetricSet> metrics);
  private:
-  int refresh();
-  void *bpf_module_;
-  int id_;
+  Inode * entry(StringRef name);
+  // drop idle entries whose key is no longer in the map
+  void drop_stale();
+  // drop the least recently used idle entries when over the mount's cap
+  void evict();
+  const TableInfo *table_;
   uint64_t last_ts_;
+  KeySet keys_;
+  size_t count_;
+  uint64_t count_ts_;
+  // lookup clock for the entries, and when to look for some to evict
+  uint64_t tick_;
+  size_t evict_at_;
+  uint64_t evictions_;
+  // text sizes by position in keys_, worked out after the last readdir
+  std::vector<uint32_t> sizes_;
+  uint64_t sizes_ts_;
+  uint64_t listed_ts_;
+  mutable std::mutex attached_mutex_;
+  std::shared_ptr<Sampler> sampler_;
+  std::shared_ptr<Publisher> publisher_;
+  std::shared_ptr<const MetricSet> metrics_;
+};
+
+// Entries named by the hex of their key bytes and holding the raw leaf
+// bytes, looked up in the map directly instead of through MapDir's list.
+class RawMapDir : public Dir {
+ public:
+  RawMapDir(mode_t mode, size_t key_size, size_t leaf_size);
+  Inode * leaf(Path *path) override;
+  int readdir(void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) override;
+  int create(const char *name, mode_t mode, struct fuse_file_info *fi) override;
+  int map_fd() const;
+ private:
+  bool decode(const char *name, uint8_t *key) const;
+  void prune();
+  HexCodec key_hex_;
+  size_t leaf_size_;
 };
 
 class FunctionDir : public Dir {
  public:
-  FunctionDir(mode_t mode, void *bpf_module, int id);
+  FunctionDir(mode_t mode, const Module *module, int id);
   // load function and return open fd
   int load(const std::string &type);
   void unload();
+  // continue where the same function of an earlier module left off
+  void take_over(FunctionDir *old);
  private:
-  void *bpf_module_;
+  const Module *module_;
   int id_;
+  std::string type_;
+  unsigned generation_;
+};
+
+// One open file, kept in fuse_file_info::fh
+class Handle {
+ public:
+  explicit Handle(File *file) : file_(file), seen_(0), polled_(false), writable_(false) {}
+  virtual ~Handle() {}
+  Handle(const Handle &) = delete;
+  File * file() const { return file_; }
+  // set by files that can be polled for changes
+  void watch(const WatchTarget &target) { target_.reset(new WatchTarget(target)); }
+  const WatchTarget * target() const { return target_.get(); }
+  // hash of the target when the handle last read from offset 0, or when it
+  // was first polled; only handles that poll pay for hashing on reads
+  uint64_t seen() const { return seen_; }
+  void set_seen(uint64_t seen) { seen_ = seen; }
+  bool polled() const { return polled_; }
+  void set_polled() { polled_ = true; }
+  // opened for writing
+  bool writable() const { return writable_; }
+  void set_writable(bool writable) { writable_ = writable; }
+  // contents of files that are built whole on a read from offset 0
+  std::string & data() { return data_; }
+ private:
+  File *file_;
+  std::unique_ptr<WatchTarget> target_;
+  std::atomic<uint64_t> seen_;
+  std::atomic<bool> polled_;
+  bool writable_;
+  std::string data_;
 };
 
 class File : public Inode {
  public:
-  File() : Inode(file_e) {}
+  // What the kernel may cache: keep_e files change only through the daemon
+  // and keep their pages across opens until they do, direct_e files are
+  // built anew on every read and bypass the page cache
+  enum Cache { keep_e, direct_e };
+  explicit File(Cache cache = keep_e)
+      : Inode(file_e), cache_(cache), version_(0), cached_version_(0) {}
   int getattr(struct stat *st) override;
   virtual int open(struct fuse_file_info *fi);
   virtual int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) { return -EACCES; }
   virtual int write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) { return -EACCES; }
   virtual int truncate(off_t newsize) { return -EACCES; }
   virtual int flush(struct fuse_file_info *fi) { return 0; }
+  virtual int release(struct fuse_file_info *fi) { return 0; }
+  static Handle * handle(struct fuse_file_info *fi);
  protected:
   virtual size_t size() const = 0;
   int read_helper(const std::string &data, char *buf, size_t size,
                   off_t offset, struct fuse_file_info *fi);
+  // wait for the caller's turn at a walk over the whole of table
+  int admit_scan(const TableInfo &table, Scheduler::Slot *slot) {
+    return mount_->admit(Scheduler::scan_e, map_memory(table), slot);
+  }
+  // the open flags of the cache policy, for opens that make their own handle
+  void set_cache(struct fuse_file_info *fi);
+  // the contents changed, pages the kernel kept are stale
+  void changed() { ++version_; }
  private:
-  size_t size_;
+  Cache cache_;
+  uint64_t version_;
+  // version_ when the file was last opened
+  uint64_t cached_version_;
 };
 
 class StringFile : public File {
  public:
-  StringFile() : File() {}
+  explicit StringFile(Cache cache = keep_e) : File(cache) {}
   int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
   int write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
   int truncate(off_t newsize) = 0;
@@ -307,7 +550,10 @@ class StatFile : public File {
   StatFile(const std::string &data) : File(), data_(data) {}
   int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
 
-  void set_data(const std::string data) { data_ = data; }
+  void set_data(const std::string data) {
+    data_ = data;
+    changed();
+  }
  protected:
   size_t size() const override { return data_.size(); }
  private:
@@ -316,22 +562,231 @@ class StatFile : public File {
 
 class FunctionTypeFile : public StringFile {
  public:
-  FunctionTypeFile() : StringFile() {}
+  explicit FunctionTypeFile(const std::string &type = "") : StringFile(), dirty_(false) {
+    data_ = type;
+  }
+  int write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
   int truncate(off_t newsize) override;
   int flush(struct fuse_file_info *fi) override;
+ private:
+  bool dirty_;
+};
+
+// Type, sizes, occupancy and memory of the map, from the latest walk over it
+class MapStatsFile : public File {
+ public:
+  explicit MapStatsFile(const TableInfo *table);
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+  size_t size() const override;
+ private:
+  const TableInfo *table_;
 };
 
 class MapDumpFile : public File {
  public:
-  MapDumpFile(void *bpf_module, int id);
+  explicit MapDumpFile(const TableInfo *table);
+  int open(struct fuse_file_info *fi) override;
   int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
   size_t size() const override;
  private:
-  void *bpf_module_;
-  int id_;
-  int fd_;
-  size_t key_size_;
-  size_t leaf_size_;
+  const TableInfo *table_;
+};
+
+// One key name per line, pollable for keys being added or removed
+class MapKeysFile : public File {
+ public:
+  explicit MapKeysFile(const TableInfo *table);
+  int open(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+ protected:
+  size_t size() const override { return 0; }
+ private:
+  const TableInfo *table_;
+};
+
+// Entries added, modified or deleted since the handle's previous read, as
+// "+ KEY LEAF", "~ KEY LEAF" and "- KEY" lines. A read that starts with
+// "RESYNC" lists the whole map instead: the first one on a handle, and
+// every one while the map has more keys than a handle may remember.
+class MapChangesFile : public File {
+ public:
+  explicit MapChangesFile(const TableInfo *table);
+  int open(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+ protected:
+  size_t size() const override { return 0; }
+ private:
+  const TableInfo *table_;
+};
+
+// Takes what was written as a whole on flush; reads show something else
+class ControlFile : public File {
+ public:
+  ControlFile() : File(direct_e), dirty_(false) {}
+  int write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+  int truncate(off_t newsize) override;
+  int flush(struct fuse_file_info *fi) override;
+ protected:
+  // called with non-empty text, the error is returned by flush
+  virtual int apply(const std::string &text) = 0;
+  size_t size() const override { return 0; }
+ private:
+  std::string text_;
+  bool dirty_;
+};
+
+// Scheduler::stats() of the mount; root or the daemon's own user may write
+// "UID WEIGHT [MAX_JOBS [MAX_BYTES]]" to configure a uid
+class SchedFile : public ControlFile {
+ public:
+  SchedFile() : ControlFile() {}
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+ protected:
+  int apply(const std::string &text) override;
+};
+
+// The K entries with the largest value in one leaf field, largest first.
+// Writing "K FIELD" sets the query; FIELD may be left out for integer leaves.
+class MapTopFile : public ControlFile {
+ public:
+  explicit MapTopFile(const TableInfo *table);
+  int open(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+ protected:
+  int apply(const std::string &text) override;
+ private:
+  const TableInfo *table_;
+  size_t k_;
+  Layout::Field field_;
+};
+
+// Entries matching the written Query, as "KEY LEAF" lines or as the raw key
+// and leaf bytes back to back
+class MapQueryFile : public ControlFile {
+ public:
+  explicit MapQueryFile(const TableInfo *table);
+  int open(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+ protected:
+  int apply(const std::string &text) override;
+ private:
+  const TableInfo *table_;
+  Query query_;
+};
+
+// Leaves of a batch of keys written to the handle, looked up again on every
+// read from offset 0. Text keys, one per line, come back as "KEY LEAF" lines
+// in the order written, "KEY -" for a missing key. Binary keys, back to
+// back, come back as one found byte per key and then the leaves, zeroed
+// where the key was missing.
+class MapLookupFile : public File {
+ public:
+  MapLookupFile(const TableInfo *table, bool binary);
+  int open(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+  int write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+  int truncate(off_t newsize) override { return 0; }
+ protected:
+  size_t size() const override { return 0; }
+ private:
+  const TableInfo *table_;
+  bool binary_;
+};
+
+// Writing anything empties the map, reading tells how many entries went
+class MapClearFile : public ControlFile {
+ public:
+  explicit MapClearFile(const TableInfo *table);
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+ protected:
+  int apply(const std::string &text) override;
+ private:
+  const TableInfo *table_;
+  size_t cleared_;
+};
+
+// Read-and-reset of a map the program keeps in two copies, NAME and
+// NAME_alt, picking the one to update by element 0 of the NAME_sel array.
+// A read from offset 0 points the program at the other copy and lists the
+// one it was updating. That copy is cleared by the next read, which first
+// adds in whatever reached it after it was listed.
+class MapSwapFile : public File {
+ public:
+  MapSwapFile(const TableInfo *table, const TableInfo *alt, const TableInfo *sel);
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+ protected:
+  size_t size() const override { return 0; }
+ private:
+  const TableInfo *table_;
+  const TableInfo *alt_;
+  const TableInfo *sel_;
+  std::mutex mutex_;
+  // the retired copy as the last read listed it, leaves by key position;
+  // unknown until this file has swapped once
+  bool listed_any_;
+  KeySet listed_;
+  std::vector<uint8_t> listed_leaves_;
+};
+
+// Writing "INTERVAL_MS FRAMES [FIELD]" starts sampling the map, "0" stops it
+class MapSampleFile : public ControlFile {
+ public:
+  explicit MapSampleFile(const TableInfo *table);
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+ protected:
+  int apply(const std::string &text) override;
+ private:
+  const TableInfo *table_;
+};
+
+// Write "INTERVAL_MS" to publish snapshots of the map behind `snapshot`,
+// "0" to stop
+class MapPublishFile : public ControlFile {
+ public:
+  explicit MapPublishFile(const TableInfo *table);
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+ protected:
+  int apply(const std::string &text) override;
+ private:
+  const TableInfo *table_;
+};
+
+// The MetricSet config of the map; writing only blank lines removes it
+class MapMetricsFile : public ControlFile {
+ public:
+  explicit MapMetricsFile(const TableInfo *table);
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+ protected:
+  int apply(const std::string &text) override;
+ private:
+  const TableInfo *table_;
+};
+
+// OpenMetrics exposition of the maps below the parent, a program or the
+// root. The text of a scrape is built into a buffer that the previous one
+// left behind, so that a scrape does not grow a new one from scratch.
+class MetricsFile : public File {
+ public:
+  MetricsFile() : File(direct_e) {}
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+  int release(struct fuse_file_info *fi) override;
+ protected:
+  size_t size() const override { return 0; }
+ private:
+  std::mutex mutex_;
+  std::string spare_;
+  std::vector<std::string> sections_;
+};
+
+// Sampler::series() or Sampler::rate() of the map, empty while not sampling
+class MapSeriesFile : public File {
+ public:
+  explicit MapSeriesFile(bool rate) : File(direct_e), rate_(rate) {}
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+ protected:
+  size_t size() const override { return 0; }
+ private:
+  bool rate_;
 };
 
 class MapEntry : public StringFile {
@@ -343,13 +798,45 @@ class MapEntry : public StringFile {
   int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
   int truncate(off_t newsize) override;
   int flush(struct fuse_file_info *fi) override;
+  int release(struct fuse_file_info *fi) override;
+  int unlink() override;
+  // open or holding data not yet written to the map, otherwise the inode
+  // can be dropped and built again on the next lookup
+  bool busy() const { return opens_ || dirty_; }
+  const uint8_t * key() const { return &key_[0]; }
+  // when the map dir last looked the entry up, by its own clock
+  uint64_t used() const { return used_; }
+  void set_used(uint64_t used) { used_ = used; }
+ private:
+  int refresh();
+  std::unique_ptr<uint8_t[]> key_;
+  size_t leaf_size_;
+  bool dirty_;
+  int opens_;
+  uint64_t used_;
+};
+
+class RawMapEntry : public File {
+ public:
+  RawMapEntry(std::unique_ptr<uint8_t[]> key, size_t leaf_size, bool created);
+  int getattr(struct stat *st) override;
+  int open(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+  int write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) override;
+  int truncate(off_t newsize) override;
+  int flush(struct fuse_file_info *fi) override;
+  int release(struct fuse_file_info *fi) override;
   int unlink() override;
+  bool busy() const { return opens_ || dirty_; }
+ protected:
+  size_t size() const override { return leaf_size_; }
  private:
   int refresh();
   std::unique_ptr<uint8_t[]> key_;
-  size_t key_size_;
+  std::unique_ptr<uint8_t[]> leaf_;
   size_t leaf_size_;
   bool dirty_;
+  int opens_;
 };
 
 }  // namespace bcc
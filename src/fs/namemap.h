@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "hash.h"
+#include "string_util.h"
+
+namespace bcc {
+
+// Map from names to values, looked up by StringRef so that resolving a path
+// does not build a std::string per component. Entries sit in one array in no
+// particular order and an open addressing table indexes them by name.
+// Erasing moves the last entry into the hole, so erase(it) returns it.
+template <class V>
+class NameMap {
+ public:
+  struct Entry {
+    std::string first;
+    V second;
+  };
+  typedef Entry * iterator;
+  typedef const Entry * const_iterator;
+
+  NameMap() {}
+  NameMap(NameMap &&other) = default;
+  NameMap & operator=(NameMap &&other) = default;
+
+  iterator begin() { return entries_.data(); }
+  iterator end() { return entries_.data() + entries_.size(); }
+  const_iterator begin() const { return entries_.data(); }
+  const_iterator end() const { return entries_.data() + entries_.size(); }
+  size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+
+  iterator find(StringRef name) {
+    if (entries_.empty())
+      return end();
+    uint32_t s = slots_[slot_of(name)];
+    return s ? &entries_[s - 1] : end();
+  }
+
+  V & operator[](StringRef name) {
+    if ((entries_.size() + 1) * 4 > slots_.size() * 3)
+      grow();
+    size_t i = slot_of(name);
+    if (!slots_[i]) {
+      entries_.push_back(Entry{name.str(), V()});
+      slots_[i] = entries_.size();
+    }
+    return entries_[slots_[i] - 1].second;
+  }
+
+  iterator erase(iterator it) {
+    size_t pos = it - begin();
+    size_t mask = slots_.size() - 1;
+    size_t i = slot_of(it->first);
+    // shift later members of the probe run back, no tombstones needed
+    for (size_t j = (i + 1) & mask; slots_[j]; j = (j + 1) & mask) {
+      size_t home = hash(entries_[slots_[j] - 1].first) & mask;
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        slots_[i] = slots_[j];
+        i = j;
+      }
+    }
+    slots_[i] = 0;
+    size_t last = entries_.size() - 1;
+    if (pos != last) {
+      slots_[slot_of(entries_[last].first)] = pos + 1;
+      entries_[pos] = std::move(entries_[last]);
+    }
+    entries_.pop_back();
+    return begin() + pos;
+  }
+
+ private:
+  NameMap(const NameMap &) = delete;
+  static uint64_t hash(StringRef name) { return hash_bytes(name.data(), name.size()); }
+
+  // slot holding name, or the empty slot where it would go
+  size_t slot_of(StringRef name) const {
+    size_t mask = slots_.size() - 1;
+    for (size_t i = hash(name) & mask;; i = (i + 1) & mask) {
+      uint32_t s = slots_[i];
+      if (!s || StringRef(entries_[s - 1].first) == name)
+        return i;
+    }
+  }
+
+  void grow() {
+    slots_.assign(slots_.empty() ? 8 : slots_.size() * 2, 0);
+    size_t mask = slots_.size() - 1;
+    for (size_t pos = 0; pos < entries_.size(); ++pos) {
+      size_t i = hash(entries_[pos].first) & mask;
+      while (slots_[i])
+        i = (i + 1) & mask;
+      slots_[i] = pos + 1;
+    }
+  }
+
+  std::vector<Entry> entries_;
+  // position + 1, 0 for an empty slot
+  std::vector<uint32_t> slots_;
+};
+
+}  // namespace bcc
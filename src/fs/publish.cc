@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <bcc/libbpf.h>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "publish.h"
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+
+namespace bcc {
+
+// The memfd is sized for every entry the map can hold and sealed against
+// resizing, so readers never fault on a short file. Writable mappings other
+// than the daemon's own are refused where the kernel has F_SEAL_FUTURE_WRITE.
+unique_ptr<Publisher> Publisher::create(const TableInfo *table, unsigned interval_ms) {
+  size_t size = sizeof(bcc_snapshot) + table->max_entries * (table->key_size + table->leaf_size);
+  int fd = memfd_create("bcc_snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return nullptr;
+  void *mem = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED) {
+    close(fd);
+    return nullptr;
+  }
+  int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+  if (fcntl(fd, F_ADD_SEALS, seals | F_SEAL_FUTURE_WRITE) && fcntl(fd, F_ADD_SEALS, seals)) {
+    munmap(mem, size);
+    close(fd);
+    return nullptr;
+  }
+  return unique_ptr<Publisher>(new Publisher(table, interval_ms, fd, mem, size));
+}
+
+Publisher::Publisher(const TableInfo *table, unsigned interval_ms, int fd, void *mem,
+                     size_t size)
+    : table_(table), interval_ms_(interval_ms), fd_(fd), header_((bcc_snapshot *)mem),
+      size_(size), stop_(false) {
+  header_->key_size = table_->key_size;
+  header_->leaf_size = table_->leaf_size;
+  header_->capacity = table_->max_entries;
+  publish();
+  thread_ = std::thread(&Publisher::run, this);
+}
+
+Publisher::~Publisher() {
+  {
+    unique_lock<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+  // readers keep their mappings, waiters are told nothing more will come
+  __atomic_or_fetch(&header_->flags, BCC_SNAPSHOT_CLOSED, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&header_->seq, 2, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &header_->seq, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+  munmap(header_, size_);
+  close(fd_);
+}
+
+void Publisher::run() {
+  unique_lock<std::mutex> lock(mutex_);
+  auto next = std::chrono::steady_clock::now();
+  while (!stop_) {
+    next += std::chrono::milliseconds(interval_ms_);
+    if (cond_.wait_until(lock, next, [this] { return stop_; }))
+      break;
+    lock.unlock();
+    publish();
+    lock.lock();
+  }
+}
+
+// Readers only retry while the records are copied, not for the whole walk.
+// The seq word doubles as the futex that bcc_snapshot_wait() sleeps on.
+void Publisher::publish() {
+  size_t key_size = table_->key_size, rsize = record_size();
+  size_t count = 0;
+  Scratch key(key_size);
+  void *prev = nullptr;
+  unique_lock<std::mutex> lock(mutex_);
+  staging_.resize(header_->capacity * rsize);
+  while (count < header_->capacity &&
+         bpf_get_next_key(table_->fd, prev, key.get()) == 0) {
+    prev = key.get();
+    uint8_t *r = &staging_[count * rsize];
+    if (bpf_lookup_elem(table_->fd, key.get(), r + key_size))
+      continue;
+    memcpy(r, key.get(), key_size);
+    ++count;
+  }
+
+  uint32_t seq = header_->seq;
+  __atomic_store_n(&header_->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(header_ + 1, staging_.data(), count * rsize);
+  header_->count = count;
+  header_->time_ns = now_ns();
+  ++header_->generation;
+  __atomic_store_n(&header_->seq, seq + 2, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &header_->seq, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+void Publisher::set_table(const TableInfo *table) {
+  unique_lock<std::mutex> lock(mutex_);
+  table_ = table;
+}
+
+string Publisher::config() const {
+  unique_lock<std::mutex> lock(mutex_);
+  return std::to_string(interval_ms_) + " " + std::to_string(header_->generation) + "\n";
+}
+
+void Publisher::counted(size_t *count, uint64_t *ts) const {
+  unique_lock<std::mutex> lock(mutex_);
+  *count = header_->count;
+  *ts = header_->time_ns;
+}
+
+size_t Publisher::memory() const {
+  unique_lock<std::mutex> lock(mutex_);
+  return sizeof(*this) + staging_.capacity() + size_;
+}
+
+}  // namespace bcc
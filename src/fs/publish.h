@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client.h"
+#include "module.h"
+
+namespace bcc {
+
+// Writes a snapshot of a map at a fixed interval into a sealed memfd that
+// readers map read-only, so that any number of them share one walk over the
+// map per interval. The layout is struct bcc_snapshot from client.h,
+// followed by the raw key and leaf of each entry.
+class Publisher {
+ public:
+  // nullptr if the memfd cannot be set up
+  static std::unique_ptr<Publisher> create(const TableInfo *table, unsigned interval_ms);
+  ~Publisher();
+  int fd() const { return fd_; }
+  // write a snapshot now, as the thread does every interval
+  void publish();
+  // go on with the same map in a reloaded module
+  void set_table(const TableInfo *table);
+  // "INTERVAL_MS GENERATION"
+  std::string config() const;
+  // entries in the latest snapshot and when it was written
+  void counted(size_t *count, uint64_t *ts) const;
+  size_t memory() const;
+ private:
+  Publisher(const TableInfo *table, unsigned interval_ms, int fd, void *mem, size_t size);
+  void run();
+  size_t record_size() const { return table_->key_size + table_->leaf_size; }
+
+  const TableInfo *table_;
+  unsigned interval_ms_;
+  int fd_;
+  bcc_snapshot *header_;
+  size_t size_;
+  // where a snapshot is built before it is copied out under the seqlock
+  std::vector<uint8_t> staging_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stop_;
+  std::thread thread_;
+};
+
+}  // namespace bcc
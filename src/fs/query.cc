@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "query.h"
+
+using std::string;
+using std::vector;
+
+namespace bcc {
+
+namespace {
+
+enum Op { eq_e, ne_e, lt_e, le_e, gt_e, ge_e };
+
+// signed values are biased so that they order like unsigned ones
+template <size_t N, bool Signed>
+uint64_t rank(const uint8_t *p) {
+  uint64_t v = 0;
+  memcpy(&v, p, N);
+  if (Signed) {
+    const unsigned shift = 64 - 8 * N;
+    v = (uint64_t)((int64_t)(v << shift) >> shift) ^ (1ull << 63);
+  }
+  return v;
+}
+
+template <size_t N, bool Signed, Op O>
+bool compare(const uint8_t *data, const Query::Clause &c) {
+  uint64_t v = rank<N, Signed>(data + c.offset);
+  switch (O) {
+    case eq_e: return v == c.value;
+    case ne_e: return v != c.value;
+    case lt_e: return v < c.value;
+    case le_e: return v <= c.value;
+    case gt_e: return v > c.value;
+    case ge_e: return v >= c.value;
+  }
+  return false;
+}
+
+bool in_prefix(const uint8_t *data, const Query::Clause &c) {
+  const uint8_t *p = data + c.offset;
+  for (size_t i = 0; i < c.addr.size(); ++i)
+    if ((p[i] & c.mask[i]) != c.addr[i])
+      return false;
+  return true;
+}
+
+typedef bool (*Test)(const uint8_t *, const Query::Clause &);
+
+template <size_t N, bool Signed>
+Test pick_op(Op op) {
+  switch (op) {
+    case eq_e: return compare<N, Signed, eq_e>;
+    case ne_e: return compare<N, Signed, ne_e>;
+    case lt_e: return compare<N, Signed, lt_e>;
+    case le_e: return compare<N, Signed, le_e>;
+    case gt_e: return compare<N, Signed, gt_e>;
+    case ge_e: return compare<N, Signed, ge_e>;
+  }
+  return nullptr;
+}
+
+template <bool Signed>
+Test pick_size(size_t size, Op op) {
+  switch (size) {
+    case 1: return pick_op<1, Signed>(op);
+    case 2: return pick_op<2, Signed>(op);
+    case 4: return pick_op<4, Signed>(op);
+    case 8: return pick_op<8, Signed>(op);
+  }
+  return nullptr;
+}
+
+bool parse_op(const string &s, Op *op) {
+  static const char *names[] = {"==", "!=", "<", "<=", ">", ">="};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+    if (s == names[i]) {
+      *op = (Op)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// value biased the same way rank() biases the field
+bool parse_value(const string &s, bool is_signed, uint64_t *v) {
+  if (s.empty())
+    return false;
+  char *end;
+  errno = 0;
+  if (is_signed)
+    *v = (uint64_t)strtoll(s.c_str(), &end, 0) ^ (1ull << 63);
+  else if (s[0] == '-')
+    return false;
+  else
+    *v = strtoull(s.c_str(), &end, 0);
+  return !errno && !*end;
+}
+
+// "10.0.0.0/8" or "fe80::/10" over a field of 4 or 16 bytes
+bool parse_prefix(const string &s, size_t size, Query::Clause *c) {
+  size_t slash = s.find('/');
+  string addr = s.substr(0, slash);
+  uint8_t buf[16];
+  int family = size == 4 ? AF_INET : size == 16 ? AF_INET6 : 0;
+  if (!family || inet_pton(family, addr.c_str(), buf) != 1)
+    return false;
+  unsigned long bits = size * 8;
+  if (slash != string::npos) {
+    char *end;
+    bits = strtoul(s.c_str() + slash + 1, &end, 10);
+    if (*end || end == s.c_str() + slash + 1 || bits > size * 8)
+      return false;
+  }
+  c->addr.assign(buf, buf + size);
+  c->mask.assign(size, 0);
+  for (size_t i = 0; i < size; ++i) {
+    size_t n = bits > i * 8 ? bits - i * 8 : 0;
+    c->mask[i] = n >= 8 ? 0xff : (uint8_t)(0xff00 >> n);
+    c->addr[i] &= c->mask[i];
+  }
+  return true;
+}
+
+// "key", "leaf.bytes", "key.saddr[2]"
+const Layout::Field * parse_ref(const string &s, const TableCodec &codec, bool *is_key,
+                                long *index) {
+  size_t dot = s.find('.'), bracket = s.find('[');
+  string side = s.substr(0, std::min(dot, bracket));
+  if (side != "key" && side != "leaf")
+    return nullptr;
+  *is_key = side == "key";
+  string name;
+  if (dot != string::npos)
+    name = s.substr(dot + 1, bracket == string::npos ? string::npos : bracket - dot - 1);
+  *index = -1;
+  if (bracket != string::npos) {
+    char *end;
+    *index = strtol(s.c_str() + bracket + 1, &end, 10);
+    if (end == s.c_str() + bracket + 1 || *index < 0 || strcmp(end, "]"))
+      return nullptr;
+  }
+  const Layout &layout = *is_key ? codec.key_layout() : codec.leaf_layout();
+  const Layout::Field *f = layout.field(name);
+  if (!f || (*index >= 0 && (size_t)*index >= f->count))
+    return nullptr;
+  return f;
+}
+
+}  // namespace
+
+int Query::compile(const string &text, const TableCodec &codec) {
+  std::istringstream in(text);
+  vector<string> words;
+  for (string w; in >> w;)
+    words.push_back(w);
+  size_t i = 0;
+  Format format = text_e;
+  if (i < words.size() && (words[i] == "text" || words[i] == "binary"))
+    format = words[i++] == "binary" ? binary_e : text_e;
+  vector<Clause> key_clauses, leaf_clauses;
+  while (i < words.size()) {
+    if ((key_clauses.size() || leaf_clauses.size()) && words[i++] != "and")
+      return -EINVAL;
+    if (i + 3 > words.size())
+      return -EINVAL;
+    bool is_key;
+    long index;
+    const Layout::Field *f = parse_ref(words[i], codec, &is_key, &index);
+    if (!f)
+      return -EINVAL;
+    Clause c;
+    c.offset = f->offset + (index > 0 ? index * f->size : 0);
+    c.value = 0;
+    Op op;
+    if (words[i + 1] == "in") {
+      // a whole array of bytes or words holds an address too
+      size_t size = index < 0 && f->count ? f->size * f->count : f->size;
+      if (!parse_prefix(words[i + 2], size, &c))
+        return -EINVAL;
+      c.test = in_prefix;
+    } else {
+      if ((f->count && index < 0) || !parse_op(words[i + 1], &op) ||
+          !parse_value(words[i + 2], f->is_signed, &c.value))
+        return -EINVAL;
+      c.test = f->is_signed ? pick_size<true>(f->size, op) : pick_size<false>(f->size, op);
+      if (!c.test)
+        return -EINVAL;
+    }
+    (is_key ? key_clauses : leaf_clauses).push_back(c);
+    i += 3;
+  }
+  format_ = format;
+  key_clauses_.swap(key_clauses);
+  leaf_clauses_.swap(leaf_clauses);
+  return 0;
+}
+
+}  // namespace bcc
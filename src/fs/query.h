@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "codec.h"
+
+namespace bcc {
+
+// Filter over the entries of one table: clauses on integer fields of the key
+// or leaf, all of which have to hold. Each clause is compiled into a test
+// specialized for the width and signedness of its field and its operator, so
+// that matching an entry never goes through the text form.
+//
+//   [text|binary] [CLAUSE [and CLAUSE]...]
+//   CLAUSE := REF OP NUMBER | REF in ADDRESS/BITS
+//   REF    := key|leaf [.FIELD] [[INDEX]]
+//   OP     := == | != | < | <= | > | >=
+class Query {
+ public:
+  enum Format { text_e, binary_e };
+
+  Query() : format_(text_e) {}
+  // 0, or -EINVAL if the text does not parse against the table's layouts
+  int compile(const std::string &text, const TableCodec &codec);
+  Format format() const { return format_; }
+  // a leaf needs to be looked up only if the key matched and there are
+  // clauses on it
+  bool match_key(const uint8_t *key) const { return match(key_clauses_, key); }
+  bool match_leaf(const uint8_t *leaf) const { return match(leaf_clauses_, leaf); }
+
+  struct Clause {
+    bool (*test)(const uint8_t *data, const Clause &c);
+    size_t offset;
+    uint64_t value;
+    // address and netmask for "in", over the bytes of the field
+    std::vector<uint8_t> addr;
+    std::vector<uint8_t> mask;
+  };
+ private:
+  static bool match(const std::vector<Clause> &clauses, const uint8_t *data) {
+    for (auto &c : clauses)
+      if (!c.test(data, c))
+        return false;
+    return true;
+  }
+  Format format_;
+  std::vector<Clause> key_clauses_;
+  std::vector<Clause> leaf_clauses_;
+};
+
+}  // namespace bcc
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <algorithm>
+#include <bcc/libbpf.h>
+#include <chrono>
+#include <cstring>
+
+#include "clock.h"
+#include "sampler.h"
+
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+namespace bcc {
+
+namespace {
+
+// counters are read as unsigned, see Sampler::delta() for the sign
+uint64_t load_field(const uint8_t *leaf, const Layout::Field &f) {
+  uint64_t v = 0;
+  memcpy(&v, leaf + f.offset, f.size);
+  return v;
+}
+
+void append_int(int64_t v, string *out) {
+  char buf[24], *end = buf + sizeof(buf), *p = end;
+  uint64_t u = v < 0 ? -(uint64_t)v : v;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (v < 0)
+    *--p = '-';
+  out->append(p, end - p);
+}
+
+}  // namespace
+
+Sampler::Sampler(const TableInfo *table, const Layout::Field &field, unsigned interval_ms,
+                 size_t frames)
+    : table_(table), field_(field), interval_ms_(interval_ms),
+      ring_(std::max<size_t>(frames, 2)), taken_(0), stop_(false) {
+  sample();
+  thread_ = std::thread(&Sampler::run, this);
+}
+
+Sampler::~Sampler() {
+  {
+    unique_lock<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+}
+
+void Sampler::run() {
+  unique_lock<std::mutex> lock(mutex_);
+  auto next = std::chrono::steady_clock::now();
+  while (!stop_) {
+    next += std::chrono::milliseconds(interval_ms_);
+    if (cond_.wait_until(lock, next, [this] { return stop_; }))
+      break;
+    lock.unlock();
+    sample();
+    lock.lock();
+  }
+}
+
+void Sampler::sample() {
+  // build the frame outside the lock, readers only wait for the swap
+  Frame f;
+  f.ts = now_ns();
+  f.count = 0;
+  size_t key_size = table_->key_size, rsize = record_size();
+  Scratch key(key_size), leaf(table_->leaf_size);
+  void *prev = nullptr;
+  while (bpf_get_next_key(table_->fd, prev, key.get()) == 0) {
+    prev = key.get();
+    if (bpf_lookup_elem(table_->fd, key.get(), leaf.get()))
+      continue;
+    f.records.resize((f.count + 1) * rsize);
+    uint8_t *r = &f.records[f.count++ * rsize];
+    memcpy(r, key.get(), key_size);
+    uint64_t v = load_field(leaf.get(), field_);
+    memcpy(r + key_size, &v, sizeof(v));
+  }
+  // sort record indices by key, then lay the records out in that order
+  vector<uint32_t> order(f.count);
+  for (size_t i = 0; i < f.count; ++i)
+    order[i] = i;
+  const uint8_t *base = f.records.data();
+  std::sort(order.begin(), order.end(), [base, rsize, key_size] (uint32_t a, uint32_t b) {
+    return memcmp(base + a * rsize, base + b * rsize, key_size) < 0;
+  });
+  vector<uint8_t> sorted(f.records.size());
+  for (size_t i = 0; i < f.count; ++i)
+    memcpy(&sorted[i * rsize], base + order[i] * rsize, rsize);
+  f.records.swap(sorted);
+
+  unique_lock<std::mutex> lock(mutex_);
+  std::swap(ring_[taken_ % ring_.size()], f);
+  ++taken_;
+}
+
+uint64_t Sampler::value(const Frame &f, const uint8_t *key, size_t *cursor) const {
+  size_t key_size = table_->key_size, rsize = record_size();
+  int c = -1;
+  while (*cursor < f.count && (c = memcmp(&f.records[*cursor * rsize], key, key_size)) < 0)
+    ++*cursor;
+  if (*cursor == f.count || c)
+    return 0;
+  uint64_t v;
+  memcpy(&v, &f.records[*cursor * rsize + key_size], sizeof(v));
+  return v;
+}
+
+vector<const Sampler::Frame *> Sampler::ordered() const {
+  vector<const Frame *> frames;
+  size_t n = std::min(taken_, ring_.size());
+  for (size_t i = taken_ - n; i < taken_; ++i)
+    frames.push_back(&ring_[i % ring_.size()]);
+  return frames;
+}
+
+// Deltas wrap at the width of the field like the counters do: an unsigned
+// counter that wrapped still moved forward, a signed field may go either way
+int64_t Sampler::delta(uint64_t v, uint64_t prev) const {
+  size_t bits = 8 * field_.size;
+  if (bits >= 64)
+    return v - prev;
+  uint64_t d = (v - prev) & ((1ull << bits) - 1);
+  if (field_.is_signed && d >> (bits - 1))
+    d |= ~0ull << bits;
+  return d;
+}
+
+// all frames are sorted by key, so each is walked once with a cursor
+int Sampler::series(string *out) const {
+  unique_lock<std::mutex> lock(mutex_);
+  vector<const Frame *> frames = ordered();
+  const Frame &last = *frames.back();
+  size_t rsize = record_size();
+  vector<size_t> cursors(frames.size(), 0);
+  for (size_t i = 0; i < last.count; ++i) {
+    const uint8_t *key = &last.records[i * rsize];
+    if (table_->codec->format_key(key, out))
+      return -EIO;
+    uint64_t prev = value(*frames[0], key, &cursors[0]);
+    for (size_t j = 1; j < frames.size(); ++j) {
+      uint64_t v = value(*frames[j], key, &cursors[j]);
+      out->push_back(' ');
+      append_int(delta(v, prev), out);
+      prev = v;
+    }
+    out->push_back('\n');
+  }
+  return 0;
+}
+
+int Sampler::rate(string *out) const {
+  unique_lock<std::mutex> lock(mutex_);
+  vector<const Frame *> frames = ordered();
+  const Frame &first = *frames.front(), &last = *frames.back();
+  size_t key_size = table_->key_size, rsize = record_size();
+  uint64_t ns = last.ts - first.ts;
+  size_t cursor = 0;
+  for (size_t i = 0; i < last.count; ++i) {
+    const uint8_t *key = &last.records[i * rsize];
+    if (table_->codec->format_key(key, out))
+      return -EIO;
+    uint64_t v;
+    memcpy(&v, key + key_size, sizeof(v));
+    int64_t d = delta(v, value(first, key, &cursor));
+    // per second, with three decimals
+    int64_t milli = ns ? (int64_t)(d * 1e12 / ns) : 0;
+    out->push_back(' ');
+    if (milli < 0) {
+      out->push_back('-');
+      milli = -milli;
+    }
+    append_int(milli / 1000, out);
+    out->push_back('.');
+    out->push_back('0' + milli / 100 % 10);
+    out->push_back('0' + milli / 10 % 10);
+    out->push_back('0' + milli % 10);
+    out->push_back('\n');
+  }
+  return 0;
+}
+
+string Sampler::config() const {
+  return std::to_string(interval_ms_) + " " + std::to_string(ring_.size()) + " " +
+         field_.name + "\n";
+}
+
+bool Sampler::counted(size_t *count, uint64_t *ts) const {
+  unique_lock<std::mutex> lock(mutex_);
+  if (!taken_)
+    return false;
+  const Frame &f = ring_[(taken_ - 1) % ring_.size()];
+  *count = f.count;
+  *ts = f.ts;
+  return true;
+}
+
+size_t Sampler::memory() const {
+  unique_lock<std::mutex> lock(mutex_);
+  size_t n = sizeof(*this) + ring_.capacity() * sizeof(Frame);
+  for (auto &f : ring_)
+    n += f.records.capacity();
+  return n;
+}
+
+}  // namespace bcc
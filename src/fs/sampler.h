@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "codec.h"
+#include "module.h"
+
+namespace bcc {
+
+// Snapshots one integer field of every entry of a map at a fixed interval
+// into a ring of frames, so that any number of readers can get per key
+// deltas and rates from a single walk over the map per interval.
+class Sampler {
+ public:
+  // frames is the number of snapshots kept, at least 2
+  Sampler(const TableInfo *table, const Layout::Field &field, unsigned interval_ms,
+          size_t frames);
+  ~Sampler();
+  // take a frame now, as the thread does every interval
+  void sample();
+  // "KEY D1 D2 ..." per key of the newest frame, oldest delta first
+  int series(std::string *out) const;
+  // "KEY RATE" per key of the newest frame, per second over the frames kept
+  int rate(std::string *out) const;
+  // "INTERVAL_MS FRAMES FIELD"
+  std::string config() const;
+  // entries in the newest frame and when it was taken, false before the first
+  bool counted(size_t *count, uint64_t *ts) const;
+  size_t memory() const;
+ private:
+  // keys with the sampled value, sorted by key bytes
+  struct Frame {
+    uint64_t ts;
+    size_t count;
+    std::vector<uint8_t> records;
+  };
+  void run();
+  size_t record_size() const { return table_->key_size + sizeof(uint64_t); }
+  // value of key in frame f, 0 if it was not in the map then; cursor is
+  // a position in f at or before key, advanced past smaller keys
+  uint64_t value(const Frame &f, const uint8_t *key, size_t *cursor) const;
+  // change from prev to v of the sampled field
+  int64_t delta(uint64_t v, uint64_t prev) const;
+  // frames in the order taken, oldest first
+  std::vector<const Frame *> ordered() const;
+
+  const TableInfo *table_;
+  Layout::Field field_;
+  unsigned interval_ms_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<Frame> ring_;
+  size_t taken_;
+  bool stop_;
+  std::thread thread_;
+};
+
+}  // namespace bcc
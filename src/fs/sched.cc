@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+#include "clock.h"
+#include "sched.h"
+
+using std::string;
+using std::unique_lock;
+
+namespace bcc {
+
+Scheduler::Slot & Scheduler::Slot::operator=(Slot &&o) {
+  release();
+  sched_ = o.sched_;
+  uid_ = o.uid_;
+  bytes_ = o.bytes_;
+  start_ = o.start_;
+  o.sched_ = nullptr;
+  return *this;
+}
+
+void Scheduler::Slot::release() {
+  if (sched_) {
+    sched_->release(this);
+    sched_ = nullptr;
+  }
+}
+
+Scheduler::Scheduler(unsigned slots)
+    : slots_(std::max(slots, 1u)), free_(slots_), next_ticket_(0) {
+}
+
+int Scheduler::admit(uid_t uid, Kind kind, size_t bytes, Slot *slot) {
+  slot->release();
+  uint64_t start = now_ns();
+  unique_lock<std::mutex> lock(mutex_);
+  User &u = users_[uid];
+  if (u.max_bytes && bytes > u.max_bytes)
+    return -ENOMEM;
+  if (!u.running && u.queue.empty()) {
+    // a user coming back starts level with the least served busy one, it
+    // earns no credit for the time it was away
+    const User *least = nullptr;
+    for (auto &it : users_) {
+      const User &o = it.second;
+      if (&o != &u && (o.running || !o.queue.empty()) && (!least || o.vtime < least->vtime))
+        least = &o;
+    }
+    if (least)
+      u.vtime = std::max(u.vtime, least->vtime);
+  }
+  uint64_t ticket = next_ticket_++;
+  u.queue.emplace_back(ticket, bytes);
+  dispatch();
+  cond_.wait(lock, [this, ticket] { return granted_.count(ticket) || refused_.count(ticket); });
+  if (refused_.erase(ticket))
+    return -ENOMEM;
+  granted_.erase(ticket);
+
+  uint64_t waited = now_ns() - start;
+  ++(kind == compile_e ? u.compiles : u.scans);
+  u.wait_ns += waited;
+  u.max_wait_ns = std::max(u.max_wait_ns, waited);
+  slot->sched_ = this;
+  slot->uid_ = uid;
+  slot->bytes_ = bytes;
+  slot->start_ = now_ns();
+  return 0;
+}
+
+bool Scheduler::fits(const User &u, size_t bytes) const {
+  if (u.max_jobs && u.running >= u.max_jobs)
+    return false;
+  return !u.max_bytes || u.bytes + bytes <= u.max_bytes;
+}
+
+void Scheduler::dispatch() {
+  bool granted = false;
+  while (free_) {
+    User *next = nullptr;
+    for (auto &it : users_) {
+      User &u = it.second;
+      if (!u.queue.empty() && fits(u, u.queue.front().second) && (!next || u.vtime < next->vtime))
+        next = &u;
+    }
+    if (!next)
+      break;
+    ++next->running;
+    next->bytes += next->queue.front().second;
+    granted_.insert(next->queue.front().first);
+    next->queue.pop_front();
+    --free_;
+    granted = true;
+  }
+  if (granted)
+    cond_.notify_all();
+}
+
+void Scheduler::release(Slot *slot) {
+  uint64_t ran = now_ns() - slot->start_;
+  unique_lock<std::mutex> lock(mutex_);
+  User &u = users_[slot->uid_];
+  --u.running;
+  u.bytes -= slot->bytes_;
+  u.vtime += ran / u.weight;
+  ++free_;
+  dispatch();
+}
+
+int Scheduler::configure(const string &text) {
+  unsigned uid = 0, weight = 0, max_jobs = 0;
+  unsigned long max_bytes = 0;
+  int end = 0;
+  int n = sscanf(text.c_str(), "%u %u %n%u %n%lu %n", &uid, &weight, &end, &max_jobs, &end,
+                 &max_bytes, &end);
+  if (n < 2 || end != (int)text.size() || !weight)
+    return -EINVAL;
+  unique_lock<std::mutex> lock(mutex_);
+  User &u = users_[uid];
+  u.weight = weight;
+  u.max_jobs = max_jobs;
+  u.max_bytes = max_bytes;
+  // a job too big for the new limit would hold up the ones behind it forever
+  auto big = [&u] (const std::pair<uint64_t, size_t> &job) {
+    return u.max_bytes && job.second > u.max_bytes;
+  };
+  for (auto &job : u.queue)
+    if (big(job))
+      refused_.insert(job.first);
+  u.queue.erase(std::remove_if(u.queue.begin(), u.queue.end(), big), u.queue.end());
+  if (!refused_.empty())
+    cond_.notify_all();
+  dispatch();
+  return 0;
+}
+
+string Scheduler::stats() const {
+  char line[512];
+  string data;
+  unique_lock<std::mutex> lock(mutex_);
+  for (auto &it : users_) {
+    const User &u = it.second;
+    snprintf(line, sizeof(line),
+             "uid %u weight %u max_jobs %u max_bytes %zu running %u queued %zu bytes %zu "
+             "compiles %llu scans %llu wait_ns %llu max_wait_ns %llu\n",
+             (unsigned)it.first, u.weight, u.max_jobs, u.max_bytes, u.running, u.queue.size(),
+             u.bytes, (unsigned long long)u.compiles, (unsigned long long)u.scans,
+             (unsigned long long)u.wait_ns, (unsigned long long)u.max_wait_ns);
+    data += line;
+  }
+  return data;
+}
+
+size_t Scheduler::waiting() const {
+  size_t n = 0;
+  unique_lock<std::mutex> lock(mutex_);
+  for (auto &it : users_)
+    n += it.second.queue.size();
+  return n;
+}
+
+}  // namespace bcc
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/types.h>
+
+namespace bcc {
+
+// Admits heavy work, compiles and walks over whole maps, from the users
+// calling into the filesystem. A fixed number of slots is shared; a free
+// slot goes to the user who has had the least run time relative to its
+// weight, oldest job first. Per uid limits cap the jobs a user runs at once
+// and the bytes they may hold.
+class Scheduler {
+ public:
+  enum Kind { compile_e, scan_e };
+
+  // held while a job runs, charging its run time to the uid when dropped
+  class Slot {
+   public:
+    Slot() : sched_(nullptr), uid_(0), bytes_(0), start_(0) {}
+    Slot(Slot &&o) : Slot() { *this = std::move(o); }
+    Slot & operator=(Slot &&o);
+    ~Slot() { release(); }
+    void release();
+   private:
+    friend class Scheduler;
+    Scheduler *sched_;
+    uid_t uid_;
+    size_t bytes_;
+    uint64_t start_;
+  };
+
+  explicit Scheduler(unsigned slots);
+  // wait for uid's turn; -ENOMEM if bytes can never fit its limit
+  int admit(uid_t uid, Kind kind, size_t bytes, Slot *slot);
+  // "UID WEIGHT [MAX_JOBS [MAX_BYTES]]", 0 for no limit; queued jobs that
+  // a lower MAX_BYTES leaves no room for fail with -ENOMEM
+  int configure(const std::string &text);
+  // a line per uid seen: its settings, current use and queue waits
+  std::string stats() const;
+  // jobs waiting for a slot
+  size_t waiting() const;
+  unsigned slots() const { return slots_; }
+ private:
+  struct User {
+    User() : weight(1), max_jobs(0), max_bytes(0), vtime(0), running(0), bytes(0),
+             compiles(0), scans(0), wait_ns(0), max_wait_ns(0) {}
+    unsigned weight;
+    unsigned max_jobs;
+    size_t max_bytes;
+    // run time so far divided by weight
+    uint64_t vtime;
+    unsigned running;
+    size_t bytes;
+    // tickets of the waiting jobs, with the bytes each wants
+    std::deque<std::pair<uint64_t, size_t>> queue;
+    uint64_t compiles;
+    uint64_t scans;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+  };
+  bool fits(const User &u, size_t bytes) const;
+  // hand free slots to the waiting jobs next in line
+  void dispatch();
+  void release(Slot *slot);
+
+  unsigned slots_;
+  unsigned free_;
+  uint64_t next_ticket_;
+  // tickets granted a slot, or refused one, not yet picked up by their waiter
+  std::set<uint64_t> granted_;
+  std::set<uint64_t> refused_;
+  std::map<uid_t, User> users_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+};
+
+}  // namespace bcc
@@ -14,8 +14,10 @@
  * limitations under the License.
  */
 
+#include <cerrno>
 #include <cstring>
 #include <future>
+#include <mutex>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -24,8 +26,10 @@
 #include "mount.h"
 #include "string_util.h"
 
+using std::mutex;
 using std::string;
 using std::thread;
+using std::unique_lock;
 
 namespace bcc {
 
@@ -40,24 +44,27 @@ int Socket::getattr(struct stat *st) {
 }
 
 FDSocket::~FDSocket() {
-  close(fd_);
-  if (sock_ >= 0) {
+  if (sock_ >= 0)
     shutdown(sock_, SHUT_RDWR);
+  if (thread_.joinable())
+    thread_.join();
+  if (sock_ >= 0)
     close(sock_);
-  }
-  thread_.join();
+  close(fd_);
 }
 
+// The socket is created here and only closed by the destructor, after the
+// thread is done with it, so its fd number cannot be reused under the
+// thread or closed twice
 FDSocket::FDSocket(mode_t mode, dev_t rdev, int fd)
-    : Socket(mode, rdev), fd_(fd), sock_(-1), ready_(false) {
+    : Socket(mode, rdev), fd_(fd), sock_(socket(AF_UNIX, SOCK_STREAM, 0)), ready_(false) {
+  if (sock_ < 0) {
+    log("socket: %s\n", strerror(errno));
+    return;
+  }
+  // errors go to the daemon's log, stderr belongs to whoever started it
   auto fn = [&] () {
 
-    sock_ = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (sock_ < 0) {
-      perror("socket");
-      return;
-    }
-
     struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
@@ -65,23 +72,42 @@ FDSocket::FDSocket(mode_t mode, dev_t rdev, int fd)
 
     ::unlink(addr.sun_path);
     if (bind(sock_, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-      perror("bind");
-      close(sock_);
+      log("bind: %s: %s\n", addr.sun_path, strerror(errno));
       return;
     }
 
     if (listen(sock_, 1) < 0) {
-      perror("listen");
-      close(sock_);
+      log("listen: %s: %s\n", addr.sun_path, strerror(errno));
       return;
     }
 
-    bcc_send_fd(sock_, fd_);
+    for (;;) {
+      int cl = accept(sock_, NULL, NULL);
+      if (cl < 0) {
+        // ignore errors when the destructor calls shutdown(sock)
+        if (errno != EINVAL)
+          log("accept: %s\n", strerror(errno));
+        return;
+      }
+      {
+        unique_lock<mutex> lock(mtx_);
+        bcc_send_fd_to(cl, fd_);
+      }
+      close(cl);
+    }
   };
   // todo: make this lighter weight - select loop and/or on-demand
   thread_ = thread(fn);
 }
 
+// the socket stays bound, so clients never find it missing while the fd
+// behind it is replaced
+void FDSocket::set_fd(int fd) {
+  unique_lock<mutex> lock(mtx_);
+  close(fd_);
+  fd_ = fd;
+}
+
 int FDSocket::getattr(struct stat *st) {
   if (!ready_)
     return -ENOENT;
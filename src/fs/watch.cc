@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <bcc/libbpf.h>
+#include <chrono>
+#include <cstring>
+#include <fuse.h>
+#include <poll.h>
+#include <utility>
+#include <vector>
+
+#include "codec.h"
+#include "hash.h"
+#include "mount.h"
+#include "watch.h"
+
+using std::pair;
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+namespace bcc {
+
+namespace {
+
+const unsigned readable = POLLIN | POLLRDNORM;
+const unsigned writable = POLLOUT | POLLWRNORM;
+
+}  // namespace
+
+WatchTarget::WatchTarget(Kind kind, int fd, size_t key_size, size_t leaf_size, const void *key)
+    : kind(kind), fd(fd), key_size(key_size), leaf_size(leaf_size) {
+  if (key)
+    this->key.assign((const char *)key, key_size);
+}
+
+uint64_t WatchTarget::hash() const {
+  Scratch leaf(leaf_size);
+  uint64_t h = 0;
+  if (kind == leaf_e) {
+    if (bpf_lookup_elem(fd, (void *)key.data(), leaf.get()) == 0)
+      h = hash_bytes(leaf.get(), leaf_size);
+  } else {
+    // summed per key, the map may list its keys in any order
+    Scratch k(key_size);
+    void *prev = nullptr;
+    while (bpf_get_next_key(fd, prev, k.get()) == 0) {
+      prev = k.get();
+      uint64_t kh = hash_bytes(k.get(), key_size);
+      if (kind == map_e) {
+        if (bpf_lookup_elem(fd, k.get(), leaf.get()))
+          continue;
+        kh ^= hash_bytes(leaf.get(), leaf_size) * 0x9e3779b97f4a7c15ull;
+      }
+      h += kh;
+    }
+  }
+  return h ? h : 1;
+}
+
+Watcher::Watcher(unsigned interval_ms) : interval_ms_(interval_ms), stop_(false) {
+}
+
+Watcher::~Watcher() {
+  {
+    unique_lock<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  if (thread_.joinable())
+    thread_.join();
+  for (auto &w : waiting_)
+    fuse_pollhandle_destroy(w.second);
+}
+
+int Watcher::poll(Handle *h, struct fuse_pollhandle *ph, unsigned *reventsp) {
+  const WatchTarget *target = h->target();
+  // reads only hash the target once the handle polls, the first poll takes
+  // the target as the handle last saw it
+  uint64_t hash = target ? target->hash() : 0;
+  if (target && !h->polled()) {
+    h->set_seen(hash);
+    h->set_polled();
+  }
+  if (!target || hash != h->seen()) {
+    *reventsp = readable | writable;
+    if (ph)
+      fuse_pollhandle_destroy(ph);
+    return 0;
+  }
+  *reventsp = writable;
+  if (!ph)
+    return 0;
+  unique_lock<std::mutex> lock(mutex_);
+  auto it = waiting_.find(h);
+  if (it != waiting_.end()) {
+    fuse_pollhandle_destroy(it->second);
+    it->second = ph;
+  } else {
+    waiting_[h] = ph;
+  }
+  if (!thread_.joinable())
+    thread_ = std::thread(&Watcher::run, this);
+  return 0;
+}
+
+void Watcher::forget(Handle *h) {
+  unique_lock<std::mutex> lock(mutex_);
+  auto it = waiting_.find(h);
+  if (it == waiting_.end())
+    return;
+  fuse_pollhandle_destroy(it->second);
+  waiting_.erase(it);
+}
+
+size_t Watcher::waiting() const {
+  unique_lock<std::mutex> lock(mutex_);
+  return waiting_.size();
+}
+
+size_t Watcher::scan() {
+  // copy the targets out, hashing them can take a while on big maps
+  vector<pair<Handle *, WatchTarget>> targets;
+  {
+    unique_lock<std::mutex> lock(mutex_);
+    targets.reserve(waiting_.size());
+    for (auto &w : waiting_)
+      targets.push_back(std::make_pair(w.first, *w.first->target()));
+  }
+  std::map<string, uint64_t> hashes;
+  vector<uint64_t> current;
+  current.reserve(targets.size());
+  string id;
+  for (auto &t : targets) {
+    const WatchTarget &w = t.second;
+    id.assign(1, (char)w.kind);
+    id.append((const char *)&w.fd, sizeof(w.fd));
+    id.append(w.key);
+    auto it = hashes.find(id);
+    if (it == hashes.end())
+      it = hashes.insert(std::make_pair(id, w.hash())).first;
+    current.push_back(it->second);
+  }
+  size_t woken = 0;
+  unique_lock<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < targets.size(); ++i) {
+    Handle *h = targets[i].first;
+    auto it = waiting_.find(h);
+    // released meanwhile, or unchanged since the handle last read it
+    if (it == waiting_.end() || current[i] == h->seen())
+      continue;
+    fuse_notify_poll(it->second);
+    fuse_pollhandle_destroy(it->second);
+    waiting_.erase(it);
+    ++woken;
+  }
+  return woken;
+}
+
+void Watcher::run() {
+  unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    cond_.wait_for(lock, std::chrono::milliseconds(interval_ms_));
+    if (stop_ || waiting_.empty())
+      continue;
+    lock.unlock();
+    scan();
+    lock.lock();
+  }
+}
+
+}  // namespace bcc
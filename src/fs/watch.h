@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// forward declarations from fuse.h
+extern "C" {
+struct fuse_pollhandle;
+}
+
+namespace bcc {
+
+class Handle;
+
+// What a pollable file shows, named by map fd and key bytes instead of by
+// inode so that the watcher never walks the inode tree.
+struct WatchTarget {
+  enum Kind {
+    leaf_e,   // the value stored under key
+    map_e,    // all keys and values
+    keys_e,   // the set of keys
+  };
+  WatchTarget(Kind kind, int fd, size_t key_size, size_t leaf_size, const void *key = nullptr);
+  // fingerprint of the current data, independent of the order the map lists
+  // its keys in and never 0
+  uint64_t hash() const;
+
+  Kind kind;
+  int fd;
+  size_t key_size;
+  size_t leaf_size;
+  std::string key;
+};
+
+// Completes fuse poll requests. A handle that has not read the current data
+// is ready at once; the others wait until a thread, looking at each watched
+// target once per interval however many handles wait on it, sees it change.
+class Watcher {
+ public:
+  explicit Watcher(unsigned interval_ms);
+  ~Watcher();
+  int poll(Handle *h, struct fuse_pollhandle *ph, unsigned *reventsp);
+  // drop the pending poll of a handle that is being released
+  void forget(Handle *h);
+  // look at every waited on target once, return the number of handles woken
+  size_t scan();
+  size_t waiting() const;
+  unsigned interval_ms() const { return interval_ms_; }
+ private:
+  void run();
+  unsigned interval_ms_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  std::map<Handle *, struct fuse_pollhandle *> waiting_;
+  std::thread thread_;
+  bool stop_;
+};
+
+}  // namespace bcc
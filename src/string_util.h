@@ -19,8 +19,8 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <memory>
 #include <string>
-#include <sstream>
 #include <vector>
 
 namespace bcc {
@@ -28,14 +28,40 @@ namespace bcc {
 static inline
 std::string operator"" _s(const char *s, size_t n) { return std::string(s, n); }
 
+// Non-owning view of a string, for lookups that should not copy the key
+class StringRef {
+ public:
+  StringRef() : data_(nullptr), size_(0) {}
+  StringRef(const char *s) : data_(s), size_(strlen(s)) {}
+  StringRef(const char *s, size_t n) : data_(s), size_(n) {}
+  StringRef(const std::string &s) : data_(s.data()), size_(s.size()) {}
+  const char * data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return !size_; }
+  // false for the null view only, an empty string is still a string
+  explicit operator bool() const { return data_ != nullptr; }
+  std::string str() const { return data_ ? std::string(data_, size_) : std::string(); }
+  bool operator==(StringRef o) const {
+    return size_ == o.size_ && (!size_ || !memcmp(data_, o.data_, size_));
+  }
+  bool operator!=(StringRef o) const { return !(*this == o); }
+ private:
+  const char *data_;
+  size_t size_;
+};
+
 static inline
 std::vector<std::string> split(const std::string &s, char delim) {
-  std::stringstream ss(s);
-  std::string item;
   std::vector<std::string> tokens;
-  while (std::getline(ss, item, delim))
-    if (!item.empty())
-      tokens.push_back(item);
+  size_t start = 0;
+  while (start <= s.size()) {
+    size_t end = s.find(delim, start);
+    if (end == std::string::npos)
+      end = s.size();
+    if (end > start)
+      tokens.push_back(s.substr(start, end - start));
+    start = end + 1;
+  }
   return tokens;
 }
 
@@ -45,27 +71,40 @@ make_unique(Args &&... args) {
   return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
 }
 
+// Walks the components of a path in place, without copying it
 class Path {
  public:
   explicit Path(const char *path)
-      : p_(path), orig_(path), cur_("."), save_(nullptr) {
-    next_ = strtok_r((char *)p_.c_str(), "/", &save_);
+      : orig_(path), p_(path), cur_(".", 1) {
+    advance();
   }
   Path * consume() {
     cur_ = next_;
-    next_ = strtok_r(nullptr, "/", &save_);
+    advance();
     return this;
   }
   const char * full() const { return orig_; }
-  const char * next() const { return next_; }
-  const char * cur() const { return cur_; }
+  // null once there are no more components
+  StringRef next() const { return next_; }
+  StringRef cur() const { return cur_; }
  private:
   Path(const Path &) = delete;
-  std::string p_;
+  void advance() {
+    while (*p_ == '/')
+      ++p_;
+    if (!*p_) {
+      next_ = StringRef();
+      return;
+    }
+    const char *start = p_;
+    while (*p_ && *p_ != '/')
+      ++p_;
+    next_ = StringRef(start, p_ - start);
+  }
   const char *orig_;
-  const char *next_;
-  const char *cur_;
-  char *save_;
+  const char *p_;
+  StringRef next_;
+  StringRef cur_;
 };
 
 }  // namespace bcc
@@ -0,0 +1,1561 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Microbenchmarks of the fuse operations, run against the in-process fake
+// BPF backend so that no root privileges or BPF capable kernel are needed.
+//
+//   bench_fs [--quick] [--filter NAME] [--out FILE] [--baseline FILE]
+//            [--threshold PCT] [--memory]
+//
+// With --baseline, each result is compared against the matching line of a
+// previous --out file and the exit status is non-zero if any case got slower
+// by more than the threshold (default 25%). Both runs time a `reference`
+// case of fixed work first, and cases are compared in multiples of it, so
+// a baseline taken on another machine still applies. Each case reports the
+// best of several rounds.
+//
+// allocs/op counts every operator new made during a case, harness included;
+// the getattr cases build their paths without allocating.
+//
+// --memory instead reports the daemon heap that a map directory holds once
+// it has listed all keys of a map, for maps of 10k, 1M and 10M keys.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <fuse.h>
+#include <malloc.h>
+#include <map>
+#include <new>
+#include <poll.h>
+#include <stdarg.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <bcc/bpf_common.h>
+#include <bcc/libbpf.h>
+
+#include "client.h"
+#include "fake_bpf.h"
+#include "fs/hex.h"
+#include "fs/mount.h"
+
+using std::function;
+using std::map;
+using std::string;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+std::atomic<size_t> allocations(0);
+
+}  // namespace
+
+void * operator new(size_t n) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void * operator new[](size_t n) {
+  return operator new(n);
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p) noexcept {
+  free(p);
+}
+
+namespace {
+
+struct Options {
+  vector<size_t> sizes;
+  vector<int> threads;
+  double seconds;
+  string filter;
+  string out;
+  string baseline;
+  double threshold;
+  bool memory;
+};
+
+struct Result {
+  string name;
+  size_t entries;
+  int threads;
+  double ns_per_op;
+  double ops_per_sec;
+  double allocs_per_op;
+};
+
+const struct fuse_operations *ops;
+
+string prog_name(size_t entries, int t) {
+  return "s" + std::to_string(entries) + "_t" + std::to_string(t);
+}
+
+string map_name(size_t entries, int t) {
+  return "counts_" + prog_name(entries, t);
+}
+
+string map_path(size_t entries, int t) {
+  return "/" + prog_name(entries, t) + "/maps/" + map_name(entries, t);
+}
+
+// format a path into a per thread buffer, without allocating
+const char * pathf(const char *fmt, ...) {
+  static __thread char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  return buf;
+}
+
+string entry_name(size_t i) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "0x%zx", i + 1);
+  return buf;
+}
+
+// the same key as entry_name(i), as hex of its bytes
+string raw_entry_name(size_t i) {
+  uint32_t key = i + 1;
+  char buf[2 * sizeof(key) + 1];
+  bcc::hex_encode((const uint8_t *)&key, sizeof(key), buf);
+  buf[sizeof(buf) - 1] = '\0';
+  return buf;
+}
+
+int write_file(const string &path, const string &data) {
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  if (int rc = ops->truncate(path.c_str(), 0))
+    return rc;
+  if (int rc = ops->open(path.c_str(), &fi))
+    return rc;
+  int rc = ops->write(path.c_str(), data.data(), data.size(), 0, &fi);
+  if (rc >= 0)
+    rc = ops->flush(path.c_str(), &fi);
+  ops->release(path.c_str(), &fi);
+  return rc < 0 ? rc : 0;
+}
+
+size_t read_file(const string &path) {
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  if (ops->open(path.c_str(), &fi))
+    return 0;
+  static __thread char buf[128 * 1024];
+  size_t total = 0;
+  for (;;) {
+    int n = ops->read(path.c_str(), buf, sizeof(buf), total, &fi);
+    if (n <= 0)
+      break;
+    total += n;
+    if ((size_t)n < sizeof(buf))
+      break;
+  }
+  ops->release(path.c_str(), &fi);
+  return total;
+}
+
+int count_filler(void *buf, const char *name, const struct stat *st, off_t off) {
+  ++*static_cast<size_t *>(buf);
+  return 0;
+}
+
+bcc::MapDir * map_dir(const string &path) {
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  if (ops->open((path + "/dump").c_str(), &fi))
+    return nullptr;
+  bcc::Inode *dump = reinterpret_cast<bcc::Handle *>(fi.fh)->file();
+  ops->release((path + "/dump").c_str(), &fi);
+  return dynamic_cast<bcc::MapDir *>(dump->parent());
+}
+
+bool load_program(const string &prog, const string &text) {
+  struct stat st;
+  if (ops->getattr(("/" + prog).c_str(), &st) && ops->mkdir(("/" + prog).c_str(), 0755))
+    return false;
+  return write_file("/" + prog + "/source", text) == 0;
+}
+
+// one program with one map per (entries, thread) so that threads never share
+// a directory, the filesystem does no locking of its own
+bool setup(size_t entries, int nthreads) {
+  for (int t = 0; t < nthreads; ++t) {
+    string prog = prog_name(entries, t);
+    struct stat st;
+    if (ops->getattr(("/" + prog).c_str(), &st) == 0)
+      continue;
+    string text =
+        "BPF_TABLE(\"hash\", u32, u64, " + map_name(entries, t) + ", " +
+        std::to_string(entries) + ");\n"
+        "int on_packet(void *ctx) { return 0; }\n";
+    if (!load_program(prog, text))
+      return false;
+    bcc::fake::fill(bcc::fake::map_fd(map_name(entries, t)), entries);
+    bcc::MapDir *md = map_dir(map_path(entries, t));
+    if (!md || md->refresh(true))
+      return false;
+  }
+  return true;
+}
+
+// a handle that has read a value waits for it to change, and is woken once
+bool check_poll(bcc::Watcher *watcher) {
+  if (!load_program("poll", "BPF_TABLE(\"hash\", u32, u64, poll_check, 16);\n"))
+    return false;
+  int fd = bcc::fake::map_fd("poll_check");
+  bcc::fake::fill(fd, 16);
+  const char *path = "/poll/maps/poll_check/0x1";
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  char buf[64];
+  unsigned revents = 0;
+  if (ops->open(path, &fi) || ops->read(path, buf, sizeof(buf), 0, &fi) <= 0)
+    return false;
+  size_t notified = bcc::fake::poll_notifications();
+  bool ok = ops->poll(path, &fi, bcc::fake::poll_handle(), &revents) == 0 &&
+            !(revents & POLLIN) && watcher->scan() == 0;
+  bcc::fake::touch(fd, 0);
+  // the watcher's own thread may get there first
+  watcher->scan();
+  ok = ok && bcc::fake::poll_notifications() == notified + 1 && watcher->waiting() == 0;
+  ok = ok && ops->poll(path, &fi, bcc::fake::poll_handle(), &revents) == 0 &&
+       (revents & POLLIN);
+  ops->release(path, &fi);
+  return ok && bcc::fake::poll_handles() == 0;
+}
+
+// a changes handle lists the whole map once, then only what changed
+bool check_changes() {
+  int fd = bcc::fake::map_fd("poll_check");
+  const char *path = "/poll/maps/poll_check/changes";
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  char buf[4096];
+  if (ops->open(path, &fi))
+    return false;
+  int n = ops->read(path, buf, sizeof(buf), 0, &fi);
+  bool ok = n > 0 && string(buf, n).compare(0, 7, "RESYNC\n") == 0 &&
+            std::count(buf, buf + n, '\n') == 17;
+  bcc::fake::touch(fd, 1);
+  uint32_t key = 3;
+  bpf_delete_elem(fd, &key);
+  n = ops->read(path, buf, sizeof(buf), 0, &fi);
+  string changes(buf, n > 0 ? n : 0);
+  ok = ok && changes.find("~ 0x2 ") == 0 && changes.find("\n- 0x3\n") != string::npos &&
+       std::count(changes.begin(), changes.end(), '\n') == 2;
+  ok = ok && ops->read(path, buf, sizeof(buf), 0, &fi) == 0;
+  ops->release(path, &fi);
+  return ok;
+}
+
+// fill() stores (i + 1) * 7 under key i + 1, so the largest values are the
+// last keys, whatever check_changes() nudged on the way
+bool check_top() {
+  const char *path = "/poll/maps/poll_check/top";
+  if (write_file(path, "3\n") || write_file(path, "3 nosuchfield\n") != -EINVAL)
+    return false;
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  char buf[4096];
+  if (ops->open(path, &fi))
+    return false;
+  int n = ops->read(path, buf, sizeof(buf), 0, &fi);
+  ops->release(path, &fi);
+  return n > 0 && string(buf, n) == "0x10 0x70\n0xf 0x69\n0xe 0x62\n";
+}
+
+string read_all(const char *path) {
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  char buf[4096];
+  if (ops->open(path, &fi))
+    return "";
+  int n = ops->read(path, buf, sizeof(buf), 0, &fi);
+  ops->release(path, &fi);
+  return n > 0 ? string(buf, n) : "";
+}
+
+bool check_query() {
+  const char *path = "/poll/maps/poll_check/query";
+  if (write_file(path, "leaf >= 0x62 and key < 0x10\n"))
+    return false;
+  string text = read_all(path);
+  if (std::count(text.begin(), text.end(), '\n') != 2 ||
+      text.find("0xe 0x62\n") == string::npos || text.find("0xf 0x69\n") == string::npos)
+    return false;
+  // keys are stored little endian, 5 reads as 5.0.0.0
+  if (write_file(path, "binary key in 5.0.0.0/8") || read_all(path).size() != 12)
+    return false;
+  return write_file(path, "leaf.nosuchfield == 1") == -EINVAL &&
+         write_file(path, "key < 1 or leaf > 2") == -EINVAL;
+}
+
+// a counter map kept in two copies is read and reset through swap, and
+// clear empties a map
+bool check_swap() {
+  if (!load_program("swap", "BPF_TABLE(\"hash\", u32, u64, pkts, 1024);\n"
+                            "BPF_TABLE(\"hash\", u32, u64, pkts_alt, 1024);\n"
+                            "BPF_TABLE(\"array\", u32, u32, pkts_sel, 1);\n"
+                            "BPF_TABLE(\"array\", u32, u64, pkts_arr, 8);\n"))
+    return false;
+  int fd = bcc::fake::map_fd("pkts"), alt = bcc::fake::map_fd("pkts_alt");
+  int sel = bcc::fake::map_fd("pkts_sel");
+  const char *path = "/swap/maps/pkts/swap";
+  uint32_t zero = 0, cur = 0;
+  bcc::fake::fill(fd, 100);
+  string text = read_all(path);
+  bool ok = std::count(text.begin(), text.end(), '\n') == 100 &&
+            bcc::fake::map_size(fd) == 100 && bpf_lookup_elem(sel, &zero, &cur) == 0 && cur == 1;
+  // runs still on the retired copy after it was listed count in the next read
+  uint32_t late = 200;
+  uint64_t one = 1;
+  bcc::fake::touch(fd, 2);
+  bpf_update_elem(fd, &late, &one, BPF_ANY);
+  bcc::fake::fill(alt, 5);
+  text = read_all(path);
+  ok = ok && std::count(text.begin(), text.end(), '\n') == 6 &&
+       text.find("0x3 0x16\n") != string::npos && text.find("0xc8 0x1\n") != string::npos &&
+       bcc::fake::map_size(fd) == 0 && bcc::fake::map_size(alt) == 5 &&
+       bpf_lookup_elem(sel, &zero, &cur) == 0 && cur == 0;
+  // a zero key puts the walk from it past the keys in earlier buckets
+  uint64_t seven = 7, got = 0;
+  bcc::fake::fill(fd, 1000);
+  bpf_update_elem(fd, &zero, &seven, BPF_ANY);
+  ok = ok && write_file("/swap/maps/pkts/clear", "1\n") == 0 && bcc::fake::map_size(fd) == 0 &&
+       read_all("/swap/maps/pkts/clear") == "1001\n";
+  // and element 0 of an array is no key's successor
+  int arr = bcc::fake::map_fd("pkts_arr");
+  bcc::fake::fill(arr, 8);
+  bpf_update_elem(arr, &zero, &seven, BPF_ANY);
+  return ok && write_file("/swap/maps/pkts_arr/clear", "1\n") == 0 &&
+         read_all("/swap/maps/pkts_arr/clear") == "8\n" &&
+         bpf_lookup_elem(arr, &zero, &got) == 0 && got == 0;
+}
+
+// static files keep their page cache until the daemon changes them, files
+// built on read bypass it
+bool check_cache() {
+  auto flags = [] (const char *path) {
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    if (ops->open(path, &fi))
+      return -1;
+    ops->release(path, &fi);
+    return (int)fi.keep_cache | (int)fi.direct_io << 1;
+  };
+  flags("/poll/valid");
+  bool ok = flags("/poll/valid") == 1 && flags("/poll/maps/poll_check/dump") == 2 &&
+            flags("/poll/maps/poll_check/clear") == 2;
+  flags("/swap/source");
+  return ok && load_program("swap", read_all("/swap/source")) && flags("/swap/source") == 0 &&
+         flags("/swap/source") == 1 && flags("/swap/memory") == 0;
+}
+
+// stats take the count of the last walk over the map, a dump counts too
+bool check_stats() {
+  if (!load_program("stats", "BPF_TABLE(\"hash\", u32, u64, stats_check, 8);\n"))
+    return false;
+  int fd = bcc::fake::map_fd("stats_check");
+  bcc::fake::fill(fd, 4);
+  const char *path = "/stats/maps/stats_check/stats";
+  // reading stats counts nothing itself
+  bool ok = read_all(path).find("\nentries 0\n") != string::npos;
+  read_all("/stats/maps/stats_check/keys");
+  string stats = read_all(path);
+  ok = ok && stats.find("type hash\nmax_entries 8\nentries 4\nfill 0.500\n") == 0 &&
+       stats.find("\nkey_size 4\nleaf_size 8\n") != string::npos;
+  uint32_t key = 100;
+  uint64_t leaf = 1;
+  bpf_update_elem(fd, &key, &leaf, BPF_ANY);
+  ok = ok && read_all(path).find("\nentries 4\n") != string::npos;
+  read_all("/stats/maps/stats_check/dump");
+  ok = ok && read_all(path).find("\nentries 5\nfill 0.625\n") != string::npos;
+  // nor does it need to while a sampler walks the map anyway
+  key = 101;
+  bpf_update_elem(fd, &key, &leaf, BPF_ANY);
+  if (!ok || write_file("/stats/maps/stats_check/sample", "3600000 2\n"))
+    return false;
+  ok = read_all(path).find("\nentries 6\n") != string::npos;
+  return write_file("/stats/maps/stats_check/sample", "0\n") == 0 && ok;
+}
+
+// one handle, a batch of keys in and their leaves out in the same order
+bool check_lookup() {
+  struct fuse_file_info fi;
+  char buf[256];
+  auto batch = [&] (const char *path, const string &keys) {
+    memset(&fi, 0, sizeof(fi));
+    if (ops->open(path, &fi))
+      return string();
+    int n = ops->write(path, keys.data(), keys.size(), 0, &fi);
+    if (n == (int)keys.size())
+      n = ops->read(path, buf, sizeof(buf), 0, &fi);
+    return n > 0 ? string(buf, n) : string();
+  };
+  const char *path = "/stats/maps/stats_check/lookup";
+  bool ok = batch(path, "0x1\n0x999\n0x1\n") == "0x1 0x123456789\n0x999 -\n0x1 0x123456789\n";
+  uint32_t key = 1;
+  uint64_t leaf = 2;
+  bpf_update_elem(bcc::fake::map_fd("stats_check"), &key, &leaf, BPF_ANY);
+  ok = ok && ops->read(path, buf, sizeof(buf), 0, &fi) > 0 && !strncmp(buf, "0x1 0x2\n", 8);
+  ops->release(path, &fi);
+  // a key past 64 bits is refused, not wrapped
+  const char *big = "0x10000000000000001\n";
+  ok = ok && ops->open(path, &fi) == 0 && ops->write(path, big, strlen(big), 0, &fi) > 0 &&
+       ops->read(path, buf, sizeof(buf), 0, &fi) == -EINVAL;
+  ops->release(path, &fi);
+  path = "/stats/maps/stats_check/raw/lookup";
+  uint32_t keys[2] = {0x999, 1};
+  string out = batch(path, string((const char *)keys, sizeof(keys)));
+  ops->release(path, &fi);
+  return ok && out.size() == 2 + 2 * sizeof(leaf) && out[0] == 0 && out[1] == 1 &&
+         !memcmp(&out[2 + sizeof(leaf)], &leaf, sizeof(leaf)) && batch(path, "abc").empty();
+}
+
+// arrays are mapped from their fd, at the stride layout describes; other
+// maps have no layout
+bool check_array() {
+  if (!load_program("array", "BPF_TABLE(\"array\", u32, u32, array_check, 16);\n"
+                             "BPF_TABLE(\"hash\", u32, u32, array_hash, 4);\n"))
+    return false;
+  struct stat st;
+  bcc_array array;
+  string layout = read_all("/array/maps/array_check/layout");
+  if (ops->getattr("/array/maps/array_hash/layout", &st) != -ENOENT ||
+      bcc_array_layout(layout.c_str(), &array) || array.stride != 8 || array.max_entries != 16 ||
+      bcc_array_map(bcc::fake::map_fd("array_check"), &array))
+    return false;
+  uint32_t key = 3, leaf = 42;
+  bpf_update_elem(bcc::fake::map_fd("array_check"), &key, &leaf, BPF_ANY);
+  uint32_t seen;
+  memcpy(&seen, BCC_ARRAY_VALUE(&array, key), sizeof(seen));
+  bcc_array_close(&array);
+  return seen == leaf;
+}
+
+// point operations on raw bytes, through a dump handle or the directory
+bool check_ioctl() {
+  const char *path = "/stats/maps/stats_check/dump";
+  alignas(8) uint8_t bytes[BCC_MAP_IO_MAX];
+  bcc_map_io *req = reinterpret_cast<bcc_map_io *>(bytes);
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  auto io = [&] (int op, uint32_t count, uint32_t flags, size_t len, unsigned dir) {
+    req->key_size = 4;
+    req->leaf_size = 8;
+    req->count = count;
+    req->flags = flags;
+    const char *p = dir ? "/stats/maps/stats_check" : path;
+    return ops->ioctl(p, BCC_MAP_IO(op, sizeof(*req) + len), nullptr, &fi, dir, req);
+  };
+  uint32_t key = 2;
+  uint64_t leaf = 0;
+  if (ops->open(path, &fi))
+    return false;
+  memcpy(req->data, &key, 4);
+  bool ok = io(BCC_MAP_LOOKUP, 1, 0, 8, 0) == 0;
+  memcpy(&leaf, req->data, 8);
+  ok = ok && leaf == 14;
+  key = 200;
+  leaf = 9;
+  memcpy(req->data, &key, 4);
+  memcpy(req->data + 4, &leaf, 8);
+  // reading the map does not let a handle or the directory change it
+  ok = ok && io(BCC_MAP_UPDATE, 1, BPF_NOEXIST, 12, 0) == -EBADF &&
+       io(BCC_MAP_UPDATE, 1, BPF_NOEXIST, 12, FUSE_IOCTL_DIR) == -EBADF;
+  ops->release(path, &fi);
+  fi.flags = O_RDWR;
+  if (ops->open(path, &fi))
+    return false;
+  // fuse hands ioctl a fuse_file_info with nothing but the handle in it
+  uint64_t fh = fi.fh;
+  memset(&fi, 0, sizeof(fi));
+  fi.fh = fh;
+  ok = ok && io(BCC_MAP_UPDATE, 1, BPF_NOEXIST, 12, 0) == 0 &&
+       io(BCC_MAP_UPDATE, 1, BPF_NOEXIST, 12, 0) == -EEXIST;
+  uint32_t keys[3] = {1, 300, 200};
+  memcpy(req->data, keys, sizeof(keys));
+  uint64_t leaves[3];
+  ok = ok && io(BCC_MAP_LOOKUP_BATCH, 3, 0, 3 * 13, 0) == 0 && req->count == 2 &&
+       !memcmp(req->data + 12, "\1\0\1", 3);
+  memcpy(leaves, req->data + 15, sizeof(leaves));
+  ok = ok && leaves[0] == 7 && leaves[1] == 0 && leaves[2] == 9;
+  memcpy(req->data, &key, 4);
+  ok = ok && io(BCC_MAP_DELETE, 1, 0, 4, FUSE_IOCTL_DIR) == -EBADF &&
+       io(BCC_MAP_DELETE, 1, 0, 4, 0) == 0 &&
+       io(BCC_MAP_LOOKUP, 1, 0, 8, FUSE_IOCTL_DIR) == -ENOENT;
+  req->key_size = 8;
+  ok = ok && ops->ioctl(path, BCC_MAP_IO(BCC_MAP_LOOKUP, sizeof(*req) + 8), nullptr, &fi, 0,
+                        req) == -EINVAL;
+  ops->release(path, &fi);
+  return ok;
+}
+
+// a listing leaves the entry sizes behind for the getattr calls after it
+bool check_listing() {
+  const char *dir = "/stats/maps/stats_check", *path = "/stats/maps/stats_check/0x1";
+  bcc::MapDir *md = map_dir(dir);
+  size_t n = 0;
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  if (!md || ops->readdir(dir, &n, count_filler, 0, &fi))
+    return false;
+  // the listing reads no leaves, the first getattr after it sizes them all
+  int fd = bcc::fake::map_fd("stats_check");
+  uint32_t key = 1;
+  uint64_t leaf = 1;
+  bpf_update_elem(fd, &key, &leaf, BPF_ANY);
+  struct stat first, cached, fresh;
+  if (ops->getattr(path, &first))
+    return false;
+  leaf = 0x123456789;
+  bpf_update_elem(fd, &key, &leaf, BPF_ANY);
+  if (ops->getattr(path, &cached))
+    return false;
+  md->forget_sizes();
+  return ops->getattr(path, &fresh) == 0 && first.st_size == 4 && cached.st_size == 4 &&
+         fresh.st_size == 12;
+}
+
+// labels from key fields, one family per metric, kept across a reload
+bool check_metrics() {
+  const char *text =
+      "struct mkey { u32 pid; char comm[4]; };\n"
+      "struct mleaf { u64 packets; s64 delta; };\n"
+      "BPF_TABLE(\"hash\", struct mkey, struct mleaf, metrics_check, 8);\n";
+  if (!load_program("export", text))
+    return false;
+  struct { uint32_t pid; char comm[4]; } key = {7, {'a', '"', 'b', 0}};
+  struct { uint64_t packets; int64_t delta; } leaf = {3, -2};
+  bpf_update_elem(bcc::fake::map_fd("metrics_check"), &key, &leaf, BPF_ANY);
+  const char *conf = "/export/maps/metrics_check/metrics.conf";
+  if (write_file(conf, "pkts counter leaf.nope\n") != -EINVAL ||
+      write_file(conf, "pkts counter leaf.packets\ndelta gauge leaf.delta by key.pid\n"))
+    return false;
+  const string expect =
+      "# TYPE pkts counter\n"
+      "pkts_total{pid=\"7\",comm=\"a\\\"b\"} 3\n"
+      "# TYPE delta gauge\n"
+      "delta{pid=\"7\"} -2\n"
+      "# EOF\n";
+  bool ok = read_all("/export/metrics") == expect && read_all("/metrics") == expect;
+  ok = ok && load_program("export", text) && read_all("/export/metrics") == expect;
+  // another program may not add a second pkts family to /metrics
+  if (!ok || !load_program("export2", "BPF_TABLE(\"hash\", u32, u64, metrics_other, 8);\n"))
+    return false;
+  const char *other = "/export2/maps/metrics_other/metrics.conf";
+  return write_file(other, "pkts counter leaf\n") == -EINVAL &&
+         write_file(other, "other gauge leaf\n") == 0 && write_file(other, "\n") == 0 &&
+         read_all("/metrics") == expect;
+}
+
+// entries looked up by name stay under the cap, the least recently used
+// idle ones go first and open ones not at all
+bool check_evict() {
+  if (!load_program("evict", "BPF_TABLE(\"hash\", u32, u64, evict_check, 4096);\n"))
+    return false;
+  bcc::fake::fill(bcc::fake::map_fd("evict_check"), 3000);
+  bcc::MapDir *md = map_dir("/evict/maps/evict_check");
+  const char *open_path = "/evict/maps/evict_check/0x1";
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  if (!md || ops->open(open_path, &fi))
+    return false;
+  struct stat st;
+  for (size_t i = 2; i <= 3000; ++i) {
+    ops->getattr(("/evict/maps/evict_check/" + entry_name(i - 1)).c_str(), &st);
+    ops->getattr("/evict/maps/evict_check/0x2", &st);
+  }
+  char buf[64];
+  bool ok = md->cached() <= 1024 && md->evictions() >= 3000 - 1024 &&
+            md->child("0x1") && md->child("0x2") && !md->child("0x3") &&
+            md->child(entry_name(2999)) && ops->read(open_path, buf, sizeof(buf), 0, &fi) > 0;
+  ops->release(open_path, &fi);
+  return ok && read_all("/evict/maps/evict_check/stats").find("\ncache_max 1024\n") !=
+               string::npos;
+}
+
+// compiles done for the calling user so far, from the root `sched` file
+size_t compiles() {
+  string stats = read_all("/sched");
+  size_t pos = stats.find("uid " + std::to_string(getuid()) + " ");
+  pos = stats.find(" compiles ", pos == string::npos ? 0 : pos);
+  return pos == string::npos ? 0 : strtoul(stats.c_str() + pos + 10, nullptr, 10);
+}
+
+// a burst of flushes costs one compile of the last text, and a job that a
+// newer one overtook while it ran finds out
+bool check_debounce(bcc::Mount *mount) {
+  std::atomic<int> stage(0);
+  bool overtaken = false, latest = false;
+  {
+    bcc::Debouncer debouncer(1);
+    debouncer.submit(&stage, [&] (const bcc::Debouncer::Obsolete &obsolete) {
+      stage = 1;
+      while (stage != 2)
+        usleep(100);
+      overtaken = obsolete();
+    });
+    while (stage != 1)
+      usleep(100);
+    debouncer.submit(&stage, [&] (const bcc::Debouncer::Obsolete &obsolete) {
+      latest = !obsolete();
+    });
+    stage = 2;
+    debouncer.drain();
+  }
+  if (!overtaken || !latest || ops->mkdir("/debounce", 0755))
+    return false;
+  mount->set_debounce(50);
+  size_t before = compiles();
+  bool ok = true;
+  for (int i = 1; i <= 3; ++i)
+    ok = ok && write_file("/debounce/source", "BPF_TABLE(\"hash\", u32, u64, burst" +
+                          std::to_string(i) + ", 4);\n") == 0;
+  ok = ok && read_all("/debounce/valid") == "0\n";
+  mount->debouncer()->drain();
+  struct stat st;
+  ok = ok && read_all("/debounce/valid") == "1\n" && compiles() == before + 1 &&
+       ops->getattr("/debounce/maps/burst3", &st) == 0 &&
+       ops->getattr("/debounce/maps/burst1", &st) == -ENOENT;
+  mount->set_debounce(0);
+  return ok;
+}
+
+// a user that already ran goes after one that has not, whoever asked first;
+// limits and stats are per uid
+bool check_sched() {
+  bcc::Scheduler sched(1);
+  bcc::Scheduler::Slot busy;
+  if (sched.admit(1, bcc::Scheduler::scan_e, 0, &busy))
+    return false;
+  usleep(2000);
+  std::atomic<int> first(0);
+  auto job = [&] (uid_t uid) {
+    bcc::Scheduler::Slot slot;
+    sched.admit(uid, bcc::Scheduler::scan_e, 0, &slot);
+    int none = 0;
+    first.compare_exchange_strong(none, uid);
+  };
+  thread again(job, 1);
+  while (sched.waiting() < 1)
+    usleep(100);
+  thread other(job, 2);
+  while (sched.waiting() < 2)
+    usleep(100);
+  busy.release();
+  again.join();
+  other.join();
+  bcc::Scheduler::Slot slot;
+  bool ok = first == 2 && sched.configure("3 2 1 100\n") == 0 &&
+            sched.admit(3, bcc::Scheduler::compile_e, 200, &slot) == -ENOMEM &&
+            sched.admit(3, bcc::Scheduler::compile_e, 50, &slot) == 0 &&
+            sched.stats().find("uid 3 weight 2 max_jobs 1 max_bytes 100 running 1 queued 0 "
+                               "bytes 50 compiles 1 scans 0 ") != string::npos;
+  // a queued job that a lower limit leaves no room for is turned away
+  std::atomic<int> rc(1);
+  thread big([&] {
+    bcc::Scheduler::Slot s;
+    rc = sched.admit(3, bcc::Scheduler::scan_e, 80, &s);
+  });
+  while (sched.waiting() < 1)
+    usleep(100);
+  ok = sched.configure("3 2 1 60\n") == 0 && ok;
+  big.join();
+  ok = ok && rc == -ENOMEM && sched.waiting() == 0;
+  slot.release();
+  string line = "uid " + std::to_string(getuid()) + " weight 1 ";
+  read_all("/poll/maps/poll_check/dump");
+  string stats = read_all("/sched");
+  size_t at = stats.find(line);
+  return ok && at != string::npos && stats.find(" scans 0 ", at) > stats.find('\n', at) &&
+         write_file("/sched", "1 0\n") == -EINVAL;
+}
+
+// a published snapshot holds every entry, and readers wait on the next one
+bool check_publish() {
+  string dir = "/poll/maps/poll_check";
+  if (write_file(dir + "/publish", "3600000\n"))
+    return false;
+  bcc::MapDir *md = map_dir(dir);
+  if (!md || !md->publisher())
+    return false;
+  const bcc_snapshot *snap = bcc_snapshot_map(md->publisher()->fd());
+  if (!snap)
+    return false;
+  int fd = bcc::fake::map_fd("poll_check");
+  const size_t rsize = sizeof(uint32_t) + sizeof(uint64_t);
+  vector<uint8_t> buf(16 * rsize);
+  uint64_t gen = 0;
+  long n = bcc_snapshot_read(snap, buf.data(), buf.size(), &gen);
+  bool ok = n == (long)bcc::fake::map_size(fd) && gen == 1 &&
+            bcc_snapshot_wait(snap, gen, 0) == -1 && errno == ETIMEDOUT;
+  bcc::fake::touch(fd, 4);
+  md->publisher()->publish();
+  n = bcc_snapshot_read(snap, buf.data(), buf.size(), &gen);
+  ok = ok && bcc_snapshot_wait(snap, 1, 0) == 0 && gen == 2 && n > 0;
+  for (long i = 0; ok && i < n; ++i) {
+    uint32_t key;
+    uint64_t leaf, cur = 0;
+    memcpy(&key, &buf[i * rsize], sizeof(key));
+    memcpy(&leaf, &buf[i * rsize + sizeof(key)], sizeof(leaf));
+    ok = bpf_lookup_elem(fd, &key, &cur) == 0 && cur == leaf;
+  }
+  ok = ok && read_all((dir + "/publish").c_str()) == "3600000 2\n" &&
+       write_file(dir + "/publish", "0\n") == 0 && !md->publisher();
+  // the last snapshot stays readable, waiting for another one fails
+  ok = ok && bcc_snapshot_read(snap, buf.data(), buf.size(), &gen) == n && gen == 2 &&
+       bcc_snapshot_wait(snap, gen, 0) == -1 && errno == EPIPE;
+  bcc_snapshot_close(snap);
+  return ok;
+}
+
+// rewriting the source keeps the maps whose table did not change; the fake
+// verifier rejects map references the reload did not patch up
+bool check_reload() {
+  string counts = "BPF_TABLE(\"hash\", u32, u64, counts, 16);\n";
+  if (!load_program("reload", counts + "BPF_TABLE(\"array\", u32, u32, other, 4);\n"
+                                       "int on_pkt(void *ctx) { return 0; }\n"))
+    return false;
+  bcc::fake::fill(bcc::fake::map_fd("counts"), 10);
+  if (!load_program("reload", counts + "BPF_TABLE(\"array\", u32, u64, other, 4);\n"
+                                       "BPF_TABLE(\"hash\", u32, u32, extra, 4);\n"
+                                       "int on_pkt(void *ctx) { return 1; }\n"))
+    return false;
+  string dump = read_all("/reload/maps/counts/dump");
+  bool ok = std::count(dump.begin(), dump.end(), '\n') == 10 &&
+            read_all("/reload/reload") ==
+                "counts kept\nother reset: leaf type changed\nextra new\n" &&
+            write_file("/reload/functions/on_pkt/type", "kprobe") == 0 &&
+            read_all("/reload/functions/on_pkt/generation") == "1\n";
+  // the function is reloaded behind the same fd socket, unless the new
+  // version does not verify
+  ok = ok && load_program("reload", counts + "int on_pkt(void *ctx) { return 2; }\n") &&
+       read_all("/reload/functions/on_pkt/generation") == "2\n" &&
+       read_all("/reload/functions/on_pkt/type") == "kprobe";
+  ok = ok && load_program("reload", counts + "int on_pkt(void *ctx) { for (;;) ; }\n") &&
+       read_all("/reload/functions/on_pkt/generation") == "2\n" &&
+       !read_all("/reload/functions/on_pkt/error").empty();
+  // a kept map goes on publishing into the same memfd
+  if (!ok || write_file("/reload/maps/counts/publish", "3600000\n"))
+    return false;
+  std::shared_ptr<bcc::Publisher> publisher = map_dir("/reload/maps/counts")->publisher();
+  return load_program("reload", counts) && read_all("/reload/reload") == "counts kept\n" &&
+         read_all("/reload/maps/counts/dump") == dump &&
+         map_dir("/reload/maps/counts")->publisher() == publisher &&
+         read_all("/reload/maps/counts/publish") == "3600000 1\n";
+}
+
+// deltas between frames the sampler took, without its thread getting a turn
+bool check_sampler() {
+  const char *dir = "/poll/maps/poll_check";
+  if (write_file(string(dir) + "/sample", "3600000 4\n"))
+    return false;
+  bcc::MapDir *md = map_dir(dir);
+  int fd = bcc::fake::map_fd("poll_check");
+  if (!md || !md->sampler())
+    return false;
+  bcc::fake::touch(fd, 4);
+  bcc::fake::touch(fd, 4);
+  md->sampler()->sample();
+  bcc::fake::touch(fd, 4);
+  md->sampler()->sample();
+  string series = read_all((string(dir) + "/series").c_str());
+  string rate = read_all((string(dir) + "/rate").c_str());
+  bool ok = series.find("0x5 2 1\n") != string::npos && series.find("0x6 0 0\n") != string::npos &&
+            rate.find("0x6 0.000\n") != string::npos && rate.find("0x5 0.000\n") == string::npos;
+  ok = ok && write_file(string(dir) + "/sample", "0\n") == 0 && !md->sampler() &&
+       read_all((string(dir) + "/series").c_str()).empty();
+  // a u32 counter that wraps moves on by what it counted past the wrap, and
+  // the all-zero key is sampled like any other
+  if (!ok || !load_program("wrap", "BPF_TABLE(\"hash\", u32, u32, wrap_check, 4);\n"))
+    return false;
+  int wfd = bcc::fake::map_fd("wrap_check");
+  uint32_t key = 0, leaf = 5;
+  bpf_update_elem(wfd, &key, &leaf, BPF_ANY);
+  key = 1, leaf = 0xfffffff0;
+  bpf_update_elem(wfd, &key, &leaf, BPF_ANY);
+  if (write_file("/wrap/maps/wrap_check/sample", "3600000 2\n"))
+    return false;
+  leaf = 0x10;
+  bpf_update_elem(wfd, &key, &leaf, BPF_ANY);
+  map_dir("/wrap/maps/wrap_check")->sampler()->sample();
+  string wrapped = read_all("/wrap/maps/wrap_check/series");
+  return wrapped.find("0x1 32\n") != string::npos && wrapped.find("0x0 0\n") != string::npos;
+}
+
+// the specialized codecs print and parse exactly like libbcc's generic
+// printf/scanf, on random bytes and on text written the ways scanf takes
+bool check_codecs() {
+  const char *text =
+      "struct flat { u8 a; u16 b[3]; int c; u64 d; u8 e[5]; };\n"
+      "BPF_TABLE(\"hash\", u8, char, codec_8, 4);\n"
+      "BPF_TABLE(\"hash\", u16, short, codec_16, 4);\n"
+      "BPF_TABLE(\"hash\", u32, int, codec_32, 4);\n"
+      "BPF_TABLE(\"hash\", u64, s64, codec_64, 4);\n"
+      "BPF_TABLE(\"hash\", struct flat, u32, codec_flat, 4);\n";
+  void *mod = bpf_module_create_c_from_string(text, 0);
+  if (!mod)
+    return false;
+  const char *ints[] = {
+    "0", "1", "-1", "+5", "  42  ", "0x7f", "0XFF", "0xAbC", "010", "08", "0x", "x1", "", "256",
+    "1 2", "4294967296", "18446744073709551615", "18446744073709551616", "0xffffffffffffffff",
+    "0x10000000000000000", "0x00000000000000000001", "01777777777777777777777",
+    "02000000000000000000000", "-9223372036854775808", "-9223372036854775809",
+  };
+  vector<string> flat;
+  for (const char *i : ints)
+    flat.push_back(string("{ 1 [ 2 ") + i + " 4 ] 5 6 [ 7 8 9 10 " + i + " ] }");
+  flat.push_back("{1[2 3 4]5 6[7 8 9 10 11]}");
+  flat.push_back("{ 1 [ 2 3 ] 5 6 [ 7 8 9 10 11 ] }");
+  flat.push_back("{ 1 [ 2 3 4 ] 5 6 [ 7 8 9 10 11 ] } x");
+  flat.push_back("{ 1 [ 2 3 4 ] 5 6 [ 7 8 9 10 11 ]");
+  uint64_t seed = 0x2545f4914f6cdd1dull;
+  bool ok = bpf_num_tables(mod) == 5;
+  for (size_t id = 0; ok && id < bpf_num_tables(mod); ++id) {
+    bcc::TableCodec codec(mod, id);
+    ok = !codec.key().generic() && !codec.leaf().generic();
+    for (int is_key = 0; ok && is_key < 2; ++is_key) {
+      size_t size = is_key ? bpf_table_key_size_id(mod, id) : bpf_table_leaf_size_id(mod, id);
+      const bcc::TypeCodec &type = is_key ? codec.key() : codec.leaf();
+      auto snprintf_ = is_key ? bpf_table_key_snprintf : bpf_table_leaf_snprintf;
+      auto sscanf_ = is_key ? bpf_table_key_sscanf : bpf_table_leaf_sscanf;
+      vector<uint8_t> data(size), ours(size), theirs(size);
+      char buf[512];
+      for (int k = 0; ok && k < 256; ++k) {
+        for (auto &c : data) {
+          seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+          c = k < 2 ? -k : seed >> 56;
+        }
+        string out;
+        ok = type.format(&data[0], &out) == 0 && snprintf_(mod, id, buf, sizeof(buf), &data[0]) == 0 &&
+             out == buf;
+      }
+      vector<string> texts(ints, ints + sizeof(ints) / sizeof(ints[0]));
+      if (id == 4 && is_key)
+        texts = flat;
+      for (size_t t = 0; ok && t < texts.size(); ++t) {
+        bool parsed = type.parse(texts[t].c_str(), &ours[0]) == 0;
+        ok = parsed == (sscanf_(mod, id, texts[t].c_str(), &theirs[0]) == 0) &&
+             (!parsed || ours == theirs);
+        if (!ok)
+          fprintf(stderr, "%s %s \"%s\" parsed differently\n", bpf_table_name(mod, id),
+                  is_key ? "key" : "leaf", texts[t].c_str());
+      }
+    }
+  }
+  bpf_module_destroy(mod);
+  return ok;
+}
+
+// the SSE2 and scalar paths of hex_encode and hex_decode agree with
+// snprintf at every length around the vector width, odd ones included
+bool check_hex() {
+  uint8_t src[80], back[80];
+  char text[161], ref[161];
+  for (size_t i = 0; i < sizeof(src); ++i)
+    src[i] = i * 37 + 11;
+  src[0] = 0x00, src[1] = 0xff, src[2] = 0x9a, src[3] = 0xa9;
+  for (size_t n = 0; n <= sizeof(src); ++n) {
+    for (size_t j = 0; j < n; ++j)
+      snprintf(ref + 2 * j, 3, "%02x", src[j]);
+    if (bcc::hex_encode(src, n, text) != text + 2 * n || memcmp(text, ref, 2 * n))
+      return false;
+    memset(back, 0, sizeof(back));
+    if (!bcc::hex_decode(text, n, back) || memcmp(back, src, n))
+      return false;
+    for (size_t j = 0; j < 2 * n; ++j)
+      ref[j] = toupper(text[j]);
+    memset(back, 0, sizeof(back));
+    if (!bcc::hex_decode(ref, n, back) || memcmp(back, src, n))
+      return false;
+    // a character just outside each digit range, anywhere, is refused
+    for (size_t j = 0; j < 2 * n; ++j) {
+      char c = text[j];
+      for (char bad : {'/', ':', '@', 'G', '`', 'g', ' ', '\xb0'}) {
+        text[j] = bad;
+        if (bcc::hex_decode(text, n, back))
+          return false;
+      }
+      text[j] = c;
+    }
+  }
+  return true;
+}
+
+typedef function<void (size_t entries, int t, size_t iter)> Op;
+
+Result run_round(double seconds, const string &name, size_t entries, int nthreads,
+                 const Op &op) {
+  std::atomic<bool> go(false);
+  vector<size_t> counts(nthreads, 0);
+  vector<double> elapsed(nthreads, 0);
+  vector<thread> threads;
+  for (int t = 0; t < nthreads; ++t) {
+    threads.push_back(thread([&, t] () {
+      while (!go.load())
+        ;
+      auto start = std::chrono::steady_clock::now();
+      auto deadline = start + std::chrono::duration<double>(seconds);
+      size_t n = 0;
+      for (;;) {
+        op(entries, t, n++);
+        if ((n & 7) == 0 || n < 8) {
+          if (std::chrono::steady_clock::now() >= deadline)
+            break;
+        }
+      }
+      counts[t] = n;
+      elapsed[t] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }));
+  }
+  size_t allocs = allocations.load();
+  go = true;
+  for (auto &th : threads)
+    th.join();
+  allocs = allocations.load() - allocs;
+  Result r;
+  r.name = name;
+  r.entries = entries;
+  r.threads = nthreads;
+  r.ns_per_op = 0;
+  r.ops_per_sec = 0;
+  size_t total = 0;
+  for (int t = 0; t < nthreads; ++t) {
+    r.ns_per_op += elapsed[t] * 1e9 / counts[t] / nthreads;
+    r.ops_per_sec += counts[t] / elapsed[t];
+    total += counts[t];
+  }
+  r.allocs_per_op = (double)allocs / total;
+  return r;
+}
+
+// the best of a few short rounds, which a busy host disturbs less than one
+// long one
+#define BENCH_ROUNDS 5
+Result run(const Options &opts, const string &name, size_t entries, int nthreads, const Op &op,
+           int rounds = BENCH_ROUNDS) {
+  Result best;
+  for (int i = 0; i < rounds; ++i) {
+    Result r = run_round(opts.seconds / rounds, name, entries, nthreads, op);
+    if (!i || r.ns_per_op < best.ns_per_op)
+      best = r;
+  }
+  return best;
+}
+
+string format(const Result &r) {
+  char buf[160];
+  snprintf(buf, sizeof(buf), "%-26s %7zu %7d %14.1f %14.1f %9.2f",
+           r.name.c_str(), r.entries, r.threads, r.ns_per_op, r.ops_per_sec, r.allocs_per_op);
+  return buf;
+}
+
+map<string, double> load_baseline(const string &path) {
+  map<string, double> base;
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f)
+    return base;
+  char line[256], name[64];
+  size_t entries;
+  int threads;
+  double ns, rate;
+  while (fgets(line, sizeof(line), f)) {
+    if (line[0] == '#')
+      continue;
+    if (sscanf(line, "%63s %zu %d %lf %lf", name, &entries, &threads, &ns, &rate) == 5)
+      base[string(name) + "/" + std::to_string(entries) + "/" + std::to_string(threads)] = ns;
+  }
+  fclose(f);
+  return base;
+}
+
+// layouts the specialized codecs cover, formatted with libbcc's generic
+// printf/scanf and with the codec picked for them
+const char *codec_source =
+    "struct tuple4 { u32 saddr; u32 daddr; u16 sport; u16 dport; u8 proto; };\n"
+    "struct tuple6 { u32 saddr[4]; u32 daddr[4]; u16 sport; u16 dport; u8 proto; };\n"
+    "BPF_TABLE(\"hash\", u32, u64, codec_u32, 16);\n"
+    "BPF_TABLE(\"hash\", u64, u64, codec_u64, 16);\n"
+    "BPF_TABLE(\"hash\", struct tuple4, u64, codec_tuple4, 16);\n"
+    "BPF_TABLE(\"hash\", struct tuple6, u64, codec_tuple6, 16);\n";
+
+struct CodecBench {
+  string name;
+  int id;
+  size_t size;
+  unique_ptr<bcc::TableCodec> codec;
+  vector<vector<uint8_t>> keys;
+  vector<string> texts;
+};
+
+void add_codec_cases(void *mod, map<string, Op> *cases) {
+  static vector<unique_ptr<CodecBench>> benches;
+  uint64_t seed = 0x9e3779b97f4a7c15ull;
+  for (size_t id = 0; id < bpf_num_tables(mod); ++id) {
+    unique_ptr<CodecBench> b(new CodecBench);
+    b->name = string(bpf_table_name(mod, id)).substr(6);
+    b->id = id;
+    b->size = bpf_table_key_size_id(mod, id);
+    b->codec.reset(new bcc::TableCodec(mod, id));
+    for (int k = 0; k < 256; ++k) {
+      vector<uint8_t> key(b->size);
+      for (auto &c : key) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        c = seed >> 56;
+      }
+      string text;
+      b->codec->format_key(&key[0], &text);
+      b->keys.push_back(key);
+      b->texts.push_back(text);
+    }
+    CodecBench *p = &*b;
+    (*cases)["codec_fmt_" + b->name + "_generic"] = [mod, p] (size_t, int, size_t i) {
+      char buf[512];
+      bpf_table_key_snprintf(mod, p->id, buf, p->size * 8, &p->keys[i & 255][0]);
+    };
+    (*cases)["codec_fmt_" + b->name] = [p] (size_t, int, size_t i) {
+      static __thread string *out;
+      if (!out)
+        out = new string;
+      out->clear();
+      p->codec->format_key(&p->keys[i & 255][0], out);
+    };
+    (*cases)["codec_parse_" + b->name + "_generic"] = [mod, p] (size_t, int, size_t i) {
+      uint8_t buf[512];
+      bpf_table_key_sscanf(mod, p->id, p->texts[i & 255].c_str(), buf);
+    };
+    (*cases)["codec_parse_" + b->name] = [p] (size_t, int, size_t i) {
+      uint8_t buf[512];
+      p->codec->parse_key(p->texts[i & 255].c_str(), buf);
+    };
+    benches.push_back(std::move(b));
+  }
+  (*cases)["hex_encode_64_snprintf"] = [] (size_t, int, size_t i) {
+    static uint8_t src[64] = {1, 2, 3};
+    char dst[129];
+    src[0] = i;
+    for (size_t j = 0; j < sizeof(src); ++j)
+      snprintf(dst + 2 * j, 3, "%02x", src[j]);
+  };
+  (*cases)["hex_encode_64"] = [] (size_t, int, size_t i) {
+    static uint8_t src[64] = {1, 2, 3};
+    char dst[128];
+    src[0] = i;
+    bcc::hex_encode(src, sizeof(src), dst);
+  };
+  (*cases)["hex_decode_64"] = [] (size_t, int, size_t i) {
+    static char src[129] = "00112233445566778899aabbccddeeff00112233445566778899AABBCCDDEEFF"
+                           "00112233445566778899aabbccddeeff00112233445566778899aabbccddeeff";
+    uint8_t dst[64];
+    src[0] = '0' + (i & 7);
+    bcc::hex_decode(src, sizeof(dst), dst);
+  };
+}
+
+size_t heap_in_use() {
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+  struct mallinfo2 mi = mallinfo2();
+#else
+  struct mallinfo mi = mallinfo();
+#endif
+  return mi.uordblks + mi.hblkhd;
+}
+
+// heap held by a map directory after listing a map of each size, and after
+// stat'ing its first 1000 entries
+int memory_bench(const vector<size_t> &sizes) {
+  printf("# name                     entries          bytes      bytes/key\n");
+  for (size_t entries : sizes) {
+    string prog = "mem" + std::to_string(entries);
+    string name = "mem_" + std::to_string(entries);
+    string text = "BPF_TABLE(\"hash\", u32, u64, " + name + ", " +
+        std::to_string(entries) + ");\n";
+    if (!load_program(prog, text)) {
+      fprintf(stderr, "setup failed for %zu entries\n", entries);
+      return 1;
+    }
+    bcc::fake::fill(bcc::fake::map_fd(name), entries);
+    string path = "/" + prog + "/maps/" + name;
+    bcc::MapDir *md = map_dir(path);
+    size_t before = heap_in_use();
+    size_t n = 0;
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    md->refresh(true);
+    ops->readdir(path.c_str(), &n, count_filler, 0, &fi);
+    size_t listed = heap_in_use() - before;
+    printf("%-26s %7zu %14zu %14.1f\n", "mem_list", entries, listed, (double)listed / entries);
+    struct stat st;
+    for (size_t i = 0; i < std::min<size_t>(entries, 1000); ++i)
+      ops->getattr((path + "/" + entry_name(i)).c_str(), &st);
+    size_t looked_up = heap_in_use() - before;
+    printf("%-26s %7zu %14zu %14.1f\n", "mem_list_stat1000", entries, looked_up,
+           (double)looked_up / entries);
+    fflush(stdout);
+    // drop the program again, the fake map itself lives on
+    ops->truncate(("/" + prog + "/source").c_str(), 0);
+  }
+  return 0;
+}
+
+void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [--quick] [--filter NAME] [--out FILE] [--baseline FILE]"
+          " [--threshold PCT] [--memory]\n", prog);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options opts;
+  opts.sizes = {1000, 10000, 100000};
+  opts.threads = {1, 2, 4};
+  opts.seconds = 0.25;
+  opts.threshold = 25;
+  opts.memory = false;
+  bool quick = false;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "--quick") {
+      quick = true;
+      opts.sizes = {100, 1000};
+      opts.threads = {1, 2};
+      opts.seconds = 0.02;
+    } else if (arg == "--filter" && i + 1 < argc) {
+      opts.filter = argv[++i];
+    } else if (arg == "--out" && i + 1 < argc) {
+      opts.out = argv[++i];
+    } else if (arg == "--baseline" && i + 1 < argc) {
+      opts.baseline = argv[++i];
+    } else if (arg == "--threshold" && i + 1 < argc) {
+      opts.threshold = atof(argv[++i]);
+    } else if (arg == "--memory") {
+      opts.memory = true;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  char tmpl[] = "/tmp/bcc-bench.XXXXXX";
+  if (!mkdtemp(tmpl)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  bcc::Mount mount;
+  char arg0[] = "bench_fs";
+  char *fuse_argv[] = {arg0, tmpl, nullptr};
+  mount.run(2, fuse_argv);
+  ops = bcc::fake::operations();
+  if (!ops) {
+    fprintf(stderr, "fuse operations were not registered\n");
+    return 1;
+  }
+  if (opts.memory) {
+    int rc = memory_bench(quick ? vector<size_t>{10000} : vector<size_t>{10000, 1000000, 10000000});
+    rmdir(tmpl);
+    return rc;
+  }
+
+  map<string, Op> cases;
+  cases["getattr_source"] = [] (size_t entries, int t, size_t i) {
+    struct stat st;
+    ops->getattr(pathf("/s%zu_t%d/source", entries, t), &st);
+  };
+  cases["getattr_dump"] = [] (size_t entries, int t, size_t i) {
+    struct stat st;
+    ops->getattr((map_path(entries, t) + "/dump").c_str(), &st);
+  };
+  cases["getattr_entry"] = [] (size_t entries, int t, size_t i) {
+    struct stat st;
+    ops->getattr(pathf("/s%zu_t%d/maps/counts_s%zu_t%d/0x%zx", entries, t, entries, t,
+                       i % entries + 1), &st);
+  };
+  cases["getattr_raw_entry"] = [] (size_t entries, int t, size_t i) {
+    struct stat st;
+    uint32_t key = i % entries + 1;
+    char hex[2 * sizeof(key) + 1];
+    bcc::hex_encode((const uint8_t *)&key, sizeof(key), hex);
+    hex[sizeof(hex) - 1] = '\0';
+    ops->getattr(pathf("/s%zu_t%d/maps/counts_s%zu_t%d/raw/%s", entries, t, entries, t, hex),
+                 &st);
+  };
+  cases["readdir_map"] = [] (size_t entries, int t, size_t i) {
+    size_t n = 0;
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    ops->readdir(map_path(entries, t).c_str(), &n, count_filler, 0, &fi);
+  };
+  // what `ls -l` does: a listing, then a getattr per name
+  cases["ls_l_map"] = [] (size_t entries, int t, size_t i) {
+    size_t n = 0;
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    string dir = map_path(entries, t);
+    ops->readdir(dir.c_str(), &n, count_filler, 0, &fi);
+    struct stat st;
+    for (size_t k = 0; k < entries; ++k)
+      ops->getattr((dir + "/" + entry_name(k)).c_str(), &st);
+  };
+  cases["read_dump"] = [] (size_t entries, int t, size_t i) {
+    read_file(map_path(entries, t) + "/dump");
+  };
+  cases["read_metrics"] = [] (size_t entries, int t, size_t i) {
+    if (i == 0)
+      write_file(map_path(entries, t) + "/metrics.conf", "value counter leaf\n");
+    read_file("/" + prog_name(entries, t) + "/metrics");
+  };
+  cases["read_stats"] = [] (size_t entries, int t, size_t i) {
+    read_file(map_path(entries, t) + "/stats");
+  };
+  cases["write_entry"] = [] (size_t entries, int t, size_t i) {
+    write_file(map_path(entries, t) + "/" + entry_name(i % entries), "0x5\n");
+  };
+  cases["write_raw_entry"] = [] (size_t entries, int t, size_t i) {
+    uint64_t leaf = 5;
+    write_file(map_path(entries, t) + "/raw/" + raw_entry_name(i % entries),
+               string((const char *)&leaf, sizeof(leaf)));
+  };
+  // by the directory, an open dump would stay watched for the later cases
+  cases["ioctl_lookup"] = [] (size_t entries, int t, size_t i) {
+    alignas(8) uint8_t bytes[sizeof(bcc_map_io) + 8];
+    bcc_map_io *req = reinterpret_cast<bcc_map_io *>(bytes);
+    uint32_t key = i % entries + 1;
+    req->key_size = 4;
+    req->leaf_size = 8;
+    req->count = 1;
+    memcpy(req->data, &key, 4);
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    ops->ioctl(map_path(entries, t).c_str(), BCC_MAP_IO(BCC_MAP_LOOKUP, sizeof(bytes)), nullptr,
+               &fi, FUSE_IOCTL_DIR, req);
+  };
+  // 100 keys per round trip, against opening 100 entries
+  cases["lookup_batch"] = [] (size_t entries, int t, size_t i) {
+    static __thread char buf[128 * 1024];
+    string keys, path = map_path(entries, t) + "/lookup";
+    for (size_t k = 0; k < 100; ++k)
+      keys += entry_name((i * 100 + k) % entries) + "\n";
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    if (ops->open(path.c_str(), &fi))
+      return;
+    ops->write(path.c_str(), keys.data(), keys.size(), 0, &fi);
+    ops->read(path.c_str(), buf, sizeof(buf), 0, &fi);
+    ops->release(path.c_str(), &fi);
+  };
+  cases["lookup_entries"] = [] (size_t entries, int t, size_t i) {
+    string dir = map_path(entries, t) + "/";
+    for (size_t k = 0; k < 100; ++k)
+      read_file(dir + entry_name((i * 100 + k) % entries));
+  };
+  cases["readdir_raw"] = [] (size_t entries, int t, size_t i) {
+    size_t n = 0;
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    ops->readdir((map_path(entries, t) + "/raw").c_str(), &n, count_filler, 0, &fi);
+  };
+  cases["refresh_map"] = [] (size_t entries, int t, size_t i) {
+    static __thread bcc::MapDir *md;
+    static __thread size_t md_entries;
+    if (!md || md_entries != entries) {
+      md = map_dir(map_path(entries, t));
+      md_entries = entries;
+    }
+    md->refresh(true);
+  };
+  // one modified entry, listed through a changes handle
+  cases["read_changes"] = [] (size_t entries, int t, size_t i) {
+    static __thread struct fuse_file_info fi;
+    static __thread size_t fi_entries;
+    static __thread char buf[128 * 1024];
+    string path = map_path(entries, t) + "/changes";
+    if (fi_entries != entries) {
+      if (fi_entries)
+        ops->release("", &fi);
+      memset(&fi, 0, sizeof(fi));
+      ops->open(path.c_str(), &fi);
+      ops->read(path.c_str(), buf, sizeof(buf), 0, &fi);
+      fi_entries = entries;
+    }
+    bcc::fake::touch(bcc::fake::map_fd(map_name(entries, t)), i % entries);
+    ops->read(path.c_str(), buf, sizeof(buf), 0, &fi);
+  };
+  // the last percent of the keys fill() wrote
+  cases["read_query"] = [] (size_t entries, int t, size_t i) {
+    static __thread size_t query_entries;
+    string path = map_path(entries, t) + "/query";
+    if (query_entries != entries) {
+      write_file(path, "key > " + std::to_string(entries - entries / 100));
+      query_entries = entries;
+    }
+    read_file(path);
+  };
+  // includes filling the map again, which the other cases expect
+  cases["clear_map"] = [] (size_t entries, int t, size_t i) {
+    write_file(map_path(entries, t) + "/clear", "1\n");
+    bcc::fake::fill(bcc::fake::map_fd(map_name(entries, t)), entries);
+  };
+  // four frames taken, read without walking the map
+  cases["read_rate"] = [] (size_t entries, int t, size_t i) {
+    static __thread size_t sample_entries;
+    if (sample_entries != entries) {
+      write_file(map_path(entries, t) + "/sample", "3600000 4");
+      bcc::Sampler *sampler = map_dir(map_path(entries, t))->sampler().get();
+      for (int f = 0; f < 3; ++f) {
+        bcc::fake::touch(bcc::fake::map_fd(map_name(entries, t)), f);
+        sampler->sample();
+      }
+      sample_entries = entries;
+    }
+    read_file(map_path(entries, t) + "/rate");
+  };
+  // what each reader of a published snapshot pays, next to read_dump
+  cases["read_snapshot"] = [] (size_t entries, int t, size_t i) {
+    static __thread const bcc_snapshot *snap;
+    static __thread size_t snap_entries;
+    static __thread vector<uint8_t> *buf;
+    if (snap_entries != entries) {
+      write_file(map_path(entries, t) + "/publish", "3600000");
+      bcc_snapshot_close(snap);
+      snap = bcc_snapshot_map(map_dir(map_path(entries, t))->publisher()->fd());
+      delete buf;
+      buf = new vector<uint8_t>(snap->capacity * (snap->key_size + snap->leaf_size));
+      snap_entries = entries;
+    }
+    bcc_snapshot_read(snap, buf->data(), buf->size(), nullptr);
+  };
+  cases["read_top"] = [] (size_t entries, int t, size_t i) {
+    read_file(map_path(entries, t) + "/top");
+  };
+  // a poll that finds nothing new and waits
+  cases["poll_entry"] = [] (size_t entries, int t, size_t i) {
+    static __thread struct fuse_file_info fi;
+    static __thread size_t fi_entries;
+    string path = map_path(entries, t) + "/" + entry_name(0);
+    if (fi_entries != entries) {
+      char buf[64];
+      if (fi_entries)
+        ops->release("", &fi);
+      memset(&fi, 0, sizeof(fi));
+      ops->open(path.c_str(), &fi);
+      ops->read(path.c_str(), buf, sizeof(buf), 0, &fi);
+      fi_entries = entries;
+    }
+    unsigned revents;
+    ops->poll(path.c_str(), &fi, bcc::fake::poll_handle(), &revents);
+  };
+  // one pass of the watcher over 32 handles waiting on the same dump
+  cases["poll_scan_dump"] = [&mount] (size_t entries, int t, size_t i) {
+    static __thread struct fuse_file_info fis[32];
+    static __thread size_t fi_entries;
+    if (fi_entries != entries) {
+      string path = map_path(entries, t) + "/dump";
+      for (auto &fi : fis) {
+        if (fi_entries)
+          ops->release("", &fi);
+        memset(&fi, 0, sizeof(fi));
+        ops->open(path.c_str(), &fi);
+        static __thread char buf[4096];
+        ops->read(path.c_str(), buf, sizeof(buf), 0, &fi);
+        unsigned revents;
+        ops->poll(path.c_str(), &fi, bcc::fake::poll_handle(), &revents);
+      }
+      fi_entries = entries;
+    }
+    mount.watcher()->scan();
+  };
+
+  map<string, double> base;
+  if (!opts.baseline.empty())
+    base = load_baseline(opts.baseline);
+  FILE *out = opts.out.empty() ? nullptr : fopen(opts.out.c_str(), "w");
+  const char *header =
+      "# name                     entries threads          ns/op          ops/s allocs/op";
+  printf("%s\n", header);
+  if (out)
+    fprintf(out, "%s\n", header);
+
+  // fixed work that no code under test touches, sized like a cheap case
+  Op reference = [] (size_t, int, size_t i) {
+    uint64_t h = i;
+    for (int k = 0; k < 64; ++k)
+      h = h * 6364136223846793005ull + 1442695040888963407ull;
+    asm volatile("" : : "r"(h));
+  };
+  // every case is scaled by it, so it gets more rounds than they do
+  Result ref = run(opts, "reference", 0, 1, reference, 10 * BENCH_ROUNDS);
+  double scale = 0;
+  auto ref_it = base.find("reference/0/1");
+  if (ref_it != base.end())
+    scale = ref.ns_per_op / ref_it->second;
+  else if (!base.empty())
+    fprintf(stderr, "the baseline has no reference case, nothing is compared\n");
+
+  int regressions = 0;
+  auto report = [&] (const Result &r) {
+    string line = format(r);
+    auto it = base.find(r.name + "/" + std::to_string(r.entries) + "/" + std::to_string(r.threads));
+    if (scale && it != base.end() && r.name != "reference") {
+      double pct = (r.ns_per_op / (it->second * scale) - 1) * 100;
+      char delta[64];
+      snprintf(delta, sizeof(delta), " %+7.1f%%%s", pct,
+               pct > opts.threshold ? " REGRESSION" : "");
+      if (pct > opts.threshold)
+        ++regressions;
+      printf("%s%s\n", line.c_str(), delta);
+    } else {
+      printf("%s\n", line.c_str());
+    }
+    fflush(stdout);
+    if (out)
+      fprintf(out, "%s\n", line.c_str());
+  };
+
+  report(ref);
+
+  // cases that do not depend on a map are run once, single threaded
+  map<string, Op> single;
+  void *codec_mod = bpf_module_create_c_from_string(codec_source, 0);
+  if (!codec_mod) {
+    fprintf(stderr, "codec benchmark source did not load\n");
+    return 1;
+  }
+  add_codec_cases(codec_mod, &single);
+  for (auto &c : single) {
+    if (!opts.filter.empty() && c.first.find(opts.filter) == string::npos)
+      continue;
+    report(run(opts, c.first, 0, 1, c.second));
+  }
+
+  if (!check_codecs()) {
+    fprintf(stderr, "a specialized codec did not match libbcc's printf/scanf\n");
+    return 1;
+  }
+  if (!check_hex()) {
+    fprintf(stderr, "hex encode or decode did not round-trip\n");
+    return 1;
+  }
+  if (!check_poll(mount.watcher())) {
+    fprintf(stderr, "poll did not report a changed entry\n");
+    return 1;
+  }
+  if (!check_changes()) {
+    fprintf(stderr, "changes did not list what changed\n");
+    return 1;
+  }
+  if (!check_top()) {
+    fprintf(stderr, "top did not list the largest values\n");
+    return 1;
+  }
+  if (!check_query()) {
+    fprintf(stderr, "query did not select the matching entries\n");
+    return 1;
+  }
+  if (!check_swap()) {
+    fprintf(stderr, "swap or clear did not reset the map\n");
+    return 1;
+  }
+  if (!check_sampler()) {
+    fprintf(stderr, "the sampler did not report per key deltas\n");
+    return 1;
+  }
+  if (!check_cache()) {
+    fprintf(stderr, "the cache policy did not follow the file class\n");
+    return 1;
+  }
+  if (!check_stats()) {
+    fprintf(stderr, "stats did not follow the last count of the map\n");
+    return 1;
+  }
+  if (!check_ioctl()) {
+    fprintf(stderr, "map ioctls did not act on the raw bytes\n");
+    return 1;
+  }
+  if (!check_array()) {
+    fprintf(stderr, "the mapped array did not show the map's values\n");
+    return 1;
+  }
+  if (!check_listing()) {
+    fprintf(stderr, "getattr after a listing did not use the listed sizes\n");
+    return 1;
+  }
+  if (!check_lookup()) {
+    fprintf(stderr, "a batch lookup did not answer its keys in order\n");
+    return 1;
+  }
+  if (!check_metrics()) {
+    fprintf(stderr, "metrics did not render the configured maps\n");
+    return 1;
+  }
+  if (!check_evict()) {
+    fprintf(stderr, "idle map entries were not evicted least recently used first\n");
+    return 1;
+  }
+  if (!check_debounce(&mount)) {
+    fprintf(stderr, "debounced flushes did not merge into one compile\n");
+    return 1;
+  }
+  if (!check_sched()) {
+    fprintf(stderr, "the scheduler did not serve users fairly\n");
+    return 1;
+  }
+  if (!check_publish()) {
+    fprintf(stderr, "the published snapshot did not match the map\n");
+    return 1;
+  }
+  if (!check_reload()) {
+    fprintf(stderr, "reloading the source did not keep unchanged maps\n");
+    return 1;
+  }
+  for (size_t entries : opts.sizes) {
+    for (int nthreads : opts.threads) {
+      if (!setup(entries, nthreads)) {
+        fprintf(stderr, "setup failed for %zu entries\n", entries);
+        return 1;
+      }
+      for (auto &c : cases) {
+        if (!opts.filter.empty() && c.first.find(opts.filter) == string::npos)
+          continue;
+        report(run(opts, c.first, entries, nthreads, c.second));
+      }
+    }
+  }
+  if (out)
+    fclose(out);
+  rmdir(tmpl);
+  return regressions ? 1 : 0;
+}
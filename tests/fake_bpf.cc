@@ -0,0 +1,1007 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fuse.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include <bcc/bpf_common.h>
+#include <bcc/libbpf.h>
+
+#include "fake_bpf.h"
+
+using std::map;
+using std::move;
+using std::mutex;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+// only counted, there is no kernel to wake
+struct fuse_pollhandle {
+};
+
+namespace bcc {
+namespace fake {
+
+namespace {
+
+// C type layout, only as much as the filesystem needs to see
+struct Type {
+  string name;
+  bool is_struct;
+  bool is_signed;
+  size_t size;
+  size_t align;
+  struct Field {
+    string name;
+    const Type *type;
+    size_t count;  // 0 for non-arrays
+    size_t offset;
+  };
+  vector<Field> fields;
+  string desc;
+};
+
+struct Scalar {
+  const char *name;
+  const char *canonical;
+  size_t size;
+  bool is_signed;
+};
+
+const Scalar scalars[] = {
+  {"char", "char", 1, true},
+  {"signed char", "signed char", 1, true},
+  {"unsigned char", "unsigned char", 1, false},
+  {"u8", "unsigned char", 1, false},
+  {"short", "short", 2, true},
+  {"unsigned short", "unsigned short", 2, false},
+  {"u16", "unsigned short", 2, false},
+  {"int", "int", 4, true},
+  {"s32", "int", 4, true},
+  {"unsigned int", "unsigned int", 4, false},
+  {"unsigned", "unsigned int", 4, false},
+  {"u32", "unsigned int", 4, false},
+  {"long", "long", 8, true},
+  {"unsigned long", "unsigned long", 8, false},
+  {"long long", "long long", 8, true},
+  {"s64", "long long", 8, true},
+  {"unsigned long long", "unsigned long long", 8, false},
+  {"u64", "unsigned long long", 8, false},
+};
+
+class FakeMap {
+ public:
+  // arrays live in the memfd, laid out like a BPF_F_MMAPABLE array: 8 byte
+  // aligned values from offset 0, so mapping fd sees the live leaves
+  FakeMap(bpf_map_type type, size_t key_size, size_t leaf_size, size_t max_entries, int fd)
+      : refs(1), ino(0), type_(type), key_size_(key_size), leaf_size_(leaf_size),
+        max_entries_(max_entries), cap_(0), used_(0), tombs_(0), array_(nullptr),
+        array_size_(0) {
+    if (type_ == BPF_MAP_TYPE_ARRAY) {
+      size_t page = sysconf(_SC_PAGESIZE);
+      stride_ = (leaf_size_ + 7) & ~7ul;
+      array_size_ = (stride_ * max_entries_ + page - 1) / page * page;
+      void *mem = MAP_FAILED;
+      if (array_size_ && ftruncate(fd, array_size_) == 0)
+        mem = mmap(nullptr, array_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (mem != MAP_FAILED)
+        array_ = (uint8_t *)mem;
+      else
+        leaves_.assign(stride_ * max_entries_, 0);
+    } else {
+      stride_ = leaf_size_;
+      rehash(16);
+    }
+  }
+
+  ~FakeMap() {
+    if (array_)
+      munmap(array_, array_size_);
+  }
+
+  int lookup(const void *key, void *leaf) {
+    unique_lock<mutex> lock(mtx_);
+    long slot = find(key);
+    if (slot < 0) {
+      errno = ENOENT;
+      return -1;
+    }
+    memcpy(leaf, at(slot), leaf_size_);
+    return 0;
+  }
+
+  int update(const void *key, const void *leaf, unsigned long long flags) {
+    unique_lock<mutex> lock(mtx_);
+    long slot = find(key);
+    if (slot >= 0 && flags == BPF_NOEXIST) {
+      errno = EEXIST;
+      return -1;
+    }
+    if (slot < 0) {
+      if (type_ == BPF_MAP_TYPE_ARRAY || flags == BPF_EXIST) {
+        errno = type_ == BPF_MAP_TYPE_ARRAY ? E2BIG : ENOENT;
+        return -1;
+      }
+      if (used_ >= max_entries_) {
+        if (type_ != BPF_MAP_TYPE_LRU_HASH) {
+          errno = E2BIG;
+          return -1;
+        }
+        evict();
+      }
+      slot = insert(key);
+    }
+    memcpy(at(slot), leaf, leaf_size_);
+    return 0;
+  }
+
+  int erase(const void *key) {
+    unique_lock<mutex> lock(mtx_);
+    if (type_ == BPF_MAP_TYPE_ARRAY) {
+      errno = EINVAL;
+      return -1;
+    }
+    long slot = find(key);
+    if (slot < 0) {
+      errno = ENOENT;
+      return -1;
+    }
+    state_[slot] = tomb_e;
+    --used_;
+    ++tombs_;
+    return 0;
+  }
+
+  int next(const void *key, void *next_key) {
+    unique_lock<mutex> lock(mtx_);
+    if (type_ == BPF_MAP_TYPE_ARRAY) {
+      uint32_t idx = 0;
+      if (key)
+        memcpy(&idx, key, sizeof(idx));
+      if (!key || idx >= max_entries_) {
+        idx = 0;
+      } else if (idx + 1 >= max_entries_) {
+        errno = ENOENT;
+        return -1;
+      } else {
+        ++idx;
+      }
+      memcpy(next_key, &idx, sizeof(idx));
+      return 0;
+    }
+    long slot = key ? find(key) : -1;
+    for (size_t i = slot < 0 ? 0 : slot + 1; i < cap_; ++i) {
+      if (state_[i] == used_e) {
+        memcpy(next_key, &keys_[i * key_size_], key_size_);
+        return 0;
+      }
+    }
+    errno = ENOENT;
+    return -1;
+  }
+
+  size_t size() {
+    unique_lock<mutex> lock(mtx_);
+    return type_ == BPF_MAP_TYPE_ARRAY ? max_entries_ : used_;
+  }
+
+  size_t key_size() const { return key_size_; }
+  size_t leaf_size() const { return leaf_size_; }
+
+  // one per fd slot pointing at the map
+  std::atomic<unsigned> refs;
+  // of the memfd standing in for the map, to tell a live fd from a stale slot
+  ino_t ino;
+
+ private:
+  enum { empty_e, used_e, tomb_e };
+
+  uint8_t * at(size_t slot) {
+    return (array_ ? array_ : &leaves_[0]) + slot * stride_;
+  }
+
+  static size_t hash(const void *key, size_t n) {
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < n; ++i)
+      h = (h ^ p[i]) * 0x100000001b3ull;
+    return h ^ (h >> 29);
+  }
+
+  long find(const void *key) const {
+    if (type_ == BPF_MAP_TYPE_ARRAY) {
+      uint32_t idx;
+      memcpy(&idx, key, sizeof(idx));
+      return idx < max_entries_ ? (long)idx : -1;
+    }
+    for (size_t i = hash(key, key_size_) & (cap_ - 1);; i = (i + 1) & (cap_ - 1)) {
+      if (state_[i] == empty_e)
+        return -1;
+      if (state_[i] == used_e && !memcmp(&keys_[i * key_size_], key, key_size_))
+        return i;
+    }
+  }
+
+  long insert(const void *key) {
+    if ((used_ + tombs_ + 1) * 2 > cap_)
+      rehash(used_ * 4 > cap_ ? cap_ * 2 : cap_);
+    size_t i = hash(key, key_size_) & (cap_ - 1);
+    while (state_[i] == used_e)
+      i = (i + 1) & (cap_ - 1);
+    if (state_[i] == tomb_e)
+      --tombs_;
+    state_[i] = used_e;
+    memcpy(&keys_[i * key_size_], key, key_size_);
+    ++used_;
+    return i;
+  }
+
+  void evict() {
+    for (size_t i = 0; i < cap_; ++i) {
+      if (state_[i] == used_e) {
+        state_[i] = tomb_e;
+        --used_;
+        ++tombs_;
+        return;
+      }
+    }
+  }
+
+  void rehash(size_t cap) {
+    vector<uint8_t> state(move(state_)), keys(move(keys_)), leaves(move(leaves_));
+    size_t old_cap = cap_;
+    cap_ = cap;
+    used_ = tombs_ = 0;
+    state_.assign(cap_, empty_e);
+    keys_.assign(cap_ * key_size_, 0);
+    leaves_.assign(cap_ * leaf_size_, 0);
+    for (size_t i = 0; i < old_cap; ++i) {
+      if (state[i] != used_e)
+        continue;
+      long slot = insert(&keys[i * key_size_]);
+      memcpy(&leaves_[slot * leaf_size_], &leaves[i * leaf_size_], leaf_size_);
+    }
+  }
+
+  mutex mtx_;
+  bpf_map_type type_;
+  size_t key_size_;
+  size_t leaf_size_;
+  size_t max_entries_;
+  size_t cap_;
+  size_t used_;
+  size_t tombs_;
+  size_t stride_;
+  uint8_t *array_;
+  size_t array_size_;
+  vector<uint8_t> state_;
+  vector<uint8_t> keys_;
+  vector<uint8_t> leaves_;
+};
+
+struct Table {
+  string name;
+  bpf_map_type type;
+  const Type *key;
+  const Type *leaf;
+  size_t max_entries;
+  int fd;
+};
+
+struct Function {
+  string name;
+  vector<bpf_insn> insns;
+};
+
+struct Module {
+  map<string, unique_ptr<Type>> types;
+  vector<Table> tables;
+  vector<Function> functions;
+  string license;
+};
+
+// Maps live as long as their fd, like the kernel objects they stand in for,
+// so they are indexed by fd rather than owned by a module. A slot is only
+// recycled when the fd number is handed out again; dup() shares the map
+// between both slots.
+const size_t max_fds = 1 << 16;
+std::atomic<FakeMap *> maps[max_fds];
+mutex names_mtx;
+map<string, int> names;
+const struct fuse_operations *fuse_ops;
+void *fuse_private_data;
+std::atomic<size_t> poll_notified(0);
+std::atomic<size_t> poll_live(0);
+
+FakeMap * get_map(int fd) {
+  if (fd < 0 || (size_t)fd >= max_fds)
+    return nullptr;
+  return maps[fd].load(std::memory_order_acquire);
+}
+
+bool live_map(int fd) {
+  FakeMap *m = get_map(fd);
+  struct stat st;
+  return m && fstat(fd, &st) == 0 && st.st_ino == m->ino;
+}
+
+void put_map(FakeMap *m) {
+  if (m && --m->refs == 0)
+    delete m;
+}
+
+int create_map(const string &name, bpf_map_type type, size_t key_size, size_t leaf_size,
+               size_t max_entries) {
+  int fd = memfd_create("fake_bpf_map", MFD_CLOEXEC);
+  if (fd < 0 || (size_t)fd >= max_fds)
+    return -1;
+  FakeMap *m = new FakeMap(type, key_size, leaf_size, max_entries, fd);
+  struct stat st;
+  if (fstat(fd, &st) == 0)
+    m->ino = st.st_ino;
+  put_map(maps[fd].exchange(m));
+  unique_lock<mutex> lock(names_mtx);
+  names[name] = fd;
+  return fd;
+}
+
+// Tiny tokenizer/parser for the supported C subset
+class Parser {
+ public:
+  Parser(const char *text, Module *mod) : p_(text), mod_(mod) {}
+
+  bool parse() {
+    for (;;) {
+      skip();
+      if (!*p_)
+        return true;
+      if (accept("struct")) {
+        if (!parse_struct())
+          return false;
+      } else if (accept("BPF_TABLE")) {
+        if (!parse_table())
+          return false;
+      } else if (accept("int")) {
+        if (!parse_function())
+          return false;
+      } else {
+        return false;
+      }
+    }
+  }
+
+ private:
+  void skip() {
+    for (;;) {
+      while (isspace(*p_))
+        ++p_;
+      if (p_[0] == '/' && p_[1] == '/') {
+        while (*p_ && *p_ != '\n')
+          ++p_;
+      } else if (*p_ == '#') {
+        while (*p_ && *p_ != '\n')
+          ++p_;
+      } else {
+        return;
+      }
+    }
+  }
+
+  bool accept(const char *tok) {
+    skip();
+    size_t n = strlen(tok);
+    if (strncmp(p_, tok, n) || isalnum(p_[n]) || p_[n] == '_')
+      return false;
+    p_ += n;
+    return true;
+  }
+
+  bool accept_char(char c) {
+    skip();
+    if (*p_ != c)
+      return false;
+    ++p_;
+    return true;
+  }
+
+  string ident() {
+    skip();
+    const char *s = p_;
+    while (isalnum(*p_) || *p_ == '_')
+      ++p_;
+    return string(s, p_);
+  }
+
+  long number() {
+    skip();
+    char *end;
+    long v = strtol(p_, &end, 0);
+    p_ = end;
+    return v;
+  }
+
+  const Type * parse_type() {
+    if (accept("struct")) {
+      auto it = mod_->types.find("struct " + ident());
+      return it == mod_->types.end() ? nullptr : &*it->second;
+    }
+    // integer types may be several words long, match the longest
+    skip();
+    const Scalar *best = nullptr;
+    for (auto &s : scalars) {
+      size_t n = strlen(s.name);
+      if (!strncmp(p_, s.name, n) && !isalnum(p_[n]) && p_[n] != '_')
+        if (!best || n > strlen(best->name))
+          best = &s;
+    }
+    if (!best)
+      return nullptr;
+    p_ += strlen(best->name);
+    string key = best->canonical;
+    auto &t = mod_->types[key];
+    if (!t) {
+      t.reset(new Type);
+      t->name = key;
+      t->is_struct = false;
+      t->is_signed = best->is_signed;
+      t->size = t->align = best->size;
+      t->desc = "\"" + key + "\"";
+    }
+    return &*t;
+  }
+
+  bool parse_struct() {
+    string name = ident();
+    if (!accept_char('{'))
+      return false;
+    unique_ptr<Type> t(new Type);
+    t->name = name;
+    t->is_struct = true;
+    t->is_signed = false;
+    t->size = 0;
+    t->align = 1;
+    t->desc = "[\"" + name + "\", [";
+    while (!accept_char('}')) {
+      Type::Field f;
+      f.type = parse_type();
+      if (!f.type)
+        return false;
+      f.name = ident();
+      f.count = 0;
+      if (accept_char('[')) {
+        f.count = number();
+        if (!accept_char(']'))
+          return false;
+      }
+      if (!accept_char(';'))
+        return false;
+      size_t align = f.type->align;
+      f.offset = (t->size + align - 1) / align * align;
+      t->size = f.offset + f.type->size * (f.count ? f.count : 1);
+      t->align = std::max(t->align, align);
+      if (!t->fields.empty())
+        t->desc += ", ";
+      t->desc += "[\"" + f.name + "\", " + f.type->desc;
+      if (f.count)
+        t->desc += ", [" + std::to_string(f.count) + "]";
+      t->desc += "]";
+      t->fields.push_back(f);
+    }
+    accept_char(';');
+    t->size = (t->size + t->align - 1) / t->align * t->align;
+    t->desc += "], \"struct\"]";
+    mod_->types["struct " + name] = move(t);
+    return true;
+  }
+
+  bool parse_table() {
+    if (!accept_char('(') || !accept_char('"'))
+      return false;
+    string kind = ident();
+    if (!accept_char('"') || !accept_char(','))
+      return false;
+    Table table;
+    table.key = parse_type();
+    if (!table.key || !accept_char(','))
+      return false;
+    table.leaf = parse_type();
+    if (!table.leaf || !accept_char(','))
+      return false;
+    table.name = ident();
+    if (!accept_char(','))
+      return false;
+    table.max_entries = number();
+    if (!accept_char(')'))
+      return false;
+    accept_char(';');
+    if (kind == "hash")
+      table.type = BPF_MAP_TYPE_HASH;
+    else if (kind == "lru_hash")
+      table.type = BPF_MAP_TYPE_LRU_HASH;
+    else if (kind == "array")
+      table.type = BPF_MAP_TYPE_ARRAY;
+    else
+      return false;
+    if (table.type == BPF_MAP_TYPE_ARRAY && table.key->size != sizeof(uint32_t))
+      return false;
+    table.fd = -1;
+    mod_->tables.push_back(table);
+    return true;
+  }
+
+  bool parse_function() {
+    Function fn;
+    fn.name = ident();
+    if (!accept_char('('))
+      return false;
+    while (*p_ && *p_ != '{')
+      ++p_;
+    const char *body = p_;
+    int depth = 0;
+    do {
+      if (*p_ == '{')
+        ++depth;
+      else if (*p_ == '}')
+        --depth;
+      else if (!*p_)
+        return false;
+      ++p_;
+    } while (depth > 0);
+    string text(body, p_);
+    // every function references every table, the way a real program's
+    // ld_imm64 map relocations would; an unbounded loop is a verifier error
+    for (size_t i = 0; i < mod_->tables.size(); ++i) {
+      bpf_insn ld[2];
+      memset(ld, 0, sizeof(ld));
+      ld[0].code = BPF_LD | BPF_DW | BPF_IMM;
+      ld[0].dst_reg = BPF_REG_1;
+      ld[0].src_reg = BPF_PSEUDO_MAP_FD;
+      ld[0].imm = i;
+      fn.insns.push_back(ld[0]);
+      fn.insns.push_back(ld[1]);
+    }
+    bpf_insn ret[2];
+    memset(ret, 0, sizeof(ret));
+    ret[0].code = BPF_ALU64 | BPF_MOV | BPF_K;
+    ret[0].dst_reg = BPF_REG_0;
+    ret[1].code = BPF_JMP | BPF_EXIT;
+    if (text.find("for (;;)") != string::npos) {
+      ret[1].code = BPF_JMP | BPF_JA;
+      ret[1].off = -2;
+    }
+    fn.insns.push_back(ret[0]);
+    fn.insns.push_back(ret[1]);
+    mod_->functions.push_back(move(fn));
+    return true;
+  }
+
+  const char *p_;
+  Module *mod_;
+};
+
+uint64_t load_int(const uint8_t *p, size_t size) {
+  uint64_t v = 0;
+  memcpy(&v, p, size);
+  return v;
+}
+
+void store_int(uint8_t *p, size_t size, uint64_t v) {
+  memcpy(p, &v, size);
+}
+
+// same text form as the printf/scanf functions generated by libbcc:
+// integers as hex, structs as "{ a b }" and arrays as "[ a b ]"
+void format(const Type *t, const uint8_t *p, string *out) {
+  char buf[32];
+  if (!t->is_struct) {
+    snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)load_int(p, t->size));
+    out->append(buf);
+    return;
+  }
+  out->append("{ ");
+  for (auto &f : t->fields) {
+    if (f.count) {
+      out->append("[ ");
+      for (size_t i = 0; i < f.count; ++i) {
+        format(f.type, p + f.offset + i * f.type->size, out);
+        out->push_back(' ');
+      }
+      out->append("]");
+    } else {
+      format(f.type, p + f.offset, out);
+    }
+    out->push_back(' ');
+  }
+  out->append("}");
+}
+
+bool scan(const Type *t, const char **s, uint8_t *p) {
+  while (isspace(**s))
+    ++*s;
+  if (!t->is_struct) {
+    char *end;
+    errno = 0;
+    uint64_t v = **s == '-' ? (uint64_t)strtoll(*s, &end, 0) : strtoull(*s, &end, 0);
+    if (end == *s || errno)
+      return false;
+    *s = end;
+    store_int(p, t->size, v);
+    return true;
+  }
+  if (**s != '{')
+    return false;
+  ++*s;
+  for (auto &f : t->fields) {
+    if (f.count) {
+      while (isspace(**s))
+        ++*s;
+      if (**s != '[')
+        return false;
+      ++*s;
+      for (size_t i = 0; i < f.count; ++i)
+        if (!scan(f.type, s, p + f.offset + i * f.type->size))
+          return false;
+      while (isspace(**s))
+        ++*s;
+      if (**s != ']')
+        return false;
+      ++*s;
+    } else if (!scan(f.type, s, p + f.offset)) {
+      return false;
+    }
+  }
+  while (isspace(**s))
+    ++*s;
+  if (**s != '}')
+    return false;
+  ++*s;
+  return true;
+}
+
+int table_snprintf(const Type *t, char *buf, size_t buflen, const void *data) {
+  string s;
+  format(t, (const uint8_t *)data, &s);
+  if (s.size() >= buflen)
+    return -1;
+  memcpy(buf, s.c_str(), s.size() + 1);
+  return 0;
+}
+
+int table_sscanf(const Type *t, const char *buf, void *data) {
+  memset(data, 0, t->size);
+  if (!scan(t, &buf, (uint8_t *)data))
+    return -1;
+  while (isspace(*buf))
+    ++buf;
+  return *buf ? -1 : 0;
+}
+
+Module * mod(void *program) { return static_cast<Module *>(program); }
+
+const Table * table(void *program, size_t id) {
+  Module *m = mod(program);
+  return id < m->tables.size() ? &m->tables[id] : nullptr;
+}
+
+}  // namespace
+
+const struct fuse_operations * operations() { return fuse_ops; }
+
+struct fuse_pollhandle * poll_handle() {
+  ++poll_live;
+  return new fuse_pollhandle;
+}
+
+size_t poll_notifications() { return poll_notified.load(); }
+
+size_t poll_handles() { return poll_live.load(); }
+
+int map_fd(const string &table) {
+  unique_lock<mutex> lock(names_mtx);
+  auto it = names.find(table);
+  return it == names.end() ? -1 : it->second;
+}
+
+void fill(int fd, size_t n) {
+  FakeMap *m = get_map(fd);
+  if (!m)
+    return;
+  vector<uint8_t> key(m->key_size()), leaf(m->leaf_size());
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t k = i + 1, v = (i + 1) * 7;
+    memcpy(&key[0], &k, std::min(sizeof(k), key.size()));
+    memcpy(&leaf[0], &v, std::min(sizeof(v), leaf.size()));
+    if (m->update(&key[0], &leaf[0], BPF_ANY))
+      return;
+  }
+}
+
+size_t map_size(int fd) {
+  FakeMap *m = get_map(fd);
+  return m ? m->size() : 0;
+}
+
+void touch(int fd, size_t i) {
+  FakeMap *m = get_map(fd);
+  if (!m)
+    return;
+  vector<uint8_t> key(m->key_size()), leaf(m->leaf_size());
+  uint64_t k = i + 1;
+  memcpy(&key[0], &k, std::min(sizeof(k), key.size()));
+  if (m->lookup(&key[0], &leaf[0]))
+    return;
+  ++leaf[0];
+  m->update(&key[0], &leaf[0], BPF_EXIST);
+}
+
+}  // namespace fake
+}  // namespace bcc
+
+using namespace bcc::fake;
+
+extern "C" {
+
+// map fds stay usable when duplicated, as they do in the kernel
+int dup(int fd) noexcept {
+  int nfd = syscall(SYS_dup, fd);
+  if (nfd < 0 || (size_t)nfd >= max_fds)
+    return nfd;
+  FakeMap *m = get_map(fd);
+  if (m)
+    ++m->refs;
+  put_map(maps[nfd].exchange(m));
+  return nfd;
+}
+
+// libbcc module api
+
+void * bpf_module_create_c_from_string(const char *text, unsigned flags) {
+  unique_ptr<Module> m(new Module);
+  m->license = "GPL";
+  if (!Parser(text, &*m).parse())
+    return nullptr;
+  for (auto &t : m->tables) {
+    t.fd = create_map(t.name, t.type, t.key->size, t.leaf->size, t.max_entries);
+    if (t.fd < 0)
+      return nullptr;
+  }
+  for (auto &fn : m->functions)
+    for (auto &insn : fn.insns)
+      if (insn.src_reg == BPF_PSEUDO_MAP_FD)
+        insn.imm = m->tables[insn.imm].fd;
+  return m.release();
+}
+
+// like libbcc, the table fds go with the module
+void bpf_module_destroy(void *program) {
+  for (auto &t : mod(program)->tables)
+    close(t.fd);
+  delete mod(program);
+}
+
+char * bpf_module_license(void *program) {
+  return &mod(program)->license[0];
+}
+
+unsigned bpf_module_kern_version(void *program) {
+  return 0;
+}
+
+size_t bpf_num_functions(void *program) {
+  return mod(program)->functions.size();
+}
+
+const char * bpf_function_name(void *program, size_t id) {
+  return mod(program)->functions.at(id).name.c_str();
+}
+
+void * bpf_function_start_id(void *program, size_t id) {
+  return &mod(program)->functions.at(id).insns[0];
+}
+
+size_t bpf_function_size_id(void *program, size_t id) {
+  return mod(program)->functions.at(id).insns.size() * sizeof(bpf_insn);
+}
+
+size_t bpf_num_tables(void *program) {
+  return mod(program)->tables.size();
+}
+
+size_t bpf_table_id(void *program, const char *table_name) {
+  Module *m = mod(program);
+  for (size_t i = 0; i < m->tables.size(); ++i)
+    if (m->tables[i].name == table_name)
+      return i;
+  return ~0ul;
+}
+
+int bpf_table_fd_id(void *program, size_t id) {
+  const Table *t = table(program, id);
+  return t ? t->fd : -1;
+}
+
+int bpf_table_fd(void *program, const char *table_name) {
+  return bpf_table_fd_id(program, bpf_table_id(program, table_name));
+}
+
+int bpf_table_type_id(void *program, size_t id) {
+  const Table *t = table(program, id);
+  return t ? t->type : -1;
+}
+
+size_t bpf_table_max_entries_id(void *program, size_t id) {
+  const Table *t = table(program, id);
+  return t ? t->max_entries : 0;
+}
+
+const char * bpf_table_name(void *program, size_t id) {
+  const Table *t = table(program, id);
+  return t ? t->name.c_str() : nullptr;
+}
+
+const char * bpf_table_key_desc_id(void *program, size_t id) {
+  const Table *t = table(program, id);
+  return t ? t->key->desc.c_str() : nullptr;
+}
+
+const char * bpf_table_leaf_desc_id(void *program, size_t id) {
+  const Table *t = table(program, id);
+  return t ? t->leaf->desc.c_str() : nullptr;
+}
+
+size_t bpf_table_key_size_id(void *program, size_t id) {
+  const Table *t = table(program, id);
+  return t ? t->key->size : 0;
+}
+
+size_t bpf_table_leaf_size_id(void *program, size_t id) {
+  const Table *t = table(program, id);
+  return t ? t->leaf->size : 0;
+}
+
+int bpf_table_key_snprintf(void *program, size_t id, char *buf, size_t buflen, const void *key) {
+  const Table *t = table(program, id);
+  return t ? table_snprintf(t->key, buf, buflen, key) : -1;
+}
+
+int bpf_table_leaf_snprintf(void *program, size_t id, char *buf, size_t buflen, const void *leaf) {
+  const Table *t = table(program, id);
+  return t ? table_snprintf(t->leaf, buf, buflen, leaf) : -1;
+}
+
+int bpf_table_key_sscanf(void *program, size_t id, const char *buf, void *key) {
+  const Table *t = table(program, id);
+  return t ? table_sscanf(t->key, buf, key) : -1;
+}
+
+int bpf_table_leaf_sscanf(void *program, size_t id, const char *buf, void *leaf) {
+  const Table *t = table(program, id);
+  return t ? table_sscanf(t->leaf, buf, leaf) : -1;
+}
+
+// libbpf
+
+int bpf_create_map(enum bpf_map_type map_type, int key_size, int value_size, int max_entries) {
+  return create_map("", map_type, key_size, value_size, max_entries);
+}
+
+int bpf_update_elem(int fd, void *key, void *value, unsigned long long flags) {
+  FakeMap *m = get_map(fd);
+  if (!m) {
+    errno = EBADF;
+    return -1;
+  }
+  return m->update(key, value, flags);
+}
+
+int bpf_lookup_elem(int fd, void *key, void *value) {
+  FakeMap *m = get_map(fd);
+  if (!m) {
+    errno = EBADF;
+    return -1;
+  }
+  return m->lookup(key, value);
+}
+
+int bpf_delete_elem(int fd, void *key) {
+  FakeMap *m = get_map(fd);
+  if (!m) {
+    errno = EBADF;
+    return -1;
+  }
+  return m->erase(key);
+}
+
+int bpf_get_next_key(int fd, void *key, void *next_key) {
+  FakeMap *m = get_map(fd);
+  if (!m) {
+    errno = EBADF;
+    return -1;
+  }
+  return m->next(key, next_key);
+}
+
+int bpf_prog_load(enum bpf_prog_type prog_type, const struct bpf_insn *insns, int insn_len,
+                  const char *license, unsigned kern_version, char *log_buf, unsigned log_buf_size) {
+  if (log_buf && log_buf_size)
+    log_buf[0] = '\0';
+  if (insn_len <= 0 || insn_len % sizeof(*insns)) {
+    errno = EINVAL;
+    return -1;
+  }
+  int n = insn_len / sizeof(*insns);
+  for (int i = 0; i < n; ++i) {
+    if (insns[i].code == (BPF_JMP | BPF_JA) && insns[i].off < 0) {
+      snprintf(log_buf, log_buf_size, "back-edge from insn %d to %d\n", i, i + 1 + insns[i].off);
+      errno = EINVAL;
+      return -1;
+    }
+    if (insns[i].code == (BPF_LD | BPF_IMM | BPF_DW) && insns[i].src_reg == BPF_PSEUDO_MAP_FD &&
+        !live_map(insns[i].imm)) {
+      snprintf(log_buf, log_buf_size, "fd %d is not pointing to valid bpf_map\n", insns[i].imm);
+      errno = EBADF;
+      return -1;
+    }
+  }
+  return memfd_create("fake_bpf_prog", MFD_CLOEXEC);
+}
+
+// fuse runtime: capture the operations instead of mounting
+
+int fuse_main_real(int argc, char *argv[], const struct fuse_operations *op, size_t op_size,
+                   void *user_data) {
+  fuse_ops = op;
+  fuse_private_data = user_data;
+  return 0;
+}
+
+int fuse_notify_poll(struct fuse_pollhandle *ph) {
+  ++poll_notified;
+  return 0;
+}
+
+void fuse_pollhandle_destroy(struct fuse_pollhandle *ph) {
+  --poll_live;
+  delete ph;
+}
+
+struct fuse_context * fuse_get_context(void) {
+  static __thread struct fuse_context ctx;
+  ctx.private_data = fuse_private_data;
+  ctx.uid = getuid();
+  ctx.gid = getgid();
+  ctx.pid = getpid();
+  return &ctx;
+}
+
+}  // extern "C"
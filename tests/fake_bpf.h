@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2015 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// In-process stand-in for libbcc, the libbpf map syscalls and the fuse
+// runtime, so that the filesystem classes can be driven without root or a
+// BPF capable kernel.
+//
+// The fake "compiler" understands a small subset of C:
+//   struct NAME { TYPE field; TYPE field[N]; ... };
+//   BPF_TABLE("hash"|"array", KEY_TYPE, LEAF_TYPE, name, max_entries);
+//   int function(...) { ... }
+// where TYPE is an integer type or a previously declared struct.
+
+extern "C" {
+struct fuse_operations;
+struct fuse_pollhandle;
+}
+
+namespace bcc {
+namespace fake {
+
+// operations table handed to fuse_main() by Mount::run()
+const struct fuse_operations * operations();
+
+// fd of the most recently created table with this name, or -1
+int map_fd(const std::string &table);
+
+// insert n entries with keys derived from 1..n and a non-zero value
+void fill(int fd, size_t n);
+
+// number of entries currently stored in the map
+size_t map_size(int fd);
+
+// modify the value stored under the i'th key written by fill()
+void touch(int fd, size_t i);
+
+// a poll handle as the kernel would pass to the poll operation
+struct fuse_pollhandle * poll_handle();
+
+// fuse_notify_poll() calls so far
+size_t poll_notifications();
+
+// poll handles not destroyed yet
+size_t poll_handles();
+
+}  // namespace fake
+}  // namespace bcc
@@ -6,7 +6,6 @@ import fcntl
 import os
 from subprocess import call
 import sys
-import time
 
 bcc = ctypes.CDLL("libbccclient.so")
 bcc.bcc_recv_fd.restype = int
@@ -52,8 +51,6 @@ int hello(void *ctx) {
 with open("/run/bcc/foo/functions/hello/type", "w") as f:
     f.write('kprobe')
 
-# Pause here due to fuse race condition, TBD soon
-time.sleep(0.2)
 fd = bcc.bcc_recv_fd(b"/run/bcc/foo/functions/hello/fd")
 
 if fd < 0: raise Exception("invalid fd %d" % fd)